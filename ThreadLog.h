@@ -2,539 +2,6864 @@
 #define THREADLOG_H
 
 #include <cstdio>
+#include <cerrno>
 #include <cstdarg>
 #include <cstring>
+#include <cstdint>
+#include <climits>
+#include <ctime>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fnmatch.h>
+#include <csignal>
+#if defined (__x86_64__) || defined (__i386__)
+#include <x86intrin.h>
+#endif
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#include <linux/futex.h>
+#if defined (LOG_ZLIB)
+#include <zlib.h>
+#endif
+#include <dirent.h>
 
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
 #include <string>
+#include <string_view>
 #include <vector>
-#include <sstream>
+#include <array>
+#include <tuple>
+#include <charconv>
+#include <type_traits>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
 
 #define ModuleName "MyModule" // set customized log title
 
-// comment out next line if you do NOT want to save log to file
+// comment out next line if you do NOT want to save log to file, or build with -DLOG_NO_FILE
+#ifndef LOG_NO_FILE
 #define SAVE_LOG_TO_FILE
+#endif
 #define LOG_FILE "/tmp/MyModule.log" // old log will be saved as /tmp/MyModule.log.1 /tmp/MyModule.log.2 /tmp/MyModule.log.3 ...
 #define LOG_ROTATE_NUM 5
 #define LOG_FILE_SIZE_LIMIT (1*1024*1024) // bytes
+#ifndef LOG_FILE_CHECK_MS
+#define LOG_FILE_CHECK_MS 1000 // how often the open log file is checked for deletion or renaming
+#endif
+
+// when LOG_ROTATE_BYTES is not 0 rotated files are kept, newest first, while their total size fits in it
+// (the newest one is always kept) and LOG_ROTATE_NUM is not used
+#ifndef LOG_ROTATE_BYTES
+#define LOG_ROTATE_BYTES 0
+#endif
+
+// uncomment next line to gzip rotated files to /tmp/MyModule.log.1.gz ... on the rotation thread, the writer
+// only renames the full file and never waits for it; zlib is used when LOG_ZLIB is defined (CMake defines it
+// when it finds zlib), else a built-in deflate encoder whose files are bigger but read by any zcat or gunzip
+// #define LOG_COMPRESS
+#ifndef LOG_COMPRESS_LEVEL
+#define LOG_COMPRESS_LEVEL 6 // 1 (fast) .. 9 (small)
+#endif
+
+// uncomment next line to write a sparse index next to every rotated text file (/tmp/MyModule.log.1.idx ...)
+// on the rotation thread: offset, time range, levels and a thread id bloom filter of every LOG_INDEX_RECORDS
+// records, used by tools/threadlog-query to skip the blocks a query can not match
+// #define LOG_INDEX
+#ifndef LOG_INDEX_RECORDS
+#define LOG_INDEX_RECORDS 256
+#endif
+
+// uncomment next line to write log files through mmap(): every file is fallocate()d to LOG_FILE_SIZE_LIMIT,
+// a record reserves its bytes with one atomic add and is copied in without a syscall or PrintLock,
+// the file is cut to its used length when it is rotated or closed (a crash leaves a zero tail, cut on reopen)
+// #define LOG_FILE_MMAP
+
+// when the log file is fdatasync()ed after a batch of records was written: never (the kernel writes the page
+// cache back), after every batch, once LOG_FSYNC_EVERY_BYTES were written since the last sync or with the first
+// batch LOG_FSYNC_EVERY_MS after it; batches with an ERROR record are synced before their writers return
+// unless LOG_FSYNC_ERRORS is 0
+#define LOG_FSYNC_NONE     0
+#define LOG_FSYNC_ALWAYS   1
+#define LOG_FSYNC_BYTES    2
+#define LOG_FSYNC_INTERVAL 3
+#ifndef LOG_FSYNC
+#define LOG_FSYNC LOG_FSYNC_NONE
+#endif
+#ifndef LOG_FSYNC_EVERY_BYTES
+#define LOG_FSYNC_EVERY_BYTES (1024*1024)
+#endif
+#ifndef LOG_FSYNC_EVERY_MS
+#define LOG_FSYNC_EVERY_MS 1000
+#endif
+#ifndef LOG_FSYNC_ERRORS
+#define LOG_FSYNC_ERRORS 1
+#endif
+
+// uncomment next line when several processes log to the same LOG_FILE: records go through a POSIX shared memory
+// ring and only one process writes and rotates the file. every process competes to be that writer unless
+// LOG_SHARED_ELECT is 0, then tools/threadlog-writerd writes it; a new writer is elected when it dies.
+// the ring (/dev/shm/threadlog.tmp.MyModule.log) outlives the processes, threadlog-writerd --unlink removes it
+// #define LOG_SHARED
+#ifndef LOG_SHARED_RING_SIZE
+#define LOG_SHARED_RING_SIZE (4*1024*1024) // bytes, must be a power of 2
+#endif
+#ifndef LOG_SHARED_ELECT
+#define LOG_SHARED_ELECT 1
+#endif
+#ifndef LOG_SHARED_ELECT_MS
+#define LOG_SHARED_ELECT_MS 100 // how often a waiting process tries to become the writer
+#endif
+#ifndef LOG_SHARED_FULL_MS
+#define LOG_SHARED_FULL_MS 100 // how long a record waits for room in a full ring before it is dropped
+#endif
+#ifndef LOG_SHARED_STALL_MS
+#define LOG_SHARED_STALL_MS 1000 // an entry reserved by a producer that died is skipped after this
+#endif
+#ifndef LOG_SHARED_EXIT_MS
+#define LOG_SHARED_EXIT_MS 1000 // how long an exiting process waits for its records to be written
+#endif
+
+// uncomment next line to submit every batch and its fdatasync() as one linked io_uring submission,
+// writev() and fdatasync() are used when the kernel or <linux/io_uring.h> has no io_uring
+// #define LOG_IO_URING
+
+// when LOG_FILE_MMAP records are forced to disk, they are in the page cache at once in every mode:
+// NONE leaves it to the kernel writeback, INTERVAL msync()s every LOG_MMAP_SYNC_MS from the writer that
+// finds it due and ALWAYS msync()s every write before it returns
+#define LOG_MMAP_SYNC_NONE     0
+#define LOG_MMAP_SYNC_INTERVAL 1
+#define LOG_MMAP_SYNC_ALWAYS   2
+#ifndef LOG_MMAP_SYNC
+#define LOG_MMAP_SYNC LOG_MMAP_SYNC_INTERVAL
+#endif
+#ifndef LOG_MMAP_SYNC_MS
+#define LOG_MMAP_SYNC_MS 1000
+#endif
+
+#define LOG_COLOR_OFF  0
+#define LOG_COLOR_ON   1
+#define LOG_COLOR_AUTO 2 // color only when the sink is a terminal
+
+// minimum level and color of the default sinks, e.g. -DLOG_STDERR_LEVEL=ERROR_LEVEL keeps stderr for errors,
+// more sinks (Unix datagram socket, callback) are added with LogSinks::add()
+#ifndef LOG_STDERR_LEVEL
+#define LOG_STDERR_LEVEL DEBUG_LEVEL
+#endif
+#ifndef LOG_STDERR_COLOR
+#define LOG_STDERR_COLOR LOG_COLOR_AUTO
+#endif
+#ifndef LOG_FILE_LEVEL
+#define LOG_FILE_LEVEL DEBUG_LEVEL
+#endif
+#ifndef LOG_FILE_COLOR
+#define LOG_FILE_COLOR LOG_COLOR_OFF
+#endif
+
+#define LOG_OVERFLOW_BLOCK       0 // caller waits until the drain thread makes room
+#define LOG_OVERFLOW_DROP_NEWEST 1 // the record being logged is discarded
+#define LOG_OVERFLOW_DROP_OLDEST 2 // the oldest queued records are discarded to make room
+
+// uncomment next line to store INFO/DEBUG records unformatted in LOG_FILE, read it with threadlog-decode
+// #define LOG_BINARY
+
+// layout of text records: the colored and indented call tree, or one JSON object / logfmt line per record
+// with ts, level, module, tid, depth, func, file, line, msg and the LOG_CALL arguments as typed fields
+#define LOG_FORMAT_TEXT   0
+#define LOG_FORMAT_JSON   1
+#define LOG_FORMAT_LOGFMT 2
+#ifndef LOG_FORMAT
+#define LOG_FORMAT LOG_FORMAT_TEXT // e.g. -DLOG_FORMAT=LOG_FORMAT_JSON
+#endif
+
+// uncomment next line to time every LOG_CALL*/LOG_SCOPE, the elapsed time is printed on the "} func" line
+// and per site statistics are reported by Profiler::dump()
+// #define LOG_PROFILE
+#ifndef LOG_PROFILE_SLOTS
+#define LOG_PROFILE_SLOTS 256 // distinct sites profiled per thread
+#endif
+#define LOG_PROFILE_BUCKETS 32 // log2 latency histogram, 1 ns .. 2 s and above
+
+// uncomment next line to keep a shadow stack of the LOG_CALL*/LOG_SCOPE frames of every thread,
+// ShadowStack::dump() or ShadowStack::install_signal() print the current stacks of all live threads
+// #define LOG_STACK
+#ifndef LOG_STACK_DEPTH
+#define LOG_STACK_DEPTH 64 // frames stored per thread, deeper frames are only counted
+#endif
+#ifndef LOG_STACK_THREADS
+#define LOG_STACK_THREADS 256 // threads tracked at once
+#endif
+#ifndef LOG_STACK_ARGS
+#define LOG_STACK_ARGS 120 // bytes of LOG_CALL arguments or LOG_SCOPE text kept per frame
+#endif
+
+// uncomment next line to also write LOG_CALL*/LOG_SCOPE spans and PRINT records as Chrome Trace Event JSON,
+// open LOG_TRACE_FILE in chrome://tracing or ui.perfetto.dev
+// #define LOG_TRACE
+#ifndef LOG_TRACE_FILE
+#define LOG_TRACE_FILE "/tmp/MyModule.trace.json" // rotated like LOG_FILE, every file loads on its own
+#endif
+#ifndef LOG_TRACE_FILE_SIZE_LIMIT
+#define LOG_TRACE_FILE_SIZE_LIMIT (16*1024*1024) // bytes
+#endif
+#ifndef LOG_TRACE_BUFFER_SIZE
+#define LOG_TRACE_BUFFER_SIZE (64*1024) // bytes of events collected per thread before one write()
+#endif
+#ifndef LOG_TRACE_FLUSH_MS
+#define LOG_TRACE_FLUSH_MS 1000 // older events are written with the next event of their thread
+#endif
+
+// uncomment next line to keep records only in a per-thread memory ring, ERROR records are still written;
+// every LOG_ERROR, crash signal or FlightRecorder::dump() appends the rings of all threads to LOG_FLIGHT_FILE
+// #define LOG_FLIGHT
+#ifndef LOG_FLIGHT_FILE
+#define LOG_FLIGHT_FILE "/tmp/MyModule.flight.log"
+#endif
+#ifndef LOG_FLIGHT_RING_SIZE
+#define LOG_FLIGHT_RING_SIZE (64*1024) // bytes of the most recent records kept per thread
+#endif
+#ifndef LOG_FLIGHT_THREADS
+#define LOG_FLIGHT_THREADS 256 // threads recorded at once, rings of exited threads are reused
+#endif
+#ifndef LOG_FLIGHT_DUMP_MS
+#define LOG_FLIGHT_DUMP_MS 1000 // LOG_ERROR dumps at most this often
+#endif
+
+// uncomment next line to count what logging costs: records and bytes per level, PrintLock and full async ring
+// waits, write and sync latency histograms, rotations, dropped and suppressed records and the deepest
+// LOG_CALL*/LOG_SCOPE nesting per thread, read with LogTelemetry::snapshot() or logged as a STATS record
+// #define LOG_TELEMETRY
+#ifndef LOG_TELEMETRY_MS
+#define LOG_TELEMETRY_MS 0 // LogTelemetry::dump() this often, 0 only when it is called
+#endif
+#ifndef LOG_TELEMETRY_BUCKETS
+#define LOG_TELEMETRY_BUCKETS 40 // latency histogram buckets of [2^i, 2^(i+1)) ns
+#endif
+
+// uncomment next line to format records in the calling thread and write them from a background thread
+// #define LOG_ASYNC
+#ifndef LOG_ASYNC_RING_SIZE
+#define LOG_ASYNC_RING_SIZE (256*1024) // bytes queued per thread, must be a power of 2
+#endif
+#ifndef LOG_ASYNC_OVERFLOW
+#define LOG_ASYNC_OVERFLOW LOG_OVERFLOW_BLOCK
+#endif
+#ifndef LOG_ASYNC_IDLE_MS
+#define LOG_ASYNC_IDLE_MS 1 // drain thread sleeps this long when every ring is empty
+#endif
+#ifndef LOG_RECORD_SIZE
+#define LOG_RECORD_SIZE 4096 // bytes, longer records are truncated
+#endif
+
+#define LOG_TIME_MILLI 3 // digits after the seconds
+#define LOG_TIME_MICRO 6
+#define LOG_TIME_NANO  9
+#ifndef LOG_TIME_PRECISION
+#define LOG_TIME_PRECISION LOG_TIME_MILLI
+#endif
+
+#define LOG_CLOCK_REALTIME        0 // exact, one vDSO clock_gettime() per record
+#define LOG_CLOCK_REALTIME_COARSE 1 // cheaper, advances once per scheduler tick
+#define LOG_CLOCK_TSC             2 // rdtsc calibrated against CLOCK_REALTIME, x86 only
+#ifndef LOG_CLOCK
+#define LOG_CLOCK LOG_CLOCK_REALTIME
+#endif
+#ifndef LOG_TSC_ANCHOR_MS
+#define LOG_TSC_ANCHOR_MS 100 // how often the tsc clock re-reads CLOCK_REALTIME
+#endif
 
 #define ERROR_LEVEL 0
 #define WARN_LEVEL  1
 #define INFO_LEVEL  2
 #define DEBUG_LEVEL 3
+#define OFF_LEVEL   (ERROR_LEVEL - 1) // sinks and LogFilter rules at this level take nothing
+
+#ifndef LOG_FILTER_CHECK_MS
+#define LOG_FILTER_CHECK_MS 1000 // how often LogFilter::watch() looks for a changed rules file
+#endif
+
+// levels more verbose than this compile to nothing, arguments included
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL DEBUG_LEVEL
+#endif
 
-#define FILENAME_ \
-  (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
+#define FILENAME_ (LogSite::basename(__FILE__).data())
 
-#define THREADID_ (int)gettid()
+// static descriptor of the enclosing call site, everything is computed at compile time
+#define LOG_SITE_(name, type)                                                  \
+  static constexpr LogSite name {LogSite::func_name(__PRETTY_FUNCTION__),      \
+                                 LogSite::basename(__FILE__), __LINE__, type,  \
+                                 __FILE__}
 
-#if defined (SAVE_LOG_TO_FILE)
-#define LOG(fmt, ...) RotateLog::get_instance().log(fmt, ##__VA_ARGS__)
+#define THREADID_ LogRecord::get().tid()
+
+// the string literal of a LOG() format as a type, F::str() is parsed and checked at compile time
+#define LOG_FORMAT_STRING_(fmt)                                                \
+  [] {                                                                         \
+    struct F {                                                                 \
+      static constexpr std::string_view str() { return "" fmt; }               \
+    };                                                                         \
+    return F {};                                                               \
+  }()
+
+// fragments are collected in the thread's LogRecord, LOG_COMMIT() hands the finished record to the sinks
+#define LOG(fmt, ...) log_format(LogRecord::get(), LOG_FORMAT_STRING_(fmt), ##__VA_ARGS__)
+
+#if defined (LOG_FLIGHT)
+#define LOG_COMMIT() FlightRecorder::commit(LogRecord::get())
+#elif defined (LOG_ASYNC)
+#define LOG_COMMIT() AsyncLog::get_instance().push(LogRecord::get())
 #else
-#define LOG(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
+#define LOG_COMMIT() LogWriter::commit(LogRecord::get())
 #endif
 
-class RotateLog {
+// LOG_TELEMETRY: what logging costs this process, counted in a cache line aligned slot per thread that only
+// its thread writes; snapshot() adds up the live slots and those of exited threads. without LOG_TELEMETRY
+// every counting call is empty and now_ns() is 0
+class LogTelemetry {
 public:
-    static RotateLog& get_instance() {
-        static RotateLog instance;
-        return instance;
+    static constexpr int LEVELS = DEBUG_LEVEL + 1;
+
+    struct Histogram {
+        uint64_t count {0};
+        uint64_t total_ns {0};
+        uint64_t max_ns {0};
+        uint64_t hist[LOG_TELEMETRY_BUCKETS] {}; // hist[i] counts [2^i, 2^(i+1)) ns
+
+        // upper bound of the bucket holding the q quantile
+        uint64_t quantile_ns(double q) const {
+            const uint64_t rank = (uint64_t) (q * count);
+            uint64_t seen = 0;
+            for (int i = 0; i < LOG_TELEMETRY_BUCKETS; i++) {
+                seen += hist[i];
+                if (seen > rank)
+                    return std::min<uint64_t>(2ULL << i, max_ns);
+            }
+            return max_ns;
+        }
+
+        void merge(const Histogram &h) {
+            count += h.count;
+            total_ns += h.total_ns;
+            max_ns = std::max(max_ns, h.max_ns);
+            for (int i = 0; i < LOG_TELEMETRY_BUCKETS; i++)
+                hist[i] += h.hist[i];
+        }
+    };
+
+    struct Counters {
+        uint64_t records[LEVELS] {};  // handed to the sinks or the async queue, by ERROR_LEVEL .. DEBUG_LEVEL
+        uint64_t bytes[LEVELS] {};
+        uint64_t lock_waits {0};      // contended PrintLock::acquire() calls and group commit waits
+        uint64_t lock_wait_ns {0};
+        uint64_t queue_waits {0};     // LOG_ASYNC records that waited for room in a full ring
+        uint64_t queue_wait_ns {0};
+        Histogram write;              // sink writes of a record or an async batch
+        Histogram sync;               // fdatasync() or msync() of LOG_FILE
+        uint64_t rotations {0};
+        uint64_t rotate_ns {0};
+        uint64_t max_rotate_ns {0};
+        uint64_t dropped {0};         // full async rings and LOG_SHARED rings, unsent SocketSink datagrams
+        uint64_t suppressed {0};      // by LOG_EVERY_MS / LOG_RATELIMITED
+        uint32_t max_depth {0};       // deepest LOG_CALL*/LOG_SCOPE nesting of any thread
+
+        void merge(const Counters &c) {
+            for (int i = 0; i < LEVELS; i++) {
+                records[i] += c.records[i];
+                bytes[i] += c.bytes[i];
+            }
+            lock_waits += c.lock_waits;
+            lock_wait_ns += c.lock_wait_ns;
+            queue_waits += c.queue_waits;
+            queue_wait_ns += c.queue_wait_ns;
+            write.merge(c.write);
+            sync.merge(c.sync);
+            rotations += c.rotations;
+            rotate_ns += c.rotate_ns;
+            max_rotate_ns = std::max(max_rotate_ns, c.max_rotate_ns);
+            dropped += c.dropped;
+            suppressed += c.suppressed;
+            max_depth = std::max(max_depth, c.max_depth);
+        }
+    };
+
+    struct ThreadDepth {
+        int tid;
+        uint32_t max_depth;
+    };
+
+    struct Snapshot {
+        Counters total;                   // all threads, live and exited
+        std::vector<ThreadDepth> threads; // live threads
+    };
+
+    static uint64_t now_ns() {
+#if defined (LOG_TELEMETRY)
+        struct timespec ts{};
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+        return 0;
+#endif
     }
-    
-    RotateLog() {
-        if (!open_log_file()) {
-            fprintf(stderr,"RotateLog::RotateLog() open_log_file() failed!\n");
+
+    static void record(int level, size_t bytes) {
+#if defined (LOG_TELEMETRY)
+        update([level, bytes](Slot &s) {
+            const int i = std::clamp(level, 0, LEVELS - 1);
+            add(s.records[i], 1);
+            add(s.bytes[i], bytes);
+        });
+#else
+        (void) level, (void) bytes;
+#endif
+    }
+
+    static void lock_wait(uint64_t ns) {
+#if defined (LOG_TELEMETRY)
+        update([ns](Slot &s) {
+            add(s.lock_waits, 1);
+            add(s.lock_wait_ns, ns);
+        });
+#else
+        (void) ns;
+#endif
+    }
+
+    static void queue_wait(uint64_t ns) {
+#if defined (LOG_TELEMETRY)
+        update([ns](Slot &s) {
+            add(s.queue_waits, 1);
+            add(s.queue_wait_ns, ns);
+        });
+#else
+        (void) ns;
+#endif
+    }
+
+    static void write(uint64_t ns) {
+#if defined (LOG_TELEMETRY)
+        update([ns](Slot &s) { s.write.add(ns); });
+#else
+        (void) ns;
+#endif
+    }
+
+    static void sync(uint64_t ns) {
+#if defined (LOG_TELEMETRY)
+        update([ns](Slot &s) { s.sync.add(ns); });
+#else
+        (void) ns;
+#endif
+    }
+
+    static void rotation(uint64_t ns) {
+#if defined (LOG_TELEMETRY)
+        update([ns](Slot &s) {
+            add(s.rotations, 1);
+            add(s.rotate_ns, ns);
+            if (ns > s.max_rotate_ns.load(std::memory_order_relaxed))
+                s.max_rotate_ns.store(ns, std::memory_order_relaxed);
+        });
+#else
+        (void) ns;
+#endif
+    }
+
+    static void dropped(uint64_t n = 1) {
+#if defined (LOG_TELEMETRY)
+        update([n](Slot &s) { add(s.dropped, n); });
+#else
+        (void) n;
+#endif
+    }
+
+    static void suppressed() {
+#if defined (LOG_TELEMETRY)
+        update([](Slot &s) { add(s.suppressed, 1); });
+#endif
+    }
+
+    static void depth(uint32_t d) {
+#if defined (LOG_TELEMETRY)
+        update([d](Slot &s) {
+            if (d > s.max_depth.load(std::memory_order_relaxed))
+                s.max_depth.store(d, std::memory_order_relaxed);
+        });
+#else
+        (void) d;
+#endif
+    }
+
+    static Snapshot snapshot() {
+        Snapshot result;
+#if defined (LOG_TELEMETRY)
+        Registry &r = registry();
+        std::scoped_lock l(r.lock);
+
+        result.total = r.retired;
+        result.total.merge(r.late.read());
+        for (const Slot *s : r.slots) {
+            const Counters c = s->read();
+            result.total.merge(c);
+            result.threads.push_back({s->tid, c.max_depth});
         }
+#endif
+        return result;
     }
 
-    void log(const char *fmt, ...) {
-        va_list args;
-        va_start(args, fmt);
-        vfprintf(stderr, fmt, args);
-        va_end(args);
+    // logs snapshot() as one STATS record, every LOG_TELEMETRY_MS too when it is not 0
+    static void dump();
 
-        if (get_file_size(LOG_FILE) >= LOG_FILE_SIZE_LIMIT) {
-            if (!rotate_logs()) {
-                fprintf(stderr,"RotateLog::log() rotate_logs() failed!\n");
-                return;
+private:
+#if defined (LOG_TELEMETRY)
+    struct AtomicHistogram {
+        std::atomic<uint64_t> count {0};
+        std::atomic<uint64_t> total_ns {0};
+        std::atomic<uint64_t> max_ns {0};
+        std::atomic<uint64_t> hist[LOG_TELEMETRY_BUCKETS] {};
+
+        void add(uint64_t ns) {
+            LogTelemetry::add(count, 1);
+            LogTelemetry::add(total_ns, ns);
+            if (ns > max_ns.load(std::memory_order_relaxed))
+                max_ns.store(ns, std::memory_order_relaxed);
+            const int b = ns ? 63 - __builtin_clzll(ns) : 0;
+            LogTelemetry::add(hist[std::min(b, LOG_TELEMETRY_BUCKETS - 1)], 1);
+        }
+
+        Histogram read() const {
+            Histogram h;
+            h.count = count.load(std::memory_order_relaxed);
+            h.total_ns = total_ns.load(std::memory_order_relaxed);
+            h.max_ns = max_ns.load(std::memory_order_relaxed);
+            for (int i = 0; i < LOG_TELEMETRY_BUCKETS; i++)
+                h.hist[i] = hist[i].load(std::memory_order_relaxed);
+            return h;
+        }
+    };
+
+    // one per thread, on cache lines of its own so counting never touches a line another thread writes
+    struct alignas(64) Slot {
+        int tid {(int) gettid()};
+        std::atomic<uint64_t> records[LEVELS] {};
+        std::atomic<uint64_t> bytes[LEVELS] {};
+        std::atomic<uint64_t> lock_waits {0};
+        std::atomic<uint64_t> lock_wait_ns {0};
+        std::atomic<uint64_t> queue_waits {0};
+        std::atomic<uint64_t> queue_wait_ns {0};
+        AtomicHistogram write;
+        AtomicHistogram sync;
+        std::atomic<uint64_t> rotations {0};
+        std::atomic<uint64_t> rotate_ns {0};
+        std::atomic<uint64_t> max_rotate_ns {0};
+        std::atomic<uint64_t> dropped {0};
+        std::atomic<uint64_t> suppressed {0};
+        std::atomic<uint32_t> max_depth {0};
+
+        Counters read() const {
+            Counters c;
+            for (int i = 0; i < LEVELS; i++) {
+                c.records[i] = records[i].load(std::memory_order_relaxed);
+                c.bytes[i] = bytes[i].load(std::memory_order_relaxed);
             }
+            c.lock_waits = lock_waits.load(std::memory_order_relaxed);
+            c.lock_wait_ns = lock_wait_ns.load(std::memory_order_relaxed);
+            c.queue_waits = queue_waits.load(std::memory_order_relaxed);
+            c.queue_wait_ns = queue_wait_ns.load(std::memory_order_relaxed);
+            c.write = write.read();
+            c.sync = sync.read();
+            c.rotations = rotations.load(std::memory_order_relaxed);
+            c.rotate_ns = rotate_ns.load(std::memory_order_relaxed);
+            c.max_rotate_ns = max_rotate_ns.load(std::memory_order_relaxed);
+            c.dropped = dropped.load(std::memory_order_relaxed);
+            c.suppressed = suppressed.load(std::memory_order_relaxed);
+            c.max_depth = max_depth.load(std::memory_order_relaxed);
+            return c;
         }
+    };
 
-        if (m_file_ptr) {
-            if (access(LOG_FILE, F_OK) != 0) {
-                fprintf(stderr,"RotateLog::log() access() failed!\n");
+    struct Registry {
+        std::mutex lock;
+        std::vector<Slot *> slots;
+        Counters retired; // slots of exited threads, added up
+        Slot late;        // what threads count after their slot was retired, under the lock
+    };
 
-                if (!close_log_file()) {
-                    fprintf(stderr,"RotateLog::log() close_log_file() failed!\n");
-                    return;
-                }
+    // single writer, plain load + store is enough
+    static void add(std::atomic<uint64_t> &a, uint64_t v) {
+        a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+    }
+
+    static Registry &registry() {
+        // never destroyed, threads may exit while static destructors run
+        static Registry *r = new Registry;
+        return *r;
+    }
+
+    // calls f with the thread's slot, or with Registry::late once the thread's thread_local
+    // destructors have retired it, so logging from a later destructor does not leak a new slot
+    template<typename F>
+    static void update(F &&f) {
+        if (Slot *s = local_slot()) {
+            f(*s);
+            return;
+        }
+
+        Registry &r = registry();
+        std::scoped_lock l(r.lock);
+        f(r.late);
+    }
+
+    // nullptr once the thread's slot was retired
+    static Slot *local_slot() {
+        struct Owner {
+            Slot *slot {nullptr};
+            bool retired {false};
 
-                if (!open_log_file()) {
-                    fprintf(stderr,"RotateLog::log() open_log_file() failed!\n");
+            ~Owner() {
+                retired = true;
+                if (slot == nullptr)
                     return;
-                }
-            }
-        } else {
-            if (!open_log_file()) {
-                fprintf(stderr,"RotateLog::log() open_log_file() failed!\n");
-                return;
+
+                Registry &r = registry();
+                std::scoped_lock l(r.lock);
+                r.retired.merge(slot->read());
+                r.slots.erase(std::find(r.slots.begin(), r.slots.end(), slot));
+                delete slot;
+                slot = nullptr;
             }
+        };
+        thread_local Owner owner;
+
+        if (owner.retired)
+            return nullptr;
+
+        if (owner.slot == nullptr) {
+            owner.slot = new Slot;
+
+            Registry &r = registry();
+            std::scoped_lock l(r.lock);
+            r.slots.push_back(owner.slot);
+#if LOG_TELEMETRY_MS > 0
+            static const bool reporting = (std::thread([] {
+                for (;;) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(LOG_TELEMETRY_MS));
+                    dump();
+                }
+            }).detach(), true);
+            (void) reporting;
+#endif
         }
 
-        va_start(args, fmt);
-        vfprintf(m_file_ptr, fmt, args);
-        fflush(m_file_ptr);
-        va_end(args);
+        return owner.slot;
+    }
+#endif
+};
+
+class PrintLock {
+public:
+    static std::recursive_mutex &get() {
+        static std::recursive_mutex lock;
+        return lock;
+    }
+
+    // locks get(), time spent blocked behind another writer is added to wait_ns()
+    static std::unique_lock<std::recursive_mutex> acquire() {
+        std::unique_lock l(get(), std::try_to_lock);
+
+        if (!l.owns_lock()) {
+            struct timespec start{}, end{};
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            l.lock();
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            const uint64_t ns = (end.tv_sec - start.tv_sec) * 1000000000LL + end.tv_nsec - start.tv_nsec;
+            wait_ns().fetch_add(ns, std::memory_order_relaxed);
+            LogTelemetry::lock_wait(ns);
+        }
+
+        return l;
+    }
+
+    // total ns writers waited for the lock, only contended acquire() calls are timed
+    static std::atomic<uint64_t> &wait_ns() {
+        static std::atomic<uint64_t> ns {0};
+        return ns;
+    }
+};
+
+// writes the whole buffer, retrying on partial writes and EINTR
+inline bool write_fd(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = ::write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+// drops the first written bytes of iov[0..n)
+inline void skip_iov(struct iovec *&iov, int &n, size_t written) {
+    while (n > 0 && written >= iov->iov_len) {
+        written -= iov->iov_len;
+        iov++;
+        n--;
+    }
+
+    if (n > 0) {
+        iov->iov_base = static_cast<char *>(iov->iov_base) + written;
+        iov->iov_len -= written;
+    }
+}
+
+// writev() of all n buffers, retrying on partial writes and EINTR, iov is consumed
+inline bool writev_fd(int fd, struct iovec *iov, int n) {
+    while (n > 0) {
+        ssize_t written = ::writev(fd, iov, std::min(n, IOV_MAX));
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        skip_iov(iov, n, written);
+    }
+
+    return true;
+}
+
+struct LogSite {
+    std::string_view func; // "func_1" out of "void func_1(int, float)"
+    std::string_view file; // basename of __FILE__
+    int line;
+    const char *type;      // "INFO", "ERROR", ...
+    const char *path;      // __FILE__ as passed to the compiler, matched by LogFilter rules
+
+    static constexpr std::string_view func_name(std::string_view pretty) {
+        pretty = pretty.substr(0, pretty.find('('));
+        const size_t space = pretty.find_last_of(' ');
+        return space == std::string_view::npos ? pretty : pretty.substr(space + 1);
+    }
+
+    static constexpr std::string_view basename(std::string_view path) {
+        const size_t slash = path.find_last_of('/');
+        return slash == std::string_view::npos ? path : path.substr(slash + 1);
+    }
+};
+
+// LOG_BINARY file format, decoded by tools/threadlog-decode.cpp
+// every frame is [u8 kind][u32 payload size][payload], integers in host byte order,
+// strings are [u16 size][bytes]; each file (and each process appending to it) starts with
+// a FrameHeader followed by the FrameSite of every site registered so far, so rotated
+// files decode on their own
+class BinaryLog {
+public:
+    enum Frame : uint8_t {
+        FrameHeader = 1, // magic, u8 time precision, i32 utc offset, str module name
+        FrameSite,       // u32 id, u8 event, u32 line, str type, str file, str func, str fmt
+        FrameText,       // preformatted text, also written to stderr
+        FrameEvent,      // u32 site id, i64 ns, i32 tid, u16 depth, u8 color, args
+        FrameExit,       // i64 ns, i32 tid, u16 depth, u8 color, str func, [i64 elapsed ns]
+    };
+
+    // what a FrameEvent prints, see PRINT, LOG_CALL_X and LOG_SCOPE
+    enum Event : uint8_t {
+        EventPrint,
+        EventCall,
+        EventScope,
+    };
+
+    // every argument is [u8 tag][value], strings are [u32 size][bytes]
+    enum Arg : uint8_t {
+        ArgInt32,
+        ArgUint32,
+        ArgInt64,
+        ArgUint64,
+        ArgDouble,
+        ArgLongDouble,
+        ArgString,
+        ArgPointer,
+    };
+
+    static constexpr char MAGIC[8] = {'T', 'L', 'O', 'G', 'B', 'I', 'N', '1'};
+    static constexpr size_t FRAME_HEADER_SIZE = 5;
+
+    struct Site {
+        const LogSite *site;
+        const char *fmt;
+        uint8_t event;
+    };
+
+    // returns the id of a new site, ids start at 1
+    static uint32_t register_site(const LogSite &site, const char *fmt, uint8_t event) {
+        std::scoped_lock l(lock());
+        sites().push_back({&site, fmt, event});
+        return sites().size();
+    }
+
+    // FrameSite payload of site id
+    static std::string site_frame(uint32_t id) {
+        Site s;
+        {
+            std::scoped_lock l(lock());
+            s = sites()[id - 1];
+        }
+
+        std::string frame;
+        put(frame, id);
+        put(frame, s.event);
+        put(frame, (uint32_t) s.site->line);
+        put_str(frame, s.site->type);
+        put_str(frame, s.site->file);
+        put_str(frame, s.site->func);
+        put_str(frame, s.fmt);
+        return wrap(FrameSite, frame);
+    }
+
+    // header and site table at the start of every opened log file
+    static void write_file_header(int fd) {
+        struct tm now{};
+        time_t t = time(nullptr);
+        localtime_r(&t, &now);
+
+        std::string header(MAGIC, sizeof(MAGIC));
+        put(header, (uint8_t) LOG_TIME_PRECISION);
+        put(header, (int32_t) now.tm_gmtoff);
+        put_str(header, ModuleName);
+
+        std::string out = wrap(FrameHeader, header);
+
+        size_t n;
+        {
+            std::scoped_lock l(lock());
+            n = sites().size();
+        }
+        for (uint32_t id = 1; id <= n; id++)
+            out += site_frame(id);
+
+        write_fd(fd, out.data(), out.size());
+    }
+
+    template<typename T>
+    static void put(std::string &out, T v) {
+        out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+    }
+
+    static void put_str(std::string &out, std::string_view str) {
+        put(out, (uint16_t) str.size());
+        out.append(str);
+    }
+
+    // length of the whole frames at the start of data, the zero tail of a LOG_FILE_MMAP file is not one
+    static size_t frames_end(const char *data, size_t size) {
+        size_t pos = 0;
+        while (size - pos >= FRAME_HEADER_SIZE && data[pos] >= FrameHeader && data[pos] <= FrameExit) {
+            uint32_t len;
+            memcpy(&len, data + pos + 1, sizeof(len));
+            if (size - pos - FRAME_HEADER_SIZE < len)
+                break;
+            pos += FRAME_HEADER_SIZE + len;
+        }
+        return pos;
+    }
+
+private:
+    static std::mutex &lock() {
+        static std::mutex l;
+        return l;
+    }
+
+    static std::vector<Site> &sites() {
+        static std::vector<Site> s;
+        return s;
+    }
+
+    static std::string wrap(uint8_t kind, const std::string &payload) {
+        std::string frame;
+        put(frame, kind);
+        put(frame, (uint32_t) payload.size());
+        return frame + payload;
+    }
+};
+
+// a small io_uring set up with raw syscalls, no liburing: a batch is one IORING_OP_WRITEV and, linked to it,
+// an IORING_OP_FSYNC, submitted and waited for with one io_uring_enter(); used by one thread at a time
+class LogUring {
+public:
+    LogUring() {
+#if defined (LOG_IO_URING) && defined (IORING_FSYNC_DATASYNC) && defined (__NR_io_uring_setup)
+        struct io_uring_params p{};
+        m_fd = (int) syscall(__NR_io_uring_setup, ENTRIES, &p);
+        if (m_fd < 0)
+            return;
+
+        m_sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        m_cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+            m_sq_size = m_cq_size = std::max(m_sq_size, m_cq_size);
+        m_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+        m_sq = map(m_sq_size, IORING_OFF_SQ_RING);
+        m_cq = (p.features & IORING_FEAT_SINGLE_MMAP) ? m_sq : map(m_cq_size, IORING_OFF_CQ_RING);
+        m_sqes = reinterpret_cast<struct io_uring_sqe *>(map(m_sqes_size, IORING_OFF_SQES));
+        if (m_sq == nullptr || m_cq == nullptr || m_sqes == nullptr) {
+            fprintf(stderr,"LogUring::LogUring() mmap() failed!\n");
+            release();
+            return;
+        }
+
+        m_sq_head = reinterpret_cast<unsigned *>(m_sq + p.sq_off.head);
+        m_sq_tail = reinterpret_cast<unsigned *>(m_sq + p.sq_off.tail);
+        m_sq_mask = *reinterpret_cast<unsigned *>(m_sq + p.sq_off.ring_mask);
+        m_sq_array = reinterpret_cast<unsigned *>(m_sq + p.sq_off.array);
+        m_cq_head = reinterpret_cast<unsigned *>(m_cq + p.cq_off.head);
+        m_cq_tail = reinterpret_cast<unsigned *>(m_cq + p.cq_off.tail);
+        m_cq_mask = *reinterpret_cast<unsigned *>(m_cq + p.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<struct io_uring_cqe *>(m_cq + p.cq_off.cqes);
+        m_append_offset = (p.features & IORING_FEAT_RW_CUR_POS) ? (uint64_t) -1 : 0;
+#endif
+    }
+
+    ~LogUring() {
+        release();
+    }
+
+    LogUring(const LogUring &) = delete;
+    LogUring &operator=(const LogUring &) = delete;
+
+    bool ok() const { return m_fd >= 0; }
+
+    // after a failed submission, writev() is used from then on
+    void disable() {
+        release();
+    }
+
+    // writes n <= IOV_MAX buffers to an O_APPEND fd, returns the bytes written or -errno; synced is set
+    // when the linked fdatasync() ran, a short write cancels it
+    ssize_t writev(int fd, const struct iovec *iov, int n, bool sync, bool &synced) {
+        synced = false;
+#if defined (LOG_IO_URING) && defined (IORING_FSYNC_DATASYNC) && defined (__NR_io_uring_setup)
+        unsigned tail = *m_sq_tail;
+        struct io_uring_sqe *sqe = next_sqe(tail);
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t) (uintptr_t) iov;
+        sqe->len = n;
+        sqe->off = m_append_offset;
+        sqe->user_data = WRITE;
+        if (sync) {
+            sqe->flags = IOSQE_IO_LINK;
+            sqe = next_sqe(tail);
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fd = fd;
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            sqe->user_data = SYNC;
+        }
+        __atomic_store_n(m_sq_tail, tail, __ATOMIC_RELEASE);
+
+        unsigned submit = sync ? 2 : 1, pending = submit;
+        ssize_t written = -EIO;
+        while (pending > 0) {
+            if (syscall(__NR_io_uring_enter, m_fd, submit, pending, IORING_ENTER_GETEVENTS, nullptr, 0) < 0) {
+                if (errno == EINTR || errno == EAGAIN) {
+                    // sqes the kernel did not take yet are submitted again with the wait
+                    submit = *m_sq_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+                    continue;
+                }
+                return -errno;
+            }
+            submit = 0;
+
+            unsigned head = *m_cq_head;
+            for (; head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE); head++, pending--) {
+                const struct io_uring_cqe &cqe = m_cqes[head & m_cq_mask];
+                if (cqe.user_data == WRITE)
+                    written = cqe.res;
+                else
+                    synced = cqe.res == 0;
+            }
+            __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+        }
+
+        return written;
+#else
+        (void) fd;
+        (void) iov;
+        (void) n;
+        (void) sync;
+        return -ENOSYS;
+#endif
+    }
+
+private:
+    static constexpr unsigned ENTRIES = 4;
+    enum : uint64_t { WRITE = 1, SYNC = 2 };
+
+    int m_fd {-1};
+    char *m_sq {nullptr};
+    char *m_cq {nullptr};
+    struct io_uring_sqe *m_sqes {nullptr};
+    size_t m_sq_size {0}, m_cq_size {0}, m_sqes_size {0};
+    unsigned *m_sq_head {nullptr}, *m_sq_tail {nullptr}, *m_sq_array {nullptr}, *m_cq_head {nullptr}, *m_cq_tail {nullptr};
+    unsigned m_sq_mask {0}, m_cq_mask {0};
+    struct io_uring_cqe *m_cqes {nullptr};
+    uint64_t m_append_offset {0};
+
+    char *map(size_t size, off_t offset) {
+        void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, offset);
+        return p == MAP_FAILED ? nullptr : static_cast<char *>(p);
+    }
+
+#if defined (LOG_IO_URING) && defined (IORING_FSYNC_DATASYNC) && defined (__NR_io_uring_setup)
+    struct io_uring_sqe *next_sqe(unsigned &tail) {
+        const unsigned index = tail++ & m_sq_mask;
+        struct io_uring_sqe *sqe = &m_sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        m_sq_array[index] = index;
+        return sqe;
+    }
+#endif
+
+    void release() {
+        if (m_sqes)
+            munmap(m_sqes, m_sqes_size);
+        if (m_cq && m_cq != m_sq)
+            munmap(m_cq, m_cq_size);
+        if (m_sq)
+            munmap(m_sq, m_sq_size);
+        if (m_fd >= 0)
+            close(m_fd);
+        m_fd = -1;
+        m_sq = m_cq = nullptr;
+        m_sqes = nullptr;
+    }
+};
+
+#if defined (LOG_COMPRESS)
+// gzips a rotated log file: with zlib when LOG_ZLIB is defined, else with a small deflate encoder, hash
+// chained LZ77 matches written in one block with the fixed Huffman code of RFC 1951
+class LogCompress {
+public:
+    // writes gz_path through gz_path.tmp, synced before it is renamed, path is left to the caller
+    static bool gzip_file(const std::string &path, const std::string &gz_path) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr,"LogCompress::gzip_file() open() failed!\n");
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            fprintf(stderr,"LogCompress::gzip_file() fstat() failed!\n");
+            close(fd);
+            return false;
+        }
+
+        const size_t size = st.st_size;
+        const unsigned char *data = nullptr;
+        if (size > 0) {
+            void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED) {
+                fprintf(stderr,"LogCompress::gzip_file() mmap() failed!\n");
+                close(fd);
+                return false;
+            }
+            data = static_cast<const unsigned char *>(map);
+            madvise(map, size, MADV_SEQUENTIAL);
+        }
+        close(fd);
+
+        const std::string tmp_path = gz_path + ".tmp";
+        int out_fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool ok = out_fd >= 0;
+        if (!ok) {
+            fprintf(stderr,"LogCompress::gzip_file() open() failed!\n");
+        } else {
+            Output out {out_fd};
+            ok = deflate_gzip(data, size, out) && out.flush() && fdatasync(out_fd) == 0;
+            if (!ok)
+                fprintf(stderr,"LogCompress::gzip_file() write failed!\n");
+            ok = close(out_fd) == 0 && ok;
+        }
+
+        if (size > 0)
+            munmap(const_cast<unsigned char *>(data), size);
+
+        if (ok && rename(tmp_path.c_str(), gz_path.c_str()) != 0) {
+            fprintf(stderr,"LogCompress::gzip_file() rename() failed!\n");
+            ok = false;
+        }
+        if (!ok)
+            unlink(tmp_path.c_str());
+
+        return ok;
+    }
+
+private:
+    // compressed bytes are collected and written in 64 KB chunks
+    struct Output {
+        int fd;
+        std::string buf {};
+        bool failed {false};
+
+        void put(const void *p, size_t n) {
+            buf.append(static_cast<const char *>(p), n);
+            if (buf.size() >= 65536)
+                flush();
+        }
+
+        bool flush() {
+            size_t done = 0;
+            while (!failed && done < buf.size()) {
+                ssize_t n = ::write(fd, buf.data() + done, buf.size() - done);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    failed = true;
+                else
+                    done += n;
+            }
+            buf.clear();
+            return !failed;
+        }
+    };
+
+#if defined (LOG_ZLIB)
+    static bool deflate_gzip(const unsigned char *data, size_t size, Output &out) {
+        z_stream zs {};
+        // 15 + 16: a 32 KB window and a gzip header and trailer
+        if (deflateInit2(&zs, LOG_COMPRESS_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+
+        unsigned char chunk[65536];
+        size_t done = 0;
+        int ret = Z_OK;
+        while (ret == Z_OK) {
+            if (zs.avail_in == 0 && done < size) {
+                zs.next_in = const_cast<unsigned char *>(data + done);
+                zs.avail_in = (uInt) std::min<size_t>(size - done, 1u << 30);
+                done += zs.avail_in;
+            }
+            zs.next_out = chunk;
+            zs.avail_out = sizeof(chunk);
+            ret = deflate(&zs, done < size ? Z_NO_FLUSH : Z_FINISH);
+            out.put(chunk, sizeof(chunk) - zs.avail_out);
+            if (ret == Z_BUF_ERROR)
+                ret = Z_OK; // no progress was possible, more input or output space follows
+        }
+        deflateEnd(&zs);
+
+        return ret == Z_STREAM_END && !out.failed;
+    }
+#else
+    static constexpr int WINDOW = 32768;
+    static constexpr int MIN_MATCH = 3;
+    static constexpr int MAX_MATCH = 258;
+    static constexpr int HASH_BITS = 15;
+    static constexpr int MAX_CHAIN = LOG_COMPRESS_LEVEL * 8; // match candidates tried per position
+
+    // LSB first bit packing of RFC 1951, Huffman codes are stored reversed
+    struct Bits {
+        Output &out;
+        uint64_t acc {0};
+        int count {0};
+
+        void put(uint32_t value, int n) {
+            acc |= (uint64_t) value << count;
+            count += n;
+            while (count >= 8) {
+                unsigned char c = (unsigned char) acc;
+                out.put(&c, 1);
+                acc >>= 8;
+                count -= 8;
+            }
+        }
+
+        void put_code(uint32_t code, int n) {
+            uint32_t reversed = 0;
+            for (int i = 0; i < n; i++)
+                reversed |= ((code >> i) & 1) << (n - 1 - i);
+            put(reversed, n);
+        }
+
+        void align() {
+            if (count > 0)
+                put(0, 8 - count);
+        }
+    };
+
+    static void put_symbol(Bits &bits, int sym) {
+        if (sym < 144)
+            bits.put_code(0x30 + sym, 8);
+        else if (sym < 256)
+            bits.put_code(0x190 + sym - 144, 9);
+        else if (sym < 280)
+            bits.put_code(sym - 256, 7);
+        else
+            bits.put_code(0xc0 + sym - 280, 8);
+    }
+
+    static void put_match(Bits &bits, int len, int dist) {
+        static const uint16_t len_base[] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                            35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+        static const uint8_t len_extra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                            3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+        static const uint16_t dist_base[] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                             257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+                                             8193, 12289, 16385, 24577};
+        static const uint8_t dist_extra[] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                             7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+        int l = int(std::upper_bound(std::begin(len_base), std::end(len_base), len) - std::begin(len_base)) - 1;
+        put_symbol(bits, 257 + l);
+        bits.put(len - len_base[l], len_extra[l]);
+
+        int d = int(std::upper_bound(std::begin(dist_base), std::end(dist_base), dist) - std::begin(dist_base)) - 1;
+        bits.put_code(d, 5);
+        bits.put(dist - dist_base[d], dist_extra[d]);
+    }
+
+    static uint32_t crc32(const unsigned char *data, size_t size) {
+        static const auto table = [] {
+            std::array<uint32_t, 256> t {};
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++)
+                    c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+                t[i] = c;
+            }
+            return t;
+        }();
+
+        uint32_t c = 0xffffffff;
+        for (size_t i = 0; i < size; i++)
+            c = table[(c ^ data[i]) & 0xff] ^ (c >> 8);
+        return c ^ 0xffffffff;
+    }
+
+    static bool deflate_gzip(const unsigned char *data, size_t size, Output &out) {
+        // magic, deflate, no flags, no mtime, no extra flags, OS unix
+        static const unsigned char header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3};
+        out.put(header, sizeof(header));
+
+        Bits bits {out};
+        bits.put(1, 1); // BFINAL
+        bits.put(1, 2); // BTYPE 01, fixed Huffman codes
+
+        // head holds the last position + 1 of every hash of three bytes, prev chains the positions of a window
+        std::vector<size_t> head(size_t(1) << HASH_BITS), prev(WINDOW);
+        auto hash = [data](size_t i) {
+            uint32_t v = data[i] | data[i + 1] << 8 | data[i + 2] << 16;
+            return (v * 2654435761u) >> (32 - HASH_BITS);
+        };
+        auto insert = [&](size_t i) {
+            if (i + MIN_MATCH > size)
+                return;
+            uint32_t h = hash(i);
+            prev[i % WINDOW] = head[h];
+            head[h] = i + 1;
+        };
+
+        size_t i = 0;
+        while (i < size) {
+            int best_len = 0;
+            size_t best_dist = 0;
+            if (i + MIN_MATCH <= size) {
+                const int max_len = (int) std::min<size_t>(MAX_MATCH, size - i);
+                size_t cand = head[hash(i)];
+                for (int chain = 0; cand != 0 && chain < MAX_CHAIN; chain++) {
+                    const size_t pos = cand - 1;
+                    if (i - pos > WINDOW)
+                        break;
+                    if (data[pos + best_len] == data[i + best_len]) {
+                        int len = 0;
+                        while (len < max_len && data[pos + len] == data[i + len])
+                            len++;
+                        if (len > best_len) {
+                            best_len = len;
+                            best_dist = i - pos;
+                            if (len == max_len)
+                                break;
+                        }
+                    }
+                    const size_t next = prev[pos % WINDOW];
+                    if (next >= cand)
+                        break; // the slot was reused by a newer position
+                    cand = next;
+                }
+            }
+
+            if (best_len >= MIN_MATCH) {
+                put_match(bits, best_len, (int) best_dist);
+                for (int k = 0; k < best_len; k++)
+                    insert(i + k);
+                i += best_len;
+            } else {
+                put_symbol(bits, data[i]);
+                insert(i);
+                i++;
+            }
+        }
+
+        put_symbol(bits, 256); // end of block
+        bits.align();
+
+        const uint32_t trailer[2] = {crc32(data, size), (uint32_t) size};
+        for (uint32_t v : trailer) {
+            const unsigned char le[4] = {(unsigned char) v, (unsigned char) (v >> 8),
+                                         (unsigned char) (v >> 16), (unsigned char) (v >> 24)};
+            out.put(le, sizeof(le));
+        }
+
+        return !out.failed;
+    }
+#endif
+};
+#endif
+
+// sparse index of a closed text log file, written next to it as FILE.idx: one Block per LOG_INDEX_RECORDS
+// records with their offset, time range, levels and a bloom filter of their thread ids, so that
+// tools/threadlog-query only reads the blocks a query can match. times are the record timestamps as
+// they were written, in ns and without a time zone
+class LogIndex {
+public:
+    static constexpr uint64_t MAGIC = 0x31584449474f4c54; // "TLOGIDX1"
+
+    struct Header {
+        uint64_t magic;
+        uint32_t block_records;
+        uint32_t blocks;
+        uint64_t file_size; // of the file the index was built from, a different size means it is stale
+        int64_t min_ns;
+        int64_t max_ns;
+    };
+
+    struct Block {
+        uint64_t offset;
+        uint64_t size;
+        uint32_t records;
+        uint32_t levels;    // bit ERROR_LEVEL .. DEBUG_LEVEL set if a record of that level is in the block
+        int64_t min_ns;
+        int64_t max_ns;
+        uint64_t tids[2];   // bloom filter, two bits per thread id
+    };
+
+    // what a record starts with, continuation lines do not parse
+    struct Record {
+        int64_t ns;
+        int level;
+        int tid;
+    };
+
+    // "2024/01/31 12:00:00:000" or a prefix of it that ends with a field, *unit is the span of the last
+    // field given (a day for "2024/01/31") so that a prefix can be taken as a period
+    static bool parse_time(std::string_view s, int64_t &ns, int64_t *unit = nullptr) {
+        static const int widths[] = {4, 2, 2, 2, 2, 2};
+        static const char separators[] = "// ::";
+        int fields[6] = {0, 1, 1, 0, 0, 0};
+        static const int64_t units[] = {0, 0, 86400000000000LL, 3600000000000LL, 60000000000LL, 1000000000LL};
+
+        size_t at = 0;
+        int given = 0;
+        for (; given < 6; given++) {
+            if (given > 0) {
+                if (at == s.size() && given >= 3)
+                    break;
+                if (at >= s.size() || s[at] != separators[given - 1])
+                    return false;
+                at++;
+            }
+            if (!parse_digits(s, at, widths[given], fields[given]))
+                return false;
+        }
+        if (given < 3)
+            return false;
+
+        int64_t last_unit = units[given - 1];
+        int64_t fraction = 0;
+        if (given == 6 && at < s.size()) {
+            if (s[at] != ':')
+                return false;
+            at++;
+            int64_t scale = 1000000000;
+            const size_t digits_from = at;
+            for (; at < s.size() && s[at] >= '0' && s[at] <= '9'; at++) {
+                scale /= 10;
+                fraction += (s[at] - '0') * scale;
+            }
+            if (at == digits_from || at - digits_from > 9)
+                return false;
+            last_unit = std::max<int64_t>(scale, 1);
+        }
+        if (at != s.size())
+            return false;
+
+        const int64_t days = days_from_civil(fields[0], fields[1], fields[2]);
+        ns = ((days * 24 + fields[3]) * 60 + fields[4]) * 60 + fields[5];
+        ns = ns * 1000000000 + fraction;
+        if (unit != nullptr)
+            *unit = last_unit;
+        return true;
+    }
+
+    // the timestamp, level and thread id of a text, JSON or logfmt record
+    static bool parse_record(const char *line, size_t len, Record &r) {
+        std::string_view s(line, len);
+        s.remove_prefix(skip_escapes(s, 0)); // LOG_ERROR colors the whole line
+        const bool json = s.compare(0, 7, "{\"ts\":\"") == 0;
+        const bool logfmt = !json && s.compare(0, 4, "ts=\"") == 0;
+        const size_t ts_at = json ? 7 : logfmt ? 4 : 0;
+
+        const size_t ts_end = s.find_first_not_of("0123456789/: ", ts_at);
+        if (ts_end == std::string_view::npos || ts_end - ts_at < 19 ||
+            !parse_time(s.substr(ts_at, ts_end - ts_at - (s[ts_end - 1] == ' ')), r.ns))
+            return false;
+
+        if (json || logfmt) {
+            const std::string_view level_key = json ? "\"level\":\"" : "level=";
+            const std::string_view tid_key = json ? "\"tid\":" : "tid=";
+            const size_t level_at = s.find(level_key, ts_end);
+            const size_t tid_at = s.find(tid_key, ts_end);
+            if (level_at == std::string_view::npos || tid_at == std::string_view::npos)
+                return false;
+            size_t from = level_at + level_key.size();
+            if (from < s.size() && s[from] == '"')
+                from++;
+            r.level = level_of(s.substr(from, s.find_first_of("\" ", from) - from));
+            return parse_int(s, tid_at + tid_key.size(), r.tid);
+        }
+
+        // "<time> [Module][TYPE]: <color><tid>:"
+        const size_t type_at = s.find("][", ts_end);
+        const size_t type_end = s.find("]:", ts_end);
+        if (type_at == std::string_view::npos || type_end == std::string_view::npos || type_end < type_at)
+            return false;
+        r.level = level_of(s.substr(type_at + 2, type_end - type_at - 2));
+
+        size_t at = type_end + 2;
+        if (at < s.size() && s[at] == ' ')
+            at++;
+        at = skip_escapes(s, at);
+        return parse_int(s, at, r.tid);
+    }
+
+    static int level_of(std::string_view type) {
+        if (type == "ERROR")
+            return ERROR_LEVEL;
+        if (type == "WARN")
+            return WARN_LEVEL;
+        if (type == "DEBUG")
+            return DEBUG_LEVEL;
+        return INFO_LEVEL;
+    }
+
+    static void add_tid(uint64_t tids[2], int tid) {
+        const uint64_t h = (uint64_t) (uint32_t) tid * 0x9e3779b97f4a7c15ULL;
+        tids[(h >> 6) & 1] |= 1ULL << (h & 63);
+        tids[(h >> 38) & 1] |= 1ULL << ((h >> 32) & 63);
+    }
+
+    static bool may_have_tid(const uint64_t tids[2], int tid) {
+        uint64_t one[2] = {0, 0};
+        add_tid(one, tid);
+        return (tids[0] & one[0]) == one[0] && (tids[1] & one[1]) == one[1];
+    }
+
+    // offset of the next '\n' at or after from, size if there is none; 32 or 16 bytes at a time with AVX2/SSE2
+    static size_t find_newline(const char *data, size_t from, size_t size) {
+        size_t i = from;
+#if defined (__AVX2__)
+        const __m256i nl = _mm256_set1_epi8('\n');
+        for (; i + 32 <= size; i += 32) {
+            const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+            const uint32_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+            if (mask)
+                return i + __builtin_ctz(mask);
+        }
+#endif
+#if defined (__SSE2__)
+        const __m128i nl16 = _mm_set1_epi8('\n');
+        for (; i + 16 <= size; i += 16) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+            const uint32_t mask = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl16));
+            if (mask)
+                return i + __builtin_ctz(mask);
+        }
+#endif
+        const void *p = i < size ? memchr(data + i, '\n', size - i) : nullptr;
+        return p ? static_cast<const char *>(p) - data : size;
+    }
+
+    // f(offset, length, record or nullptr) for every line of data[from, to), the '\n' not included
+    template<typename F>
+    static void for_each_line(const char *data, size_t from, size_t to, F &&f) {
+        while (from < to) {
+            const size_t end = find_newline(data, from, to);
+            Record r;
+            f(from, end - from, parse_record(data + from, end - from, r) ? &r : nullptr);
+            from = end + 1;
+        }
+    }
+
+    static std::vector<Block> blocks_of(const char *data, size_t size, uint32_t block_records) {
+        std::vector<Block> blocks;
+        for_each_line(data, 0, size, [&](size_t offset, size_t len, const Record *r) {
+            if (r != nullptr && (blocks.empty() || blocks.back().records == block_records))
+                blocks.push_back({offset, 0, 0, 0, r->ns, r->ns, {0, 0}});
+            if (blocks.empty())
+                return; // lines before the first record are left out
+            Block &b = blocks.back();
+            b.size = offset + len + 1 - b.offset;
+            if (r == nullptr)
+                return;
+            b.records++;
+            b.levels |= 1u << r->level;
+            b.min_ns = std::min(b.min_ns, r->ns);
+            b.max_ns = std::max(b.max_ns, r->ns);
+            add_tid(b.tids, r->tid);
+        });
+        if (!blocks.empty())
+            blocks.back().size = std::min<uint64_t>(blocks.back().size, size - blocks.back().offset);
+        return blocks;
+    }
+
+    // indexes the text log file path into idx_path, written through idx_path.tmp
+    static bool build(const std::string &path, const std::string &idx_path) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr,"LogIndex::build() open() failed!\n");
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            fprintf(stderr,"LogIndex::build() fstat() failed!\n");
+            close(fd);
+            return false;
+        }
+
+        const size_t size = st.st_size;
+        std::vector<Block> blocks;
+        if (size > 0) {
+            void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED) {
+                fprintf(stderr,"LogIndex::build() mmap() failed!\n");
+                close(fd);
+                return false;
+            }
+            madvise(map, size, MADV_SEQUENTIAL);
+            blocks = blocks_of(static_cast<const char *>(map), size, LOG_INDEX_RECORDS);
+            munmap(map, size);
+        }
+        close(fd);
+
+        Header h {MAGIC, LOG_INDEX_RECORDS, (uint32_t) blocks.size(), size, INT64_MAX, INT64_MIN};
+        for (const Block &b : blocks) {
+            h.min_ns = std::min(h.min_ns, b.min_ns);
+            h.max_ns = std::max(h.max_ns, b.max_ns);
+        }
+
+        const std::string tmp_path = idx_path + ".tmp";
+        int out = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out < 0) {
+            fprintf(stderr,"LogIndex::build() open() failed!\n");
+            return false;
+        }
+        bool ok = write_fd(out, reinterpret_cast<const char *>(&h), sizeof(h)) &&
+                  write_fd(out, reinterpret_cast<const char *>(blocks.data()), blocks.size() * sizeof(Block));
+        ok = close(out) == 0 && ok;
+        if (!ok || rename(tmp_path.c_str(), idx_path.c_str()) != 0) {
+            fprintf(stderr,"LogIndex::build() write failed!\n");
+            unlink(tmp_path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // false if idx_path is missing or damaged, an index of another version of the file has
+    // another h.file_size
+    static bool read(const std::string &idx_path, Header &h, std::vector<Block> &blocks) {
+        int fd = open(idx_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+
+        bool ok = pread(fd, &h, sizeof(h), 0) == (ssize_t) sizeof(h) && h.magic == MAGIC;
+        if (ok) {
+            blocks.resize(h.blocks);
+            const ssize_t bytes = (ssize_t) (h.blocks * sizeof(Block));
+            ok = pread(fd, blocks.data(), bytes, sizeof(h)) == bytes;
+        }
+        close(fd);
+        return ok;
+    }
+
+    // length of the color escapes ("\x1b[...m") at s[at], 0 if there is none
+    static size_t escape_len(std::string_view s, size_t at) {
+        if (at + 1 >= s.size() || s[at] != '\x1b' || s[at + 1] != '[')
+            return 0;
+        const size_t end = s.find('m', at + 2);
+        return end == std::string_view::npos ? 0 : end + 1 - at;
+    }
+
+private:
+    static bool parse_digits(std::string_view s, size_t &at, int width, int &value) {
+        if (at + width > s.size())
+            return false;
+        value = 0;
+        for (int i = 0; i < width; i++, at++) {
+            if (s[at] < '0' || s[at] > '9')
+                return false;
+            value = value * 10 + (s[at] - '0');
+        }
+        return true;
+    }
+
+    static bool parse_int(std::string_view s, size_t at, int &value) {
+        if (at >= s.size())
+            return false;
+        const auto [p, ec] = std::from_chars(s.data() + at, s.data() + s.size(), value);
+        (void) p;
+        return ec == std::errc();
+    }
+
+    static size_t skip_escapes(std::string_view s, size_t at) {
+        while (size_t n = escape_len(s, at))
+            at += n;
+        return at;
+    }
+
+    // days since 1970/01/01 of a proleptic Gregorian date
+    static int64_t days_from_civil(int64_t y, int m, int d) {
+        y -= m <= 2;
+        const int64_t era = (y >= 0 ? y : y - 399) / 400;
+        const int64_t yoe = y - era * 400;
+        const int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+        const int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+        return era * 146097 + doe - 719468;
+    }
+};
+
+class RotateLog {
+public:
+    // called with the fd and current size of every file opened, e.g. to write a file header
+    typedef void (*OpenHook)(int fd, size_t size);
+
+    static RotateLog& get_instance() {
+#if defined (LOG_BINARY)
+        static RotateLog instance(LOG_FILE, LOG_FILE_SIZE_LIMIT,
+                                  [](int fd, size_t) { BinaryLog::write_file_header(fd); });
+#else
+        static RotateLog instance(LOG_FILE, LOG_FILE_SIZE_LIMIT);
+#endif
+        return instance;
+    }
+
+    RotateLog(const char *path, size_t size_limit, OpenHook on_open = nullptr)
+        : m_path(path), m_size_limit(size_limit), m_on_open(on_open) {
+        // finish the rotations that were interrupted by the last exit
+        recover_rotated();
+
+        if (!open_log_file()) {
+            fprintf(stderr,"RotateLog::RotateLog() open_log_file() failed!\n");
+        }
+    }
+
+    ~RotateLog() {
+        {
+            std::scoped_lock l(m_rotate_lock);
+            m_rotator_stop = true;
+        }
+        m_rotate_cv.notify_all();
+        if (m_rotator.joinable())
+            m_rotator.join();
+
+        close_log_file();
+    }
+
+    // group commit counters, writes / batches is the mean batch size
+    struct Stats {
+        uint64_t batches;          // writev() or io_uring submissions
+        uint64_t writes;           // write() calls they carried
+        uint64_t bytes;
+        uint64_t max_batch_writes;
+        uint64_t max_batch_bytes;
+        uint64_t write_ns;         // in writev() or io_uring, a linked fdatasync() included
+        uint64_t max_write_ns;
+        uint64_t syncs;            // fdatasync() calls
+        uint64_t urgent_syncs;     // of them for batches with an ERROR record
+        uint64_t sync_ns;          // in fdatasync() calls not linked to their write
+        uint64_t max_sync_ns;
+        uint64_t commit_waits;     // write() calls queued behind another caller's batch
+        uint64_t commit_wait_ns;   // they spent waiting for it, batches they led themselves not included
+        uint64_t max_commit_wait_ns;
+    };
+
+    // appends one finished record
+    void write(const char *data, size_t len) {
+        struct iovec iov {const_cast<char *>(data), len};
+        write(&iov, 1, len);
+    }
+
+    // appends a run of records, bytes is their total size, urgent if one of them has to be durable at once.
+    // Callers that come while a batch is being written queue their iovecs and wait, the first of them writes
+    // all queued runs as the next batch with one writev() or io_uring submission (group commit); a caller
+    // returns once its run is written and, as LOG_FSYNC says, synced
+    void write(struct iovec *iov, int n, size_t bytes, bool urgent = false) {
+#if defined (LOG_FILE_MMAP)
+        map_write(iov, n, bytes, urgent);
+#else
+        std::unique_lock l(m_commit_lock);
+        if (!m_committing && m_queue.empty()) {
+            // nobody is writing or waiting, the run is a batch of its own and is not copied
+            m_committing = true;
+            const uint64_t batch = m_next_batch++;
+            l.unlock();
+            end_batch(l, batch, 1, bytes, urgent, write_batch(iov, n, bytes, urgent));
+            return;
+        }
+
+        m_queue.insert(m_queue.end(), iov, iov + n);
+        m_queue_bytes += bytes;
+        m_queue_writes++;
+        m_queue_urgent |= urgent;
+
+        const uint64_t batch = m_next_batch;
+        const uint64_t queued_at = mono_ns();
+        uint64_t led_ns = 0;
+        while (m_done_batches <= batch) {
+            if (m_committing) {
+                m_commit_cv.wait(l);
+            } else {
+                const uint64_t lead_start = mono_ns();
+                commit_batch(l);
+                led_ns += mono_ns() - lead_start;
+            }
+        }
+
+        const uint64_t wait_ns = mono_ns() - queued_at - led_ns;
+        m_stats.commit_waits++;
+        m_stats.commit_wait_ns += wait_ns;
+        m_stats.max_commit_wait_ns = std::max(m_stats.max_commit_wait_ns, wait_ns);
+        l.unlock();
+        LogTelemetry::lock_wait(wait_ns);
+#endif
+    }
+
+    Stats stats() {
+        std::scoped_lock l(m_commit_lock);
+        return m_stats;
+    }
+
+private:
+    const std::string m_path;
+    const size_t m_size_limit;
+    const OpenHook m_on_open;
+
+    int m_fd {-1};
+    size_t m_size {0}; // bytes in the open file, counted instead of stat()ed
+    long m_next_check_ms {0};
+
+    // the writer only renames m_path to m_path.rotating.<seq> and queues it, m_rotator indexes and compresses
+    // the queued files and runs the rename cascade for them in rotation order
+    std::mutex m_rotate_lock;
+    std::condition_variable m_rotate_cv;
+    std::thread m_rotator;
+    std::deque<std::string> m_rotated;
+    uint64_t m_rotate_seq {1};
+    bool m_rotator_stop {false};
+
+    std::mutex m_commit_lock;
+    Stats m_stats {}; // stays zero with LOG_FILE_MMAP, writers do not meet there
+
+#if !defined (LOG_FILE_MMAP)
+    // group commit: runs queued since the current batch started, written by the next leader
+    std::condition_variable m_commit_cv;
+    std::vector<struct iovec> m_queue;
+    std::vector<struct iovec> m_batch; // the leader's copy, keeps its capacity
+    size_t m_queue_bytes {0};
+    uint64_t m_queue_writes {0};
+    bool m_queue_urgent {false};
+    uint64_t m_next_batch {0};   // number of the batch m_queue becomes
+    uint64_t m_done_batches {0}; // batches before it are written
+    bool m_committing {false};
+
+    size_t m_unsynced {0}; // bytes written since the last fdatasync()
+    long m_next_sync_ms {0};
+    LogUring m_uring;
+
+    static uint64_t mono_ns() {
+        struct timespec ts{};
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    // time spent on a batch, sync_ns is 0 when the fdatasync() was linked to the write or did not run
+    struct BatchTimes {
+        uint64_t write_ns;
+        uint64_t sync_ns;
+        bool synced;
+    };
+
+    // called by the caller that leads the queued runs as the next batch, m_commit_lock is released while
+    // it is written
+    void commit_batch(std::unique_lock<std::mutex> &l) {
+        m_committing = true;
+        m_batch.swap(m_queue);
+        const size_t bytes = m_queue_bytes;
+        const uint64_t writes = m_queue_writes;
+        const bool urgent = m_queue_urgent;
+        const uint64_t batch = m_next_batch++;
+        m_queue_bytes = 0;
+        m_queue_writes = 0;
+        m_queue_urgent = false;
+        l.unlock();
+
+        const BatchTimes times = write_batch(m_batch.data(), (int) m_batch.size(), bytes, urgent);
+        m_batch.clear();
+        end_batch(l, batch, writes, bytes, urgent, times);
+    }
+
+    void end_batch(std::unique_lock<std::mutex> &l, uint64_t batch, uint64_t writes, size_t bytes, bool urgent,
+                   const BatchTimes &times) {
+        l.lock();
+        m_stats.batches++;
+        m_stats.writes += writes;
+        m_stats.bytes += bytes;
+        m_stats.max_batch_writes = std::max(m_stats.max_batch_writes, writes);
+        m_stats.max_batch_bytes = std::max<uint64_t>(m_stats.max_batch_bytes, bytes);
+        m_stats.write_ns += times.write_ns;
+        m_stats.max_write_ns = std::max(m_stats.max_write_ns, times.write_ns);
+        if (times.synced) {
+            m_stats.syncs++;
+            m_stats.urgent_syncs += urgent;
+            m_stats.sync_ns += times.sync_ns;
+            m_stats.max_sync_ns = std::max(m_stats.max_sync_ns, times.sync_ns);
+        }
+
+        m_done_batches = batch + 1;
+        m_committing = false;
+        m_commit_cv.notify_all();
+    }
+
+    // whether the batch being written is followed by fdatasync()
+    bool sync_due(size_t bytes, bool urgent) {
+        m_unsynced += bytes;
+        if (urgent && LOG_FSYNC_ERRORS)
+            return true;
+
+#if LOG_FSYNC == LOG_FSYNC_ALWAYS
+        return true;
+#elif LOG_FSYNC == LOG_FSYNC_BYTES
+        return m_unsynced >= LOG_FSYNC_EVERY_BYTES;
+#elif LOG_FSYNC == LOG_FSYNC_INTERVAL
+        struct timespec ts{};
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        const long now_ms = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+        if (now_ms < m_next_sync_ms)
+            return false;
+        m_next_sync_ms = now_ms + LOG_FSYNC_EVERY_MS;
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    BatchTimes write_batch(struct iovec *iov, int n, size_t bytes, bool urgent) {
+        BatchTimes times {0, 0, false};
+        bool &synced = times.synced;
+        if (!prepare_log_file())
+            return times;
+
+        const bool sync = sync_due(bytes, urgent);
+        const uint64_t start = mono_ns();
+
+        // io_uring takes IOV_MAX buffers per writev, the fdatasync() is linked to the last one
+        bool ok = true;
+        while (n > 0 && m_uring.ok()) {
+            const int chunk = std::min(n, IOV_MAX);
+            size_t chunk_bytes = 0;
+            for (int i = 0; i < chunk; i++)
+                chunk_bytes += iov[i].iov_len;
+
+            const ssize_t written = m_uring.writev(m_fd, iov, chunk, sync && chunk == n, synced);
+            if (written < 0) {
+                fprintf(stderr,"RotateLog::write_batch() io_uring failed, using writev()\n");
+                m_uring.disable();
+                break;
+            }
+            skip_iov(iov, n, written);
+            if ((size_t) written < chunk_bytes)
+                break;
+        }
+
+        if (n > 0 && !writev_fd(m_fd, iov, n)) {
+            fprintf(stderr,"RotateLog::write_batch() writev() failed!\n");
+            ok = false;
+        }
+        times.write_ns = mono_ns() - start;
+
+        if (sync && !synced && ok) {
+            const uint64_t sync_start = mono_ns();
+            if (fdatasync(m_fd) != 0) {
+                fprintf(stderr,"RotateLog::write_batch() fdatasync() failed!\n");
+            } else {
+                synced = true;
+            }
+            times.sync_ns = mono_ns() - sync_start;
+            LogTelemetry::sync(times.sync_ns);
+        }
+
+        if (synced)
+            m_unsynced = 0;
+        if (ok)
+            m_size += bytes;
+        return times;
+    }
+#endif
+
+#if defined (LOG_FILE_MMAP)
+    // one mapped file, the two segments take turns so a writer that loaded m_segment just before a rotation
+    // still subtracts from a live object: left is negative until the segment is published again, whatever
+    // its capacity is then, and the writer retries on the next segment
+    struct Segment {
+        int fd {-1};
+        char *map {nullptr};
+        size_t capacity {0};             // 0 while no file could be mapped, records are dropped
+        std::atomic<int64_t> left {0};   // bytes not handed out yet, negative once the segment is full
+        std::atomic<size_t> written {0}; // bytes copied in
+        std::atomic<size_t> synced {0};  // msync()ed up to here
+        std::atomic<uint64_t> dev {0};   // of the mapped file, compared with m_path by the liveness check
+        std::atomic<uint64_t> ino {0};
+    };
+
+    Segment m_segments[2];
+    std::atomic<Segment *> m_segment {nullptr};
+    std::atomic<long> m_next_sync_ms {0};
+    std::atomic<long> m_next_alive_ms {0};
+
+    // the writer whose reservation crosses capacity rotates, the ones after it wait for the next segment
+    void map_write(const struct iovec *iov, int n, size_t bytes, bool urgent) {
+        if (bytes > m_size_limit) {
+            fprintf(stderr,"RotateLog::map_write() record larger than the log file dropped!\n");
+            LogTelemetry::dropped();
+            return;
+        }
+
+        for (;;) {
+            Segment *seg = m_segment.load(std::memory_order_acquire);
+            if (seg == nullptr)
+                return;
+
+            if (map_check_due() && !map_file_alive(seg)) {
+                // taking the whole rest makes this writer the one that rotates the segment, by reopening m_path
+                fprintf(stderr,"RotateLog::map_write() log file was removed, reopening\n");
+                const int64_t left = seg->left.fetch_sub((int64_t) seg->capacity + 1, std::memory_order_acq_rel);
+                if (left >= 0 && !map_rotate(seg, seg->capacity - left, true))
+                    return;
+                continue;
+            }
+
+            const int64_t left = seg->left.fetch_sub(bytes, std::memory_order_acq_rel);
+            if (left >= (int64_t) bytes) {
+                const size_t at = seg->capacity - left;
+                char *dst = seg->map + at;
+                for (int i = 0; i < n; i++) {
+                    memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+                    dst += iov[i].iov_len;
+                }
+                if (urgent && LOG_FSYNC_ERRORS)
+                    sync_range(seg, at, at + bytes);
+                else
+                    map_sync(seg, at + bytes);
+                seg->written.fetch_add(bytes, std::memory_order_release);
+                return;
+            }
+
+            if (left >= 0) {
+                // a failed rotation drops the record instead of retrying it forever
+                if (!map_rotate(seg, seg->capacity - left))
+                    return;
+            } else {
+                while (m_segment.load(std::memory_order_acquire) == seg)
+                    std::this_thread::yield();
+            }
+        }
+    }
+
+    // called with a reservation held, so the segment stays mapped
+    void map_sync(Segment *seg, size_t end) {
+#if LOG_MMAP_SYNC == LOG_MMAP_SYNC_ALWAYS
+        sync_range(seg, end - std::min(end, (size_t) LOG_RECORD_SIZE), end);
+#elif LOG_MMAP_SYNC == LOG_MMAP_SYNC_INTERVAL
+        struct timespec ts{};
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        const long now_ms = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+        long due = m_next_sync_ms.load(std::memory_order_relaxed);
+        if (now_ms >= due && m_next_sync_ms.compare_exchange_strong(due, now_ms + LOG_MMAP_SYNC_MS))
+            sync_range(seg, seg->synced.load(std::memory_order_relaxed), end);
+#else
+        (void) seg;
+        (void) end;
+#endif
+    }
+
+    static void sync_range(Segment *seg, size_t from, size_t to) {
+        static const size_t page = sysconf(_SC_PAGESIZE);
+        from -= from % page;
+        if (from >= to)
+            return;
+
+        const uint64_t start = LogTelemetry::now_ns();
+        if (msync(seg->map + from, to - from, MS_SYNC) != 0) {
+            fprintf(stderr,"RotateLog::sync_range() msync() failed!\n");
+            return;
+        }
+        LogTelemetry::sync(LogTelemetry::now_ns() - start);
+
+        size_t synced = seg->synced.load(std::memory_order_relaxed);
+        while (synced < to && !seg->synced.compare_exchange_weak(synced, to)) {
+        }
+    }
+
+    // the reservations before used are all copied in once written reaches it, then the file is cut to used
+    // and renamed, or reopened when it was removed; false if no file is mapped afterwards
+    bool map_rotate(Segment *seg, size_t used, bool reopen = false) {
+        while (seg->written.load(std::memory_order_acquire) != used)
+            std::this_thread::yield();
+
+        if (seg->map && reopen) {
+            if (!close_log_file() || !open_log_file()) {
+                fprintf(stderr,"RotateLog::map_rotate() reopen failed!\n");
+            }
+        } else if (seg->map) {
+            if (!rotate_logs()) {
+                fprintf(stderr,"RotateLog::map_rotate() rotate_logs() failed!\n");
+            }
+        } else if (check_due()) {
+            // no file since the last failure, only retried every LOG_FILE_CHECK_MS
+            if (!open_log_file()) {
+                fprintf(stderr,"RotateLog::map_rotate() open_log_file() failed!\n");
+            }
+        }
+
+        if (m_segment.load(std::memory_order_relaxed) == seg)
+            publish(next_segment(), -1, nullptr, 0, 0);
+
+        return m_segment.load(std::memory_order_relaxed)->capacity != 0;
+    }
+
+    // the liveness check of prepare_log_file() for the lock free writers, one of them runs it every
+    // LOG_FILE_CHECK_MS
+    bool map_check_due() {
+        struct timespec ts{};
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        const long now_ms = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+        long due = m_next_alive_ms.load(std::memory_order_relaxed);
+        return now_ms >= due && m_next_alive_ms.compare_exchange_strong(due, now_ms + LOG_FILE_CHECK_MS);
+    }
+
+    // false if m_path no longer names the mapped file (rm, logrotate), a segment without a file is alive
+    bool map_file_alive(const Segment *seg) const {
+        const uint64_t ino = seg->ino.load(std::memory_order_relaxed);
+        if (ino == 0)
+            return true;
+
+        struct stat path_st{};
+        return stat(m_path.c_str(), &path_st) == 0 && (uint64_t) path_st.st_ino == ino &&
+               (uint64_t) path_st.st_dev == seg->dev.load(std::memory_order_relaxed);
+    }
+
+    Segment *next_segment() {
+        Segment *seg = m_segment.load(std::memory_order_relaxed);
+        return seg == &m_segments[0] ? &m_segments[1] : &m_segments[0];
+    }
+
+    // left is stored last, a writer that takes bytes from it sees the mapping as well
+    void publish(Segment *seg, int fd, char *map, size_t capacity, size_t used) {
+        struct stat st{};
+        const bool stated = fd >= 0 && fstat(fd, &st) == 0;
+        seg->dev.store(stated ? st.st_dev : 0, std::memory_order_relaxed);
+        seg->ino.store(stated ? st.st_ino : 0, std::memory_order_relaxed);
+        seg->fd = fd;
+        seg->map = map;
+        seg->capacity = capacity;
+        seg->written.store(used, std::memory_order_relaxed);
+        seg->synced.store(used, std::memory_order_relaxed);
+        seg->left.store((int64_t) capacity - (int64_t) used, std::memory_order_release);
+        m_segment.store(seg, std::memory_order_release);
+    }
+
+    // bytes of a mapped file that hold records: whole frames of a LOG_BINARY file, text up to its zero tail
+    static size_t used_length(const char *map, size_t size) {
+        if (size > BinaryLog::FRAME_HEADER_SIZE + sizeof(BinaryLog::MAGIC) && map[0] == BinaryLog::FrameHeader &&
+            memcmp(map + BinaryLog::FRAME_HEADER_SIZE, BinaryLog::MAGIC, sizeof(BinaryLog::MAGIC)) == 0)
+            return BinaryLog::frames_end(map, size);
+
+        while (size > 0 && map[size - 1] == '\0')
+            size--;
+        return size;
+    }
+
+    bool open_log_file() {
+        const int fd = open(m_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            fprintf(stderr,"open() log file failed!\n");
+            return false;
+        }
+
+        // the zero tail a crash left behind is cut before the open hook appends to the records
+        struct stat st{};
+        size_t used = fstat(fd, &st) == 0 ? st.st_size : 0;
+        if (used > 0) {
+            void *old = mmap(nullptr, used, PROT_READ, MAP_SHARED, fd, 0);
+            if (old != MAP_FAILED) {
+                used = used_length(static_cast<char *>(old), used);
+                munmap(old, st.st_size);
+            }
+            if (used != (size_t) st.st_size && ftruncate(fd, used) != 0) {
+                fprintf(stderr,"RotateLog::open_log_file() ftruncate() failed!\n");
+            }
+        }
+
+        if (m_on_open) {
+            lseek(fd, used, SEEK_SET);
+            m_on_open(fd, used);
+            used = lseek(fd, 0, SEEK_CUR);
+        }
+
+        // a file that already reached the limit, e.g. written with a larger one, is rotated by the first record
+        const size_t capacity = std::max(used, m_size_limit);
+
+        int err = posix_fallocate(fd, 0, capacity);
+        if (err == EOPNOTSUPP || err == EINVAL)
+            err = ftruncate(fd, capacity) == 0 ? 0 : errno;
+        if (err != 0) {
+            fprintf(stderr,"RotateLog::open_log_file() fallocate() failed!\n");
+            close(fd);
+            return false;
+        }
+
+        void *map = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            fprintf(stderr,"RotateLog::open_log_file() mmap() failed!\n");
+            close(fd);
+            return false;
+        }
+
+        publish(next_segment(), fd, static_cast<char *>(map), capacity, used);
+        return true;
+    }
+
+    bool close_log_file() {
+        Segment *seg = m_segment.load(std::memory_order_acquire);
+        if (seg == nullptr || seg->map == nullptr)
+            return true;
+
+        const size_t used = std::min(seg->written.load(std::memory_order_acquire), seg->capacity);
+#if LOG_MMAP_SYNC != LOG_MMAP_SYNC_NONE
+        sync_range(seg, seg->synced.load(std::memory_order_relaxed), used);
+#endif
+        munmap(seg->map, seg->capacity);
+        seg->map = nullptr;
+
+        bool ok = true;
+        if (ftruncate(seg->fd, used) != 0) {
+            fprintf(stderr,"RotateLog::close_log_file() ftruncate() failed!\n");
+            ok = false;
+        }
+
+        if (close(seg->fd) != 0) {
+            fprintf(stderr,"close() log file failed!\n");
+            ok = false;
+        }
+
+        seg->fd = -1;
+        return ok;
+    }
+#endif
+
+    bool prepare_log_file() {
+        if (m_fd < 0) {
+            if (!open_log_file()) {
+                fprintf(stderr,"RotateLog::log() open_log_file() failed!\n");
+                return false;
+            }
+        } else if (check_due() && !log_file_alive()) {
+            fprintf(stderr,"RotateLog::log() log file was removed, reopening\n");
+
+            if (!close_log_file()) {
+                fprintf(stderr,"RotateLog::log() close_log_file() failed!\n");
+                return false;
+            }
+
+            if (!open_log_file()) {
+                fprintf(stderr,"RotateLog::log() open_log_file() failed!\n");
+                return false;
+            }
+        }
+
+        if (m_size >= m_size_limit) {
+            if (!rotate_logs()) {
+                fprintf(stderr,"RotateLog::log() rotate_logs() failed!\n");
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // rate limits the liveness check, CLOCK_MONOTONIC_COARSE is read from the vDSO
+    bool check_due() {
+        struct timespec ts{};
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        long now_ms = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+        if (now_ms < m_next_check_ms)
+            return false;
+
+        m_next_check_ms = now_ms + LOG_FILE_CHECK_MS;
+        return true;
+    }
+
+    // false if the open file was deleted or m_path now names another file (logrotate, rm)
+    bool log_file_alive() const {
+        struct stat fd_st{}, path_st{};
+
+        if (fstat(m_fd, &fd_st) != 0 || fd_st.st_nlink == 0)
+            return false;
+
+        if (stat(m_path.c_str(), &path_st) != 0)
+            return false;
+
+        return fd_st.st_ino == path_st.st_ino && fd_st.st_dev == path_st.st_dev;
+    }
+
+    // never waits for the rotator: a full file is only renamed and queued, however far behind it is
+    bool rotate_logs() {
+        const uint64_t start = LogTelemetry::now_ns();
+        if (!close_log_file()) {
+            fprintf(stderr,"RotateLog::rotate_logs() close_log_file() failed!\n");
+            return false;
+        }
+
+        std::unique_lock l(m_rotate_lock);
+        const std::string rotated = m_path + ".rotating." + std::to_string(m_rotate_seq++);
+        if (rename(m_path.c_str(), rotated.c_str()) == 0) {
+            m_rotated.push_back(rotated);
+            if (!m_rotator.joinable())
+                m_rotator = std::thread([this] { rotator_loop(); });
+        } else if (errno != ENOENT) {
+            fprintf(stderr,"RotateLog::rotate_logs() rename() failed!\n");
+            return false;
+        }
+        l.unlock();
+        m_rotate_cv.notify_all();
+
+        if (!open_log_file()) {
+            fprintf(stderr,"RotateLog::rotate_logs() open_log_file() failed!\n");
+            return false;
+        }
+
+        LogTelemetry::rotation(LogTelemetry::now_ns() - start);
+        return true;
+    }
+
+    // drains the queue before it stops, so no rotated file is left behind by a clean exit
+    void rotator_loop() {
+        std::unique_lock l(m_rotate_lock);
+
+        for (;;) {
+            m_rotate_cv.wait(l, [this] { return !m_rotated.empty() || m_rotator_stop; });
+
+            while (!m_rotated.empty()) {
+                std::string rotated = m_rotated.front();
+                l.unlock();
+#if defined (LOG_INDEX)
+                if (!is_gz(rotated) && !LogIndex::build(rotated, index_name(rotated))) {
+                    fprintf(stderr,"RotateLog::rotator_loop() LogIndex::build() failed!\n");
+                }
+#endif
+#if defined (LOG_COMPRESS)
+                if (!is_gz(rotated)) {
+                    if (LogCompress::gzip_file(rotated, rotated + ".gz")) {
+                        if (unlink(rotated.c_str()) != 0) {
+                            fprintf(stderr,"RotateLog::rotator_loop() unlink() failed!\n");
+                        }
+                        rotated += ".gz";
+                    } else {
+                        fprintf(stderr,"RotateLog::rotator_loop() gzip_file() failed!\n");
+                    }
+                }
+#endif
+                if (!shift_logs(rotated)) {
+                    fprintf(stderr,"RotateLog::rotator_loop() shift_logs() failed!\n");
+                }
+                l.lock();
+                m_rotated.pop_front();
+            }
+
+            if (m_rotator_stop)
+                return;
+        }
+    }
+
+    // queues the m_path.rotating.<seq>[.gz] files of the last run in their order, drops half written .tmp
+    // files and the source of a finished .gz; m_path.rotating is the one full file of older versions.
+    // a finished .idx is left for shift_logs(), an unfinished one is built again
+    void recover_rotated() {
+        const size_t slash = m_path.rfind('/');
+        const std::string dir = slash == std::string::npos ? "." : m_path.substr(0, slash + 1);
+        const std::string prefix = m_path.substr(slash == std::string::npos ? 0 : slash + 1) + ".rotating";
+
+        DIR *d = opendir(dir.c_str());
+        if (d == nullptr)
+            return;
+
+        std::vector<std::pair<uint64_t, std::string>> found;
+        while (struct dirent *e = readdir(d)) {
+            const std::string name = e->d_name;
+            if (name.compare(0, prefix.size(), prefix) != 0)
+                continue;
+
+            const std::string path = dir + (slash == std::string::npos ? "/" : "") + name;
+            std::string_view rest = std::string_view(name).substr(prefix.size());
+            if (rest.size() >= 4 && rest.substr(rest.size() - 4) == ".tmp") {
+                unlink(path.c_str());
+                continue;
+            }
+
+            uint64_t seq = 0;
+            if (!rest.empty()) {
+                const char *end = rest.data() + rest.size();
+                auto [p, ec] = std::from_chars(rest.data() + 1, end, seq);
+                if (rest[0] != '.' || ec != std::errc() || seq == 0 ||
+                    (p != end && std::string_view(p, end - p) != ".gz"))
+                    continue;
+            }
+            found.emplace_back(seq, path);
+        }
+        closedir(d);
+
+        // a .gz sorts after its source, which is dropped as the .gz was complete before it was renamed
+        std::sort(found.begin(), found.end());
+        for (size_t i = 0; i < found.size(); i++) {
+            if (i + 1 < found.size() && found[i + 1].first == found[i].first) {
+                unlink(found[i].second.c_str());
+                continue;
+            }
+            m_rotated.push_back(found[i].second);
+            m_rotate_seq = std::max(m_rotate_seq, found[i].first + 1);
+        }
+
+        if (!m_rotated.empty())
+            m_rotator = std::thread([this] { rotator_loop(); });
+    }
+
+    static bool is_gz(const std::string &name) {
+        return name.size() > 3 && name.compare(name.size() - 3, 3, ".gz") == 0;
+    }
+
+    std::string rotated_name(int i, const char *suffix) const {
+        return m_path + "." + std::to_string(i) + suffix;
+    }
+
+    // the LOG_INDEX file of name, name.gz shares the one of its source
+    static std::string index_name(const std::string &name) {
+        return name.substr(0, name.size() - (is_gz(name) ? 3 : 0)) + ".idx";
+    }
+
+    // m_path.i[.gz][.idx] becomes m_path.i+1[.gz][.idx] and rotated becomes m_path.1[.gz], then the oldest
+    // files are dropped: m_path.LOG_ROTATE_NUM, or those beyond the LOG_ROTATE_BYTES budget
+    bool shift_logs(const std::string &rotated) const {
+        static const char *const suffixes[] = {"", ".gz", ".idx"};
+
+#if LOG_ROTATE_BYTES > 0
+        int last = 1;
+        while (access(rotated_name(last, "").c_str(), F_OK) == 0 ||
+               access(rotated_name(last, ".gz").c_str(), F_OK) == 0)
+            last++;
+#else
+        const int last = LOG_ROTATE_NUM;
+        for (const char *suffix : suffixes) {
+            if (unlink(rotated_name(last, suffix).c_str()) != 0 && errno != ENOENT) {
+                fprintf(stderr,"RotateLog::shift_logs() unlink() failed!\n");
+                return false;
+            }
+        }
+#endif
+
+        for (int i = last - 1; i >= 1; --i) {
+            for (const char *suffix : suffixes) {
+                if (rename(rotated_name(i, suffix).c_str(), rotated_name(i + 1, suffix).c_str()) != 0 &&
+                    errno != ENOENT) {
+                    fprintf(stderr,"RotateLog::shift_logs() rename() failed!\n");
+                    return false;
+                }
+            }
+        }
+
+        if (rename(rotated.c_str(), rotated_name(1, is_gz(rotated) ? ".gz" : "").c_str()) != 0 && errno != ENOENT) {
+            fprintf(stderr,"RotateLog::shift_logs() rename() failed!\n");
+            return false;
+        }
+        if (rename(index_name(rotated).c_str(), rotated_name(1, ".idx").c_str()) != 0 && errno != ENOENT) {
+            fprintf(stderr,"RotateLog::shift_logs() rename() failed!\n");
+            return false;
+        }
+
+#if LOG_ROTATE_BYTES > 0
+        uint64_t total = 0;
+        for (int i = 1; i <= last; i++) {
+            for (const char *suffix : suffixes) {
+                const std::string name = rotated_name(i, suffix);
+                struct stat st;
+                if (stat(name.c_str(), &st) != 0)
+                    continue;
+
+                total += st.st_size;
+                if (i > 1 && total > (uint64_t) LOG_ROTATE_BYTES && unlink(name.c_str()) != 0) {
+                    fprintf(stderr,"RotateLog::shift_logs() unlink() failed!\n");
+                    return false;
+                }
+            }
+        }
+#endif
+
+        return true;
+    }
+
+#if !defined (LOG_FILE_MMAP)
+    bool open_log_file() {
+        m_fd = open(m_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (m_fd < 0) {
+            fprintf(stderr,"open() log file failed!\n");
+            return false;
+        }
+
+        struct stat st{};
+        m_size = fstat(m_fd, &st) == 0 ? st.st_size : 0;
+
+        if (m_on_open) {
+            m_on_open(m_fd, m_size);
+            m_size = lseek(m_fd, 0, SEEK_END);
+        }
+
+        return true;
+    }
+
+    bool close_log_file() {
+        if (m_fd < 0)
+            return true;
+
+#if LOG_FSYNC != LOG_FSYNC_NONE
+        // the tail of a rotated file is as durable as the policy made the rest of it
+        if (m_unsynced > 0 && fdatasync(m_fd) != 0) {
+            fprintf(stderr,"RotateLog::close_log_file() fdatasync() failed!\n");
+        }
+        m_unsynced = 0;
+#endif
+
+        if (close(m_fd) != 0) {
+            fprintf(stderr,"close() log file failed!\n");
+            m_fd = -1;
+            return false;
+        }
+
+        m_fd = -1;
+        return true;
+    }
+#endif
+};
+
+#if defined (LOG_SHARED)
+// LOG_SHARED: records of every process logging to one file go through a shared memory ring, reserved with a
+// CAS and published with a release store, and one elected writer process drains it into its RotateLog.
+// the writer holds flock() on the shm fd, the kernel releases it when the writer dies and the next process
+// that tries takes over where it stopped (the last batch of the dead writer may be written twice).
+// the ring is never removed by a logging process, a later one would otherwise create a second ring for the file
+class SharedLog {
+public:
+    static SharedLog& get_instance() {
+        static SharedLog instance(LOG_FILE, LOG_SHARED_RING_SIZE, LOG_SHARED_ELECT);
+        return instance;
+    }
+
+    // elect: this process runs a thread that becomes the writer when no other process is
+    SharedLog(const char *path, size_t ring_size, bool elect) : m_path(path), m_ring_size(ring_size) {
+        if (!open_ring()) {
+            fprintf(stderr,"SharedLog::SharedLog() open_ring() failed, writing %s directly!\n", path);
+            return;
+        }
+
+        if (elect)
+            m_elector = std::thread([this] { serve(m_stop, true); });
+    }
+
+    ~SharedLog() {
+        m_stop = true;
+        if (m_elector.joinable())
+            m_elector.join();
+
+        if (m_shared != nullptr) {
+            // what was published so far is written by the writer, or by this process if there is none
+            const uint64_t published = m_shared->reserve.load();
+            const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(LOG_SHARED_EXIT_MS);
+            bool writer = false;
+            while (m_shared->tail.load(std::memory_order_acquire) < published &&
+                   std::chrono::steady_clock::now() < deadline) {
+                if (!writer)
+                    writer = flock(m_shm_fd, LOCK_EX | LOCK_NB) == 0;
+                if (!writer || drain() == 0)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            if (writer)
+                flock(m_shm_fd, LOCK_UN);
+            munmap(m_shared, RING_OFFSET + m_ring_size);
+        }
+        if (m_shm_fd >= 0)
+            close(m_shm_fd);
+    }
+
+    // publishes a run of records as one ring entry, urgent ones return once the writer wrote them.
+    // waits up to LOG_SHARED_FULL_MS for room, then drops the run
+    void write(struct iovec *iov, int n, size_t bytes, bool urgent = false) {
+        if (m_shared == nullptr) {
+            direct_file().write(iov, n, bytes, urgent);
+            return;
+        }
+
+        const uint64_t mask = m_ring_size - 1;
+        const uint64_t need = ENTRY_HEADER + ((bytes + 7) & ~uint64_t(7));
+        if (need > m_ring_size / 4) {
+            m_shared->dropped.fetch_add(1, std::memory_order_relaxed);
+            LogTelemetry::dropped();
+            return;
+        }
+
+        // tail is read before reserve, so pos - tail never wraps around
+        uint64_t tail = m_shared->tail.load(std::memory_order_acquire);
+        uint64_t pos = m_shared->reserve.load(std::memory_order_relaxed);
+        uint64_t pad = 0;
+        auto deadline = std::chrono::steady_clock::time_point::max();
+        for (;;) {
+            pad = m_ring_size - (pos & mask) < need ? m_ring_size - (pos & mask) : 0;
+            if (pos + pad + need - tail <= m_ring_size) {
+                // seq_cst pairs with the writer going to sleep, see wait_for_records()
+                if (m_shared->reserve.compare_exchange_weak(pos, pos + pad + need))
+                    break;
+                continue;
+            }
+
+            const uint64_t now_tail = m_shared->tail.load(std::memory_order_acquire);
+            if (now_tail == tail) {
+                // full: a writer that fell this far behind is not expected back soon after it timed out once
+                if (deadline == std::chrono::steady_clock::time_point::max())
+                    deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(
+                        m_stalled_tail.load(std::memory_order_relaxed) == tail ? 0 : LOG_SHARED_FULL_MS);
+                if (std::chrono::steady_clock::now() >= deadline) {
+                    m_stalled_tail.store(tail, std::memory_order_relaxed);
+                    m_shared->dropped.fetch_add(1, std::memory_order_relaxed);
+                    LogTelemetry::dropped();
+                    return;
+                }
+                wake_writer();
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+            tail = m_shared->tail.load(std::memory_order_acquire);
+            pos = m_shared->reserve.load(std::memory_order_relaxed);
+        }
+
+        if (pad != 0) {
+            entry_word(pos).store(make_word(PADDING, pad - ENTRY_HEADER, false), std::memory_order_release);
+            pos += pad;
+        }
+
+        std::atomic<uint64_t> &word = entry_word(pos);
+        word.store(make_word(RESERVED, bytes, urgent), std::memory_order_relaxed);
+        char *p = m_ring + (pos & mask) + ENTRY_HEADER;
+        for (int i = 0; i < n; i++) {
+            memcpy(p, iov[i].iov_base, iov[i].iov_len);
+            p += iov[i].iov_len;
+        }
+        word.store(make_word(COMMITTED, bytes, urgent), std::memory_order_release);
+
+        const uint64_t end = pos + need;
+        if (m_shared->sleeping.load())
+            wake_writer();
+
+        if (urgent && writer_alive()) {
+            const auto urgent_deadline =
+                std::chrono::steady_clock::now() + std::chrono::milliseconds(LOG_SHARED_FULL_MS);
+            while (m_shared->tail.load(std::memory_order_acquire) < end &&
+                   std::chrono::steady_clock::now() < urgent_deadline)
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+
+    // becomes the writer once no other process is and drains the ring into path until stop,
+    // runs on the elector thread of every process or as threadlog-writerd
+    void serve(const std::atomic<bool> &stop, bool poll = false) {
+        if (m_shared == nullptr)
+            return;
+
+        while (!stop) {
+            if (flock(m_shm_fd, LOCK_EX | (poll ? LOCK_NB : 0)) == 0)
+                break;
+            if (errno != EWOULDBLOCK && errno != EINTR) {
+                fprintf(stderr,"SharedLog::serve() flock() failed!\n");
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(LOG_SHARED_ELECT_MS));
+        }
+        if (stop)
+            return;
+
+        m_shared->writer_pid.store(getpid());
+        while (!stop) {
+            if (drain() == 0)
+                wait_for_records();
+        }
+
+        while (drain() != 0) {
+        }
+        m_shared->writer_pid.store(0);
+        flock(m_shm_fd, LOCK_UN);
+    }
+
+    // removes the ring's name once nothing logs to path any more: processes that have it mapped keep
+    // using it, a process that starts later creates a new ring
+    bool unlink_ring() {
+        if (m_shared == nullptr)
+            return true;
+        if (shm_unlink(shm_name().c_str()) != 0 && errno != ENOENT) {
+            fprintf(stderr,"SharedLog::unlink_ring() shm_unlink() failed!\n");
+            return false;
+        }
+        return true;
+    }
+
+    // runs dropped because the ring stayed full, counted across all processes
+    uint64_t dropped() const {
+        return m_shared != nullptr ? m_shared->dropped.load(std::memory_order_relaxed) : 0;
+    }
+
+    bool shared() const {
+        return m_shared != nullptr;
+    }
+
+private:
+    static constexpr uint64_t MAGIC = 0x474f4c4452485354; // "TSHRDLOG"
+    static constexpr size_t RING_OFFSET = 4096;
+    static constexpr size_t ENTRY_HEADER = 8;
+
+    // the first 8 bytes of every ring entry: state in the top 2 bits, urgent, the pid of the
+    // producer and the payload size in the low 32 bits. empty ring bytes are zero
+    enum : uint64_t { EMPTY = 0, RESERVED = 1, COMMITTED = 2, PADDING = 3 };
+
+    struct Shared {
+        uint64_t magic;
+        uint64_t ring_size;
+        alignas(64) std::atomic<uint64_t> reserve;  // producers, bytes reserved so far
+        alignas(64) std::atomic<uint64_t> tail;     // writer, bytes written to the file and zeroed
+        std::atomic<uint32_t> wake;                 // futex word the idle writer waits on
+        std::atomic<uint32_t> sleeping;
+        std::atomic<uint64_t> dropped;
+        std::atomic<int32_t> writer_pid;
+    };
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "LOG_SHARED needs lock free 64 bit atomics");
+    static_assert(sizeof(Shared) <= RING_OFFSET, "SharedLog::Shared does not fit its page");
+
+    const std::string m_path;
+    const size_t m_ring_size;
+
+    int m_shm_fd {-1};
+    Shared *m_shared {nullptr};
+    char *m_ring {nullptr};
+
+    const pid_t m_pid {getpid()};
+    std::atomic<uint64_t> m_stalled_tail {~uint64_t(0)}; // tail when a full ring made this process drop
+    std::atomic<bool> m_stop {false};
+    std::thread m_elector;
+    std::unique_ptr<RotateLog> m_file; // opened once this process is the writer
+    uint64_t m_stall_pos {~uint64_t(0)}; // the entry at the tail that is not committed yet, and since when
+    std::chrono::steady_clock::time_point m_stall_since {};
+
+    // "/threadlog.tmp.MyModule.log" for /tmp/MyModule.log
+    std::string shm_name() const {
+        std::string name = "/threadlog" + m_path;
+        std::replace(name.begin() + 1, name.end(), '/', '.');
+        return name;
+    }
+
+    // the first process creates and sizes the ring, the others wait until it is set up
+    bool open_ring() {
+        if (m_ring_size == 0 || (m_ring_size & (m_ring_size - 1)) != 0) {
+            fprintf(stderr,"SharedLog::open_ring() ring size must be a power of 2!\n");
+            return false;
+        }
+
+        const std::string name = shm_name();
+        const size_t map_size = RING_OFFSET + m_ring_size;
+        bool created = true;
+        m_shm_fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (m_shm_fd < 0 && errno == EEXIST) {
+            created = false;
+            m_shm_fd = shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0644);
+        }
+        if (m_shm_fd < 0) {
+            fprintf(stderr,"SharedLog::open_ring() shm_open() failed!\n");
+            return false;
+        }
+
+        if (created && ftruncate(m_shm_fd, map_size) != 0) {
+            fprintf(stderr,"SharedLog::open_ring() ftruncate() failed!\n");
+            shm_unlink(name.c_str());
+            return false;
+        }
+
+        for (int i = 0; !created; i++) {
+            struct stat st;
+            if (fstat(m_shm_fd, &st) == 0 && (size_t) st.st_size >= map_size)
+                break;
+            if (i == 1000) {
+                fprintf(stderr,"SharedLog::open_ring() %s is not set up!\n", name.c_str());
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        void *map = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_shm_fd, 0);
+        if (map == MAP_FAILED) {
+            fprintf(stderr,"SharedLog::open_ring() mmap() failed!\n");
+            return false;
+        }
+        Shared *shared = static_cast<Shared *>(map);
+
+        if (created) {
+            shared->ring_size = m_ring_size;
+            __atomic_store_n(&shared->magic, MAGIC, __ATOMIC_RELEASE);
+        }
+        for (int i = 0; __atomic_load_n(&shared->magic, __ATOMIC_ACQUIRE) != MAGIC; i++) {
+            if (i == 1000) {
+                fprintf(stderr,"SharedLog::open_ring() %s is not set up!\n", name.c_str());
+                munmap(map, map_size);
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (shared->ring_size != m_ring_size) {
+            fprintf(stderr,"SharedLog::open_ring() %s has another LOG_SHARED_RING_SIZE!\n", name.c_str());
+            munmap(map, map_size);
+            return false;
+        }
+
+        m_shared = shared;
+        m_ring = static_cast<char *>(map) + RING_OFFSET;
+        return true;
+    }
+
+    // the file of a process whose ring could not be opened, as if LOG_SHARED was not defined
+    RotateLog &direct_file() {
+        static RotateLog *file = new RotateLog(m_path.c_str(), LOG_FILE_SIZE_LIMIT);
+        return *file;
+    }
+
+    uint64_t make_word(uint64_t state, uint64_t len, bool urgent) const {
+        return state << 62 | uint64_t(urgent) << 61 | uint64_t(m_pid & 0x1fffffff) << 32 | len;
+    }
+
+    std::atomic<uint64_t> &entry_word(uint64_t pos) const {
+        return *reinterpret_cast<std::atomic<uint64_t> *>(m_ring + (pos & (m_ring_size - 1)));
+    }
+
+    void wake_writer() {
+        m_shared->wake.fetch_add(1);
+        syscall(SYS_futex, &m_shared->wake, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+    }
+
+    // sleeping is set before the ring is checked and read by producers after their reserve CAS, so either
+    // the writer sees the reservation or the producer wakes it. an entry still being copied is polled for
+    void wait_for_records() {
+        const uint32_t wake = m_shared->wake.load();
+        m_shared->sleeping.store(1);
+        if (m_shared->reserve.load() == m_shared->tail.load()) {
+            struct timespec timeout {0, LOG_SHARED_ELECT_MS * 1000000L};
+            syscall(SYS_futex, &m_shared->wake, FUTEX_WAIT, wake, &timeout, nullptr, 0);
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+        m_shared->sleeping.store(0);
+    }
+
+    // writes the committed entries from tail on, returns the bytes consumed. an entry a dead producer left
+    // RESERVED is skipped, an entry without a header is given up with everything reserved after it once
+    // nothing moved for LOG_SHARED_STALL_MS
+    size_t drain() {
+        if (!m_file)
+            m_file.reset(new RotateLog(m_path.c_str(), LOG_FILE_SIZE_LIMIT));
+
+        const uint64_t mask = m_ring_size - 1;
+        const uint64_t start = m_shared->tail.load(std::memory_order_acquire);
+        const uint64_t reserved = m_shared->reserve.load(std::memory_order_acquire);
+
+        uint64_t pos = start;
+        struct iovec iov[64];
+        int n = 0;
+        size_t bytes = 0;
+        bool urgent = false;
+        while (pos < reserved && n < 64) {
+            const uint64_t word = entry_word(pos).load(std::memory_order_acquire);
+            const uint64_t state = word >> 62;
+            const size_t len = word & 0xffffffff;
+            if (state == PADDING) {
+                pos += ENTRY_HEADER + len;
+                continue;
+            }
+            if (state == COMMITTED) {
+                iov[n].iov_base = m_ring + (pos & mask) + ENTRY_HEADER;
+                iov[n].iov_len = len;
+                n++;
+                bytes += len;
+                urgent |= (word >> 61) & 1;
+                pos += ENTRY_HEADER + ((len + 7) & ~uint64_t(7));
+                continue;
+            }
+            if (pos == start && stalled(word, pos, reserved)) {
+                pos = state == RESERVED ? pos + ENTRY_HEADER + ((len + 7) & ~uint64_t(7)) : reserved;
+                m_shared->dropped.fetch_add(1, std::memory_order_relaxed);
+                LogTelemetry::dropped();
+                break;
+            }
+            break;
+        }
+
+        if (n > 0)
+            m_file->write(iov, n, bytes, urgent);
+
+        // producers find zeroed bytes where they reserve
+        for (uint64_t p = start; p < pos;) {
+            const uint64_t chunk = std::min<uint64_t>(pos - p, m_ring_size - (p & mask));
+            memset(m_ring + (p & mask), 0, chunk);
+            p += chunk;
+        }
+        if (pos != start)
+            m_shared->tail.store(pos, std::memory_order_release);
+
+        return pos - start;
+    }
+
+    // false if there is no writer or it died without clearing writer_pid, which is then cleared so that
+    // urgent records stop waiting for it until the next writer takes over
+    bool writer_alive() {
+        int32_t pid = m_shared->writer_pid.load(std::memory_order_relaxed);
+        if (pid == 0)
+            return false;
+        if (kill(pid, 0) == 0 || errno != ESRCH)
+            return true;
+
+        m_shared->writer_pid.compare_exchange_strong(pid, 0, std::memory_order_relaxed);
+        return false;
+    }
+
+    // the entry at the tail has not been committed yet: its producer died if its pid is gone,
+    // without a header (a producer killed right after its CAS) only time tells
+    bool stalled(uint64_t word, uint64_t pos, uint64_t reserved) {
+        const auto now = std::chrono::steady_clock::now();
+        if (m_stall_pos != pos) {
+            m_stall_pos = pos;
+            m_stall_since = now;
+        }
+
+        if (word >> 62 == RESERVED) {
+            const pid_t pid = (word >> 32) & 0x1fffffff;
+            return kill(pid, 0) != 0 && errno == ESRCH;
+        }
+        return reserved > pos && now - m_stall_since > std::chrono::milliseconds(LOG_SHARED_STALL_MS);
+    }
+};
+#endif
+
+// what FileSink writes LOG_FILE through
+#if defined (LOG_SHARED)
+typedef SharedLog LogFile;
+#else
+typedef RotateLog LogFile;
+#endif
+
+// clock read for every record, see LOG_CLOCK
+class LogClock {
+public:
+    static struct timespec now() {
+        struct timespec ts{};
+#if LOG_CLOCK == LOG_CLOCK_TSC && (defined (__x86_64__) || defined (__i386__))
+        int64_t ns = tsc_now_ns();
+        ts.tv_sec = ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+#elif LOG_CLOCK == LOG_CLOCK_REALTIME_COARSE
+        clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+#else
+        clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+        return ts;
+    }
+
+private:
+#if LOG_CLOCK == LOG_CLOCK_TSC && (defined (__x86_64__) || defined (__i386__))
+    // per thread anchor of (tsc, realtime), re-anchored every LOG_TSC_ANCHOR_MS so
+    // the tick rate is measured over a long baseline and NTP steps are picked up
+    static int64_t tsc_now_ns() {
+        struct Anchor {
+            uint64_t tsc {0};
+            int64_t ns {0};
+            uint64_t reanchor_ticks {0};
+            double ns_per_tick {0};
+        };
+        thread_local Anchor a;
+
+        const uint64_t tsc = __rdtsc();
+        const uint64_t elapsed = tsc - a.tsc;
+
+        if (a.ns_per_tick > 0 && elapsed < a.reanchor_ticks)
+            return a.ns + (int64_t) (elapsed * a.ns_per_tick);
+
+        struct timespec ts{};
+        clock_gettime(CLOCK_REALTIME, &ts);
+        const int64_t ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+        if (a.tsc == 0) {
+            a.tsc = tsc;
+            a.ns = ns;
+        } else if (ns - a.ns >= 1000000) {
+            // at least 1 ms of baseline before the rate is trusted
+            a.ns_per_tick = double(ns - a.ns) / double(elapsed);
+            a.reanchor_ticks = (uint64_t) (LOG_TSC_ANCHOR_MS * 1000000.0 / a.ns_per_tick);
+            a.tsc = tsc;
+            a.ns = ns;
+        }
+
+        return ns;
+    }
+#endif
+};
+
+// renders "2024/01/31 12:00:00:000", the part up to the seconds is cached per thread
+class LogTimestamp {
+public:
+    static constexpr size_t SIZE = 20 + LOG_TIME_PRECISION;
+
+    static LogTimestamp &get() {
+        thread_local LogTimestamp t;
+        return t;
+    }
+
+    // writes SIZE bytes to out
+    void format(char *out) {
+        const struct timespec ts = LogClock::now();
+
+        if (ts.tv_sec != m_sec) {
+            struct tm now{};
+            localtime_r(&ts.tv_sec, &now);
+
+            write_digits(m_head, now.tm_year + 1900, 4);
+            m_head[4] = '/';
+            write_digits(m_head + 5, now.tm_mon + 1, 2);
+            m_head[7] = '/';
+            write_digits(m_head + 8, now.tm_mday, 2);
+            m_head[10] = ' ';
+            write_digits(m_head + 11, now.tm_hour, 2);
+            m_head[13] = ':';
+            write_digits(m_head + 14, now.tm_min, 2);
+            m_head[16] = ':';
+            write_digits(m_head + 17, now.tm_sec, 2);
+            m_head[19] = ':';
+
+            m_sec = ts.tv_sec;
+        }
+
+        memcpy(out, m_head, sizeof(m_head));
+        write_digits(out + sizeof(m_head), (unsigned long) ts.tv_nsec / FRACTION_DIVISOR, LOG_TIME_PRECISION);
+    }
+
+    static void write_digits(char *out, unsigned long v, int n) {
+        for (int i = n - 1; i >= 0; --i) {
+            out[i] = char('0' + v % 10);
+            v /= 10;
+        }
+    }
+
+private:
+    static constexpr long FRACTION_DIVISOR =
+            LOG_TIME_PRECISION == LOG_TIME_NANO ? 1 : LOG_TIME_PRECISION == LOG_TIME_MICRO ? 1000 : 1000000;
+
+    char m_head[20];
+    time_t m_sec {-1};
+};
+
+// finds the bytes a JSON string or an unquoted logfmt value can not hold, 32 or 16 at a time with AVX2/SSE2
+class LogEscape {
+public:
+    // length of the leading run that JSON leaves as it is, with logfmt also without space and '='
+    static size_t plain_run(const char *data, size_t len, bool logfmt) {
+        size_t i = 0;
+#if defined (__AVX2__)
+        const __m256i ctl = _mm256_set1_epi8(logfmt ? ' ' : ' ' - 1);
+        const __m256i quote = _mm256_set1_epi8('"'), backslash = _mm256_set1_epi8('\\');
+        const __m256i equals = _mm256_set1_epi8(logfmt ? '=' : '"');
+
+        for (; i + 32 <= len; i += 32) {
+            const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+            // unsigned v <= ctl, bytes of UTF-8 sequences pass
+            const __m256i hit = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, ctl), v), _mm256_cmpeq_epi8(v, quote)),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, backslash), _mm256_cmpeq_epi8(v, equals)));
+            const uint32_t mask = (uint32_t) _mm256_movemask_epi8(hit);
+            if (mask)
+                return i + __builtin_ctz(mask);
+        }
+#endif
+#if defined (__SSE2__)
+        const __m128i ctl16 = _mm_set1_epi8(logfmt ? ' ' : ' ' - 1);
+        const __m128i quote16 = _mm_set1_epi8('"'), backslash16 = _mm_set1_epi8('\\');
+        const __m128i equals16 = _mm_set1_epi8(logfmt ? '=' : '"');
+
+        for (; i + 16 <= len; i += 16) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+            const __m128i hit = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, ctl16), v), _mm_cmpeq_epi8(v, quote16)),
+                _mm_or_si128(_mm_cmpeq_epi8(v, backslash16), _mm_cmpeq_epi8(v, equals16)));
+            const uint32_t mask = (uint32_t) _mm_movemask_epi8(hit);
+            if (mask)
+                return i + __builtin_ctz(mask);
+        }
+#endif
+        for (; i < len; i++) {
+            const unsigned char c = data[i];
+            if (c < ' ' || c == '"' || c == '\\' || (logfmt && (c == ' ' || c == '=')))
+                return i;
+        }
+        return len;
+    }
+
+    // writes str as the inside of a JSON string, which logfmt accepts in quoted values as well.
+    // returns the bytes written, an escape that does not fit in cap is left out with the rest
+    static size_t json(char *out, size_t cap, std::string_view str) {
+        static constexpr char hex[] = "0123456789abcdef";
+        size_t len = 0;
+
+        for (;;) {
+            const size_t run = std::min(plain_run(str.data(), str.size(), false), cap - len);
+            memcpy(out + len, str.data(), run);
+            len += run;
+            str.remove_prefix(run);
+
+            if (str.empty() || len == cap)
+                return len;
+
+            const unsigned char c = str[0];
+            char esc[6] = {'\\', (char) c};
+            size_t n = 2;
+            if (c == '\n')
+                esc[1] = 'n';
+            else if (c == '\t')
+                esc[1] = 't';
+            else if (c == '\r')
+                esc[1] = 'r';
+            else if (c < ' ') {
+                memcpy(esc, "\\u00", 4);
+                esc[4] = hex[c >> 4];
+                esc[5] = hex[c & 0xf];
+                n = 6;
+            }
+
+            if (len + n > cap)
+                return len;
+
+            memcpy(out + len, esc, n);
+            len += n;
+            str.remove_prefix(1);
+        }
+    }
+};
+
+// what the sinks need to know about a record besides its bytes, AsyncLog queues it next to them
+struct LogMark {
+    static constexpr int MAX_ESCAPES = 4; // level color, thread color and reset of a line, or the two of LOG_SCOPE
+
+    int8_t level {INFO_LEVEL};  // ERROR_LEVEL .. DEBUG_LEVEL, from the type of the first prefix
+    uint8_t frame {0};          // BinaryLog frame kind, FrameText in text builds
+    uint8_t escapes {0};        // color escapes at escape_at[i], in record order
+    uint8_t escape_len[MAX_ESCAPES] {};
+    uint32_t escape_at[MAX_ESCAPES] {};
+};
+
+// one finished record as it is handed to the sinks
+struct LogEntry {
+    const char *data;
+    uint32_t len;
+    LogMark mark;
+};
+
+// thread-local buffer that collects the fragments of one record until LOG_COMMIT()
+class LogRecord {
+public:
+    static LogRecord &get() {
+        thread_local LogRecord record;
+        return record;
+    }
+
+    // runtime formats, LOG() goes through log_format()
+    __attribute__((format(printf, 2, 3)))
+    void append(const char *fmt, ...) {
+        if (m_len >= sizeof(m_buf) - 1)
+            return;
+
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(m_buf + m_len, sizeof(m_buf) - m_len, fmt, args);
+        va_end(args);
+
+        if (n < 0)
+            return;
+
+        if (m_len + n >= sizeof(m_buf) - 1) {
+            // truncated, keep the record line terminated
+            m_len = sizeof(m_buf) - 1;
+            m_buf[m_len - 1] = '\n';
+            return;
+        }
+
+        m_len += n;
+    }
+
+    // a record cut short at LOG_RECORD_SIZE still ends its line, as append() leaves it
+    void end_truncated() {
+        if (m_len >= sizeof(m_buf) - 1)
+            m_buf[m_len - 1] = '\n';
+    }
+
+    void append_raw(const char *str, size_t len) {
+        len = std::min(len, sizeof(m_buf) - 1 - m_len);
+        memcpy(m_buf + m_len, str, len);
+        m_len += len;
+    }
+
+    void append_raw(const char *str) {
+        append_raw(str, strlen(str));
+    }
+
+    void append_raw(std::string_view str) {
+        append_raw(str.data(), str.size());
+    }
+
+    // integers as with std::to_string(), floating point as "%f"
+    template<typename T>
+    void append_number(T value) {
+        char *first = m_buf + m_len, *last = m_buf + sizeof(m_buf) - 1;
+        std::to_chars_result res;
+
+        if constexpr (std::is_floating_point_v<T>)
+            res = std::to_chars(first, last, value, std::chars_format::fixed, 6);
+        else
+            res = std::to_chars(first, last, value);
+
+        if (res.ec == std::errc())
+            m_len = res.ptr - m_buf;
+    }
+
+    // "file.cpp:42"
+    void append_location(const LogSite &site) {
+        append_raw(site.file);
+        append_raw(":", 1);
+        append_uint(site.line);
+    }
+
+    void append_spaces(size_t n) {
+        n = std::min(n, sizeof(m_buf) - 1 - m_len);
+        memset(m_buf + m_len, ' ', n);
+        m_len += n;
+    }
+
+    void append_uint(unsigned long v) {
+        char digits[20];
+        size_t n = 0;
+        do {
+            digits[sizeof(digits) - ++n] = char('0' + v % 10);
+            v /= 10;
+        } while (v);
+        append_raw(digits + sizeof(digits) - n, n);
+    }
+
+    // "2024/01/31 12:00:00:000 [ModuleName][type]:"
+    void append_prefix(const char *type) {
+        static constexpr char module[] = " [" ModuleName "][";
+
+        if (m_type == nullptr) {
+            m_type = type;
+            m_mark.level = level_of(type);
+        }
+#if LOG_FORMAT != LOG_FORMAT_TEXT
+        else {
+            // one structured record holds one line
+            return;
+        }
+#endif
+
+        if (sizeof(m_buf) - 1 - m_len < LogTimestamp::SIZE + FIELDS_RESERVE)
+            return;
+
+#if LOG_FORMAT == LOG_FORMAT_JSON
+        append_raw("{\"ts\":\"", 7);
+#elif LOG_FORMAT == LOG_FORMAT_LOGFMT
+        append_raw("ts=\"", 4);
+#endif
+        LogTimestamp::get().format(m_buf + m_len);
+        m_len += LogTimestamp::SIZE;
+#if LOG_FORMAT == LOG_FORMAT_TEXT
+        append_raw(module, sizeof(module) - 1);
+        append_raw(type);
+        append_raw("]:", 2);
+#else
+        (void) module;
+        append_raw("\"", 1);
+        m_fields_end = m_len;
+        field("level", std::string_view(type));
+        field("module", std::string_view(ModuleName));
+        field("tid", m_tid);
+#endif
+    }
+
+    // LOG_FORMAT_JSON/LOG_FORMAT_LOGFMT: appends ,"key":value / key=value after the fields so far,
+    // numbers and bools stay unquoted and everything else is rendered by to_log() into a string
+    template<typename T>
+    void field(std::string_view key, const T &value);
+
+    // fields until end_group() are ,"name":{...} in JSON and name.key=value in logfmt
+    void begin_group(std::string_view name) {
+        if (m_len > m_fields_end)
+            return;
+#if LOG_FORMAT == LOG_FORMAT_JSON
+        if (!append_key(name) || room() < 1)
+            return;
+        append_raw("{", 1);
+        m_group_first = true;
+#endif
+        m_group = name;
+        m_fields_end = m_len;
+    }
+
+    void end_group() {
+        if (m_group.empty())
+            return;
+#if LOG_FORMAT == LOG_FORMAT_JSON
+        // closing '}' has its own reserve so that a full record stays valid JSON
+        if (m_len == m_fields_end) {
+            m_buf[m_len++] = '}';
+            m_fields_end = m_len;
+        }
+        m_group_first = false;
+#endif
+        m_group = {};
+    }
+
+    // color escapes are remembered so that sinks without color can leave them out,
+    // the ones past LogMark::MAX_ESCAPES stay in every sink's copy. structured records have none
+    void append_color(const char *code) {
+#if LOG_FORMAT != LOG_FORMAT_TEXT
+        (void) code;
+        return;
+#endif
+        const size_t len = strlen(code);
+        if (m_mark.escapes < LogMark::MAX_ESCAPES && sizeof(m_buf) - 1 - m_len >= len) {
+            m_mark.escape_at[m_mark.escapes] = m_len;
+            m_mark.escape_len[m_mark.escapes] = len;
+            m_mark.escapes++;
+        }
+        append_raw(code, len);
+    }
+
+    template<typename T>
+    void append_pod(const T &v) {
+        append_raw(reinterpret_cast<const char *>(&v), sizeof(v));
+    }
+
+    // record is written as one BinaryLog frame of this kind, FrameText unless set
+    void set_frame(uint8_t kind) { m_kind = kind; }
+
+    // fills in the frame header or closes the structured record, call before data()
+    void finish() {
+#if LOG_FORMAT != LOG_FORMAT_TEXT
+        close_fields();
+#endif
+#if defined (LOG_BINARY)
+        const uint32_t payload = m_len - HEADER_SIZE;
+        m_buf[0] = (char) m_kind;
+        memcpy(m_buf + 1, &payload, sizeof(payload));
+#endif
+    }
+
+    const char *data() const { return m_buf; }
+
+    // call after finish()
+    LogEntry entry() const {
+        LogMark mark = m_mark;
+        mark.frame = m_kind;
+        return {m_buf, (uint32_t) m_len, mark};
+    }
+
+    size_t size() const { return m_len; }
+
+    // bytes appended since size() returned from
+    std::string_view view(size_t from) const { return {m_buf + from, m_len - from}; }
+
+    bool empty() const { return m_len == HEADER_SIZE; }
+
+    void clear() {
+        m_len = HEADER_SIZE;
+        m_kind = BinaryLog::FrameText;
+        m_type = nullptr;
+        m_mark = LogMark();
+        m_fields_end = 0;
+        m_group = {};
+        m_group_first = false;
+        m_finished = false;
+    }
+
+    // type of the first prefix in the record, nullptr if it has none
+    const char *type() const { return m_type; }
+
+    // cached, gettid() is a syscall
+    int tid() const { return m_tid; }
+
+#if defined (LOG_BINARY)
+    static constexpr size_t HEADER_SIZE = BinaryLog::FRAME_HEADER_SIZE;
+#else
+    static constexpr size_t HEADER_SIZE = 0;
+#endif
+
+private:
+    // kept free by structured appends for the closing "}}\n" of a record
+    static constexpr size_t FIELDS_RESERVE = 4;
+
+    size_t room() const {
+        return sizeof(m_buf) - 1 - FIELDS_RESERVE - std::min(m_len, sizeof(m_buf) - 1 - FIELDS_RESERVE);
+    }
+
+    // ,"key": or key= and with a group name.key=, false if it does not fit
+    bool append_key(std::string_view key) {
+        key.remove_prefix(std::min(key.find_first_not_of(' '), key.size()));
+#if LOG_FORMAT == LOG_FORMAT_JSON
+        if (room() < 4 + key.size())
+            return false;
+        if (!m_group_first)
+            m_buf[m_len++] = ',';
+        m_group_first = false;
+        m_buf[m_len++] = '"';
+        m_len += LogEscape::json(m_buf + m_len, room() - 2, key);
+        append_raw("\":", 2);
+#else
+        if (room() < 3 + m_group.size() + key.size())
+            return false;
+        m_buf[m_len++] = ' ';
+        if (!m_group.empty()) {
+            append_raw(m_group);
+            m_buf[m_len++] = '.';
+        }
+        // argument expressions like v.size() become valid keys
+        for (char c : key)
+            m_buf[m_len++] = LogEscape::plain_run(&c, 1, true) == 1 ? c : '_';
+        m_buf[m_len++] = '=';
+#endif
+        return true;
+    }
+
+    // string value: always quoted in JSON, quoted in logfmt only when it has to be
+    void append_quoted(std::string_view str) {
+#if LOG_FORMAT == LOG_FORMAT_LOGFMT
+        if (!str.empty() && LogEscape::plain_run(str.data(), str.size(), true) == str.size()) {
+            append_raw(str.data(), std::min(str.size(), room()));
+            return;
+        }
+#endif
+        if (room() < 2)
+            return;
+        m_buf[m_len++] = '"';
+        m_len += LogEscape::json(m_buf + m_len, room() - 1, str);
+        m_buf[m_len++] = '"';
+    }
+
+    // the text after the last field is the message, trimmed of the spaces and newline text records have
+    void close_fields() {
+        if (m_finished || m_type == nullptr)
+            return;
+        m_finished = true;
+
+        std::string_view msg = view(std::min(m_fields_end, m_len));
+        msg.remove_prefix(std::min(msg.find_first_not_of(' '), msg.size()));
+        while (!msg.empty() && (msg.back() == '\n' || msg.back() == ' '))
+            msg.remove_suffix(1);
+
+        m_len = m_fields_end;
+        end_group();
+        if (!msg.empty()) {
+            char text[LOG_RECORD_SIZE];
+            memcpy(text, msg.data(), msg.size());
+            field("msg", std::string_view(text, msg.size()));
+        }
+
+#if LOG_FORMAT == LOG_FORMAT_JSON
+        append_raw("}\n", 2);
+#else
+        append_raw("\n", 1);
+#endif
+    }
+
+    // records without a known type, PROFILE and STACK reports included, count as INFO
+    static int8_t level_of(const char *type) {
+        if (strcmp(type, "ERROR") == 0)
+            return ERROR_LEVEL;
+        if (strcmp(type, "WARN") == 0)
+            return WARN_LEVEL;
+        if (strcmp(type, "DEBUG") == 0)
+            return DEBUG_LEVEL;
+        return INFO_LEVEL;
+    }
+
+    char m_buf[LOG_RECORD_SIZE];
+    size_t m_len {HEADER_SIZE};
+    uint8_t m_kind {BinaryLog::FrameText};
+    const char *m_type {nullptr};
+    LogMark m_mark;
+    int m_tid {(int)gettid()};
+
+    // structured records
+    size_t m_fields_end {0};      // end of the last field, what follows is the message
+    std::string_view m_group;     // name of the open group
+    bool m_group_first {false};   // no field in the open JSON group yet
+    bool m_finished {false};      // close_fields() ran
+};
+
+// destination of finished records with its own minimum level and color, write() is called under PrintLock
+// with runs of records that were formatted once for all sinks
+class LogSink {
+public:
+    LogSink(int level, int color, bool tty = false) : m_level(level), m_color(color), m_tty(tty) {
+    }
+
+    virtual ~LogSink() = default;
+
+    LogSink(const LogSink &) = delete;
+    LogSink &operator=(const LogSink &) = delete;
+
+    // records above level are skipped, OFF_LEVEL skips all
+    void set_level(int level) { m_level.store(level, std::memory_order_relaxed); }
+
+    int level() const { return m_level.load(std::memory_order_relaxed); }
+
+    // LOG_COLOR_OFF, LOG_COLOR_ON or LOG_COLOR_AUTO
+    void set_color(int color) { m_color.store(color, std::memory_order_relaxed); }
+
+    bool color() const {
+        const int color = m_color.load(std::memory_order_relaxed);
+        return color == LOG_COLOR_ON || (color == LOG_COLOR_AUTO && m_tty);
+    }
+
+    virtual void write(const LogEntry *entries, size_t n) = 0;
+
+protected:
+    // with LOG_BINARY only a raw sink gets the binary frames, the others get the text of FrameText records
+    bool takes(const LogEntry &entry, bool raw = false) const {
+        if (entry.mark.frame != BinaryLog::FrameText)
+            return raw;
+        return entry.mark.level <= level();
+    }
+
+    // the most pieces for_each_piece() cuts a record into
+    static constexpr int MAX_PIECES = LogMark::MAX_ESCAPES + 1;
+
+    // calls out(data, len) for the pieces of the record text that are left
+    // once the frame header and, without color, the escapes are cut out
+    template<typename F>
+    static void for_each_piece(const LogEntry &entry, bool color, F &&out) {
+        const LogMark &m = entry.mark;
+        size_t from = LogRecord::HEADER_SIZE;
+
+        for (int i = 0; !color && i < m.escapes; i++) {
+            if (m.escape_at[i] > from)
+                out(entry.data + from, m.escape_at[i] - from);
+            from = m.escape_at[i] + m.escape_len[i];
+        }
+
+        if (from < entry.len)
+            out(entry.data + from, entry.len - from);
+    }
+
+private:
+    std::atomic<int> m_level;
+    std::atomic<int> m_color;
+    const bool m_tty;
+};
+
+// gathers the pieces of the records a sink takes into iovecs, flush(iov, n, bytes) gets them 64 at a time
+template<typename F>
+class LogGather {
+public:
+    explicit LogGather(F flush) : m_flush(flush) {
+    }
+
+    void add(const char *data, size_t len) {
+        if (len == 0)
+            return;
+
+        if (m_n == IOV_COUNT)
+            flush();
+
+        m_iov[m_n].iov_base = const_cast<char *>(data);
+        m_iov[m_n].iov_len = len;
+        m_n++;
+        m_bytes += len;
+    }
+
+    void flush() {
+        if (m_n == 0)
+            return;
+
+        m_flush(m_iov, m_n, m_bytes);
+        m_n = 0;
+        m_bytes = 0;
+    }
+
+private:
+    static constexpr int IOV_COUNT = 64;
+
+    F m_flush;
+    struct iovec m_iov[IOV_COUNT];
+    int m_n {0};
+    size_t m_bytes {0};
+};
+
+// stderr or any other open fd, one writev() per run of records
+class FdSink : public LogSink {
+public:
+    explicit FdSink(int fd, int level = DEBUG_LEVEL, int color = LOG_COLOR_AUTO)
+        : LogSink(level, color, isatty(fd) == 1), m_fd(fd) {
+    }
+
+    void write(const LogEntry *entries, size_t n) override {
+        const bool color = this->color();
+        LogGather gather([this](struct iovec *iov, int count, size_t) { writev_fd(m_fd, iov, count); });
+
+        for (size_t i = 0; i < n; i++) {
+            if (takes(entries[i]))
+                for_each_piece(entries[i], color, [&gather](const char *data, size_t len) { gather.add(data, len); });
+        }
+
+        gather.flush();
+    }
+
+private:
+    const int m_fd;
+};
+
+// RotateLog file, or the SharedLog ring with LOG_SHARED. with LOG_BINARY it gets every frame unchanged, the level still applies to text frames
+class FileSink : public LogSink {
+public:
+    explicit FileSink(LogFile &file, int level = DEBUG_LEVEL, int color = LOG_COLOR_OFF)
+        : LogSink(level, color), m_file(file) {
+    }
+
+    void write(const LogEntry *entries, size_t n) override {
+        // ERROR records are made durable before the writer returns, see LOG_FSYNC_ERRORS
+        bool urgent = false;
+        for (size_t i = 0; i < n && !urgent; i++)
+            urgent = entries[i].mark.level == ERROR_LEVEL && takes(entries[i], true);
+
+        LogGather gather([this, urgent](struct iovec *iov, int count, size_t bytes) {
+            m_file.write(iov, count, bytes, urgent);
+        });
+
+#if defined (LOG_BINARY)
+        for (size_t i = 0; i < n; i++) {
+            if (takes(entries[i], true))
+                gather.add(entries[i].data, entries[i].len);
+        }
+#else
+        const bool color = this->color();
+        for (size_t i = 0; i < n; i++) {
+            if (takes(entries[i]))
+                for_each_piece(entries[i], color, [&gather](const char *data, size_t len) { gather.add(data, len); });
+        }
+#endif
+
+        gather.flush();
+    }
+
+private:
+    LogFile &m_file;
+};
+
+// takes everything and writes nothing, e.g. to measure formatting alone
+class NullSink : public LogSink {
+public:
+    NullSink() : LogSink(DEBUG_LEVEL, LOG_COLOR_OFF) {
+    }
+
+    void write(const LogEntry *, size_t) override {
+    }
+};
+
+// one datagram per record to a Unix domain socket. sends never block, records are dropped
+// and counted while nobody reads the socket or its queue is full
+class SocketSink : public LogSink {
+public:
+    explicit SocketSink(const char *path, int level = DEBUG_LEVEL, int color = LOG_COLOR_OFF)
+        : LogSink(level, color) {
+        m_addr.sun_family = AF_UNIX;
+        strncpy(m_addr.sun_path, path, sizeof(m_addr.sun_path) - 1);
+
+        m_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (m_fd < 0) {
+            fprintf(stderr,"SocketSink::SocketSink() socket() failed!\n");
+        }
+    }
+
+    ~SocketSink() override {
+        if (m_fd >= 0)
+            close(m_fd);
+    }
+
+    void write(const LogEntry *entries, size_t n) override {
+        const bool color = this->color();
+
+        for (size_t i = 0; i < n; i++) {
+            if (!takes(entries[i]))
+                continue;
+
+            struct iovec iov[MAX_PIECES];
+            int count = 0;
+            for_each_piece(entries[i], color, [&iov, &count](const char *data, size_t len) {
+                iov[count].iov_base = const_cast<char *>(data);
+                iov[count].iov_len = len;
+                count++;
+            });
+
+            struct msghdr msg{};
+            msg.msg_name = &m_addr;
+            msg.msg_namelen = sizeof(m_addr);
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+
+            if (m_fd < 0 || sendmsg(m_fd, &msg, MSG_NOSIGNAL) < 0) {
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                LogTelemetry::dropped();
+            }
+        }
+    }
+
+    uint64_t dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+private:
+    int m_fd {-1};
+    struct sockaddr_un m_addr {};
+    std::atomic<uint64_t> m_dropped {0};
+};
+
+// hands every record to a function as one string, e.g. to forward it to another logging system
+class CallbackSink : public LogSink {
+public:
+    typedef std::function<void(int level, std::string_view text)> Callback;
+
+    explicit CallbackSink(Callback callback, int level = DEBUG_LEVEL, int color = LOG_COLOR_OFF)
+        : LogSink(level, color), m_callback(std::move(callback)) {
+    }
+
+    void write(const LogEntry *entries, size_t n) override {
+        const bool color = this->color();
+
+        for (size_t i = 0; i < n; i++) {
+            if (!takes(entries[i]))
+                continue;
+
+            // the text is only copied when escapes have to be cut out
+            if (color || entries[i].mark.escapes == 0) {
+                const size_t from = LogRecord::HEADER_SIZE;
+                m_callback(entries[i].mark.level,
+                           std::string_view(entries[i].data + from, entries[i].len > from ? entries[i].len - from : 0));
+                continue;
+            }
+            m_text.clear();
+            for_each_piece(entries[i], color, [this](const char *data, size_t len) { m_text.append(data, len); });
+            m_callback(entries[i].mark.level, m_text);
+        }
+    }
+
+private:
+    Callback m_callback;
+    std::string m_text;
+};
+
+// the sinks every record is written to: stderr, LOG_FILE with SAVE_LOG_TO_FILE and what was add()ed
+class LogSinks {
+public:
+    static LogSink &stderr_sink() {
+        static FdSink *sink = new FdSink(STDERR_FILENO, LOG_STDERR_LEVEL, LOG_STDERR_COLOR);
+        return *sink;
+    }
+
+#if defined (SAVE_LOG_TO_FILE)
+    static LogSink &file_sink() {
+        static FileSink *sink = new FileSink(LogFile::get_instance(), LOG_FILE_LEVEL, LOG_FILE_COLOR);
+        return *sink;
+    }
+#endif
+
+    // the sink is owned by LogSinks from now on
+    static LogSink &add(std::unique_ptr<LogSink> sink) {
+        auto l = PrintLock::acquire();
+        std::vector<LogSink *> &list = sinks();
+        list.push_back(sink.release());
+        return *list.back();
+    }
+
+    // deletes a sink that was add()ed, the default sinks are turned off with set_level(OFF_LEVEL)
+    static bool remove(LogSink &sink) {
+        auto l = PrintLock::acquire();
+        std::vector<LogSink *> &list = sinks();
+
+        auto it = std::find(list.begin() + DEFAULT_SINKS, list.end(), &sink);
+        if (it == list.end())
+            return false;
+
+        list.erase(it);
+        delete &sink;
+        return true;
+    }
+
+    // caller holds PrintLock, skip was written already
+    static void write(const LogEntry *entries, size_t n, const LogSink *skip = nullptr) {
+        for (LogSink *sink : sinks()) {
+            if (sink != skip)
+                sink->write(entries, n);
+        }
+    }
+
+private:
+#if defined (SAVE_LOG_TO_FILE)
+    static constexpr size_t DEFAULT_SINKS = 2;
+#else
+    static constexpr size_t DEFAULT_SINKS = 1;
+#endif
+
+    // never destroyed, records may be written while static destructors run
+    static std::vector<LogSink *> &sinks() {
+#if defined (SAVE_LOG_TO_FILE)
+        static std::vector<LogSink *> *list = new std::vector<LogSink *> {&stderr_sink(), &file_sink()};
+#else
+        static std::vector<LogSink *> *list = new std::vector<LogSink *> {&stderr_sink()};
+#endif
+        return *list;
+    }
+};
+
+// hands finished records to the sinks
+class LogWriter {
+public:
+    // caller holds PrintLock
+    static void write(const LogEntry *entries, size_t n) {
+        const uint64_t start = LogTelemetry::now_ns();
+        LogSinks::write(entries, n);
+        LogTelemetry::write(LogTelemetry::now_ns() - start);
+    }
+
+    static void commit(LogRecord &record) {
+        if (record.empty())
+            return;
+
+        record.finish();
+        {
+            const LogEntry entry = record.entry();
+            LogTelemetry::record(entry.mark.level, entry.len);
+            const uint64_t start = LogTelemetry::now_ns();
+#if defined (SAVE_LOG_TO_FILE)
+            // the file orders its writers itself (group commit, or LOG_FILE_MMAP reservations),
+            // PrintLock only orders the other sinks
+            LogSink &file = LogSinks::file_sink();
+            file.write(&entry, 1);
+            auto l = PrintLock::acquire();
+            LogSinks::write(&entry, 1, &file);
+#else
+            auto l = PrintLock::acquire();
+            LogSinks::write(&entry, 1);
+#endif
+            LogTelemetry::write(LogTelemetry::now_ns() - start);
+        }
+
+        record.clear();
+    }
+};
+
+// single producer single consumer byte ring, records are stored as [uint32 len][LogMark][bytes]
+// head is advanced with CAS so the producer can evict the oldest records under LOG_OVERFLOW_DROP_OLDEST
+class LogRing {
+public:
+    explicit LogRing(size_t capacity) : m_buf(new char[capacity]), m_capacity(capacity) {
+    }
+
+    ~LogRing() {
+        delete[] m_buf;
+    }
+
+    LogRing(const LogRing &) = delete;
+    LogRing &operator=(const LogRing &) = delete;
+
+    // returns false when the record was not queued, dropped records are counted
+    bool try_push(const LogEntry &entry, int policy) {
+        const uint32_t len = entry.len;
+        const uint64_t need = RECORD_HEADER_SIZE + len;
+        if (need > m_capacity) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            LogTelemetry::dropped();
+            return false;
+        }
+
+        const uint64_t tail = m_tail.load(std::memory_order_relaxed);
+        uint64_t head = m_head.load(std::memory_order_acquire);
+
+        while (m_capacity - (tail - head) < need) {
+            if (policy == LOG_OVERFLOW_BLOCK)
+                return false;
+
+            if (policy == LOG_OVERFLOW_DROP_NEWEST) {
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                LogTelemetry::dropped();
+                return false;
+            }
+
+            uint32_t oldest;
+            copy_out(head, &oldest, sizeof(oldest));
+            if (m_head.compare_exchange_weak(head, head + RECORD_HEADER_SIZE + oldest,
+                                             std::memory_order_acq_rel, std::memory_order_acquire)) {
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                LogTelemetry::dropped();
+                head += RECORD_HEADER_SIZE + oldest;
+            }
+        }
+
+        copy_in(tail, &len, sizeof(len));
+        copy_in(tail + sizeof(len), &entry.mark, sizeof(entry.mark));
+        copy_in(tail + RECORD_HEADER_SIZE, entry.data, len);
+        m_tail.store(tail + need, std::memory_order_release);
+        return true;
+    }
+
+    // copies the oldest record into out and describes it in entry, returns its length or 0 when the ring is empty
+    size_t pop(char *out, size_t out_size, LogEntry &entry) {
+        uint64_t head = m_head.load(std::memory_order_acquire);
+
+        for (;;) {
+            if (head == m_tail.load(std::memory_order_acquire))
+                return 0;
+
+            uint32_t len;
+            copy_out(head, &len, sizeof(len));
+
+            // a length torn by a concurrent eviction fails the CAS below anyway
+            if (len <= out_size) {
+                copy_out(head + sizeof(len), &entry.mark, sizeof(entry.mark));
+                copy_out(head + RECORD_HEADER_SIZE, out, len);
+            }
+
+            if (m_head.compare_exchange_strong(head, head + RECORD_HEADER_SIZE + len,
+                                               std::memory_order_acq_rel, std::memory_order_acquire)) {
+                entry.data = out;
+                entry.len = std::min<size_t>(len, out_size);
+                return entry.len;
+            }
+        }
+    }
+
+    bool empty() const {
+        return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+    }
+
+    uint64_t take_dropped() {
+        return m_dropped.exchange(0, std::memory_order_relaxed);
+    }
+
+    std::atomic<bool> retired {false}; // owner thread has exited
+
+private:
+    static constexpr size_t RECORD_HEADER_SIZE = sizeof(uint32_t) + sizeof(LogMark);
+
+    void copy_in(uint64_t pos, const void *src, size_t n) {
+        const size_t off = pos & (m_capacity - 1);
+        const size_t first = std::min(n, m_capacity - off);
+        memcpy(m_buf + off, src, first);
+        memcpy(m_buf, static_cast<const char *>(src) + first, n - first);
+    }
+
+    void copy_out(uint64_t pos, void *dst, size_t n) const {
+        const size_t off = pos & (m_capacity - 1);
+        const size_t first = std::min(n, m_capacity - off);
+        memcpy(dst, m_buf + off, first);
+        memcpy(static_cast<char *>(dst) + first, m_buf, n - first);
+    }
+
+    alignas(64) std::atomic<uint64_t> m_head {0};
+    alignas(64) std::atomic<uint64_t> m_tail {0};
+    alignas(64) std::atomic<uint64_t> m_dropped {0};
+    char *m_buf;
+    size_t m_capacity;
+};
+
+// owns one LogRing per logging thread and a drain thread that writes them out
+class AsyncLog {
+public:
+    static AsyncLog &get_instance() {
+        // never destroyed, threads may still log while static destructors run
+        static AsyncLog *instance = new AsyncLog;
+        return *instance;
+    }
+
+    void push(LogRecord &record) {
+        if (record.empty())
+            return;
+
+        record.finish();
+
+        if (!m_running.load(std::memory_order_acquire)) {
+            LogWriter::commit(record);
+            return;
+        }
+
+        LogRing *ring = local_ring();
+        if (ring == nullptr) {
+            LogWriter::commit(record);
+            return;
+        }
+
+        const int policy = m_policy.load(std::memory_order_relaxed);
+        const LogEntry entry = record.entry();
+
+        uint64_t blocked_at = 0;
+        bool queued;
+        while (!(queued = ring->try_push(entry, policy))) {
+            if (policy != LOG_OVERFLOW_BLOCK)
+                break;
+
+            if (!m_running.load(std::memory_order_acquire)) {
+                LogWriter::commit(record);
+                break;
+            }
+
+            if (blocked_at == 0)
+                blocked_at = LogTelemetry::now_ns();
+            m_cv.notify_one();
+            std::this_thread::yield();
+        }
+        if (blocked_at != 0)
+            LogTelemetry::queue_wait(LogTelemetry::now_ns() - blocked_at);
+        if (queued)
+            LogTelemetry::record(entry.mark.level, entry.len);
+
+        record.clear();
+    }
+
+    // writes out everything queued so far, returns when done
+    void flush() {
+        std::scoped_lock l(m_drain_lock);
+        drain();
+    }
+
+    // stops the drain thread after writing out everything queued, later records are written synchronously
+    void stop() {
+        if (!m_running.exchange(false))
+            return;
+
+        m_cv.notify_one();
+        if (m_drainer.joinable())
+            m_drainer.join();
+
+        flush();
+    }
+
+    void set_overflow_policy(int policy) { m_policy.store(policy, std::memory_order_relaxed); }
+
+    // records discarded by the overflow policy since start
+    uint64_t dropped() const { return m_dropped_total.load(std::memory_order_relaxed); }
+
+private:
+    std::mutex m_rings_lock;
+    std::vector<LogRing *> m_rings;
+
+    std::mutex m_drain_lock;
+    std::mutex m_cv_lock;
+    std::condition_variable m_cv;
+    std::thread m_drainer;
+    std::atomic<bool> m_running {false};
+    std::atomic<int> m_policy {LOG_ASYNC_OVERFLOW};
+    std::atomic<uint64_t> m_dropped_total {0};
+
+    static constexpr size_t BATCH_RECORDS = 256;
+
+    char m_batch[4 * LOG_RECORD_SIZE];
+    size_t m_batch_len {0};
+    LogEntry m_entries[BATCH_RECORDS];
+    size_t m_entry_count {0};
+
+    AsyncLog() {
+#if defined (SAVE_LOG_TO_FILE)
+        LogFile::get_instance();
+#endif
+        m_running = true;
+        m_drainer = std::thread([this] { drain_loop(); });
+
+        if (std::atexit([] { AsyncLog::get_instance().stop(); }) != 0) {
+            fprintf(stderr,"AsyncLog::AsyncLog() atexit() failed!\n");
+        }
+    }
+
+    // nullptr once the thread's ring was retired: records of later thread_local destructors are written
+    // synchronously, the drain thread may already have freed the ring
+    LogRing *local_ring() {
+        struct Owner {
+            LogRing *ring {nullptr};
+            bool retired {false};
+
+            ~Owner() {
+                if (ring)
+                    ring->retired.store(true, std::memory_order_release);
+                ring = nullptr;
+                retired = true;
+            }
+        };
+        thread_local Owner owner;
+
+        if (owner.ring == nullptr && !owner.retired) {
+            owner.ring = new LogRing(LOG_ASYNC_RING_SIZE);
+
+            std::scoped_lock l(m_rings_lock);
+            m_rings.push_back(owner.ring);
+        }
+
+        return owner.ring;
+    }
+
+    void drain_loop() {
+        while (m_running.load(std::memory_order_acquire)) {
+            size_t drained;
+            {
+                std::scoped_lock l(m_drain_lock);
+                drained = drain();
+            }
+
+            if (drained == 0) {
+                std::unique_lock l(m_cv_lock);
+                m_cv.wait_for(l, std::chrono::milliseconds(LOG_ASYNC_IDLE_MS));
+            }
+        }
+    }
+
+    // caller holds m_drain_lock, returns number of records written
+    size_t drain() {
+        size_t records = 0;
+        uint64_t dropped = 0;
+
+        std::scoped_lock l(m_rings_lock);
+
+        for (auto it = m_rings.begin(); it != m_rings.end();) {
+            LogRing *ring = *it;
+            // read retired before draining so records pushed right before exit are not lost
+            const bool retired = ring->retired.load(std::memory_order_acquire);
+
+            size_t n;
+            while ((n = ring->pop(m_batch + m_batch_len, sizeof(m_batch) - m_batch_len,
+                                  m_entries[m_entry_count])) > 0) {
+                m_batch_len += n;
+                m_entry_count++;
+                records++;
+
+                if (sizeof(m_batch) - m_batch_len < LOG_RECORD_SIZE || m_entry_count == BATCH_RECORDS)
+                    write_batch();
+            }
+
+            dropped += ring->take_dropped();
+
+            if (retired) {
+                delete ring;
+                it = m_rings.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        write_batch();
+
+        if (dropped > 0) {
+            m_dropped_total.fetch_add(dropped, std::memory_order_relaxed);
+            report_dropped(dropped);
+        }
+
+        return records;
+    }
+
+    void write_batch() {
+        if (m_batch_len == 0)
+            return;
+
+        write_out(m_entries, m_entry_count);
+        m_batch_len = 0;
+        m_entry_count = 0;
+    }
+
+    void report_dropped(uint64_t dropped) {
+        LogRecord &record = LogRecord::get();
+        record.append_prefix("WARN");
+        record.append(" async log dropped %llu records\n", (unsigned long long) dropped);
+        record.finish();
+        const LogEntry entry = record.entry();
+        write_out(&entry, 1);
+        record.clear();
+    }
+
+    static void write_out(const LogEntry *entries, size_t n) {
+        auto l = PrintLock::acquire();
+        LogWriter::write(entries, n);
+    }
+};
+
+#if LOG_FORMAT != LOG_FORMAT_TEXT && defined (LOG_BINARY)
+#error "LOG_FORMAT_JSON/LOG_FORMAT_LOGFMT are text records, they do not combine with LOG_BINARY"
+#endif
+
+#if defined (LOG_FLIGHT) && defined (LOG_BINARY)
+#error "LOG_FLIGHT keeps text records, it does not combine with LOG_BINARY"
+#endif
+
+#if defined (LOG_SHARED) && defined (LOG_BINARY)
+#error "LOG_BINARY site ids are per process, LOG_SHARED does not combine with it"
+#endif
+
+#if defined (LOG_INDEX) && defined (LOG_BINARY)
+#error "LOG_INDEX reads text records, it does not combine with LOG_BINARY"
+#endif
+
+// LOG_FLIGHT: every record is copied into its thread's ring with two memcpy() and no lock or syscall,
+// only ERROR records also reach LogWriter. dumps append the last records of every thread to LOG_FLIGHT_FILE
+class FlightRecorder {
+public:
+    // LOG_COMMIT() of LOG_FLIGHT
+    static void commit(LogRecord &record) {
+        if (record.empty())
+            return;
+
+        record.finish();
+        if (Slot *slot = local_slot())
+            slot->write(record.data(), record.size());
+
+        const bool error = record.type() && strcmp(record.type(), "ERROR") == 0;
+        if (!written(record.type())) {
+            record.clear();
+            return;
+        }
+
+#if defined (LOG_ASYNC)
+        AsyncLog::get_instance().push(record);
+#else
+        LogWriter::commit(record);
+#endif
+        if (error && dump_due())
+            dump("LOG_ERROR");
+    }
+
+    // appends the rings of all live and exited threads to LOG_FLIGHT_FILE
+    static bool dump(const char *reason) {
+        static std::mutex lock;
+        std::scoped_lock l(lock);
+
+        const int fd = open(LOG_FLIGHT_FILE, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            fprintf(stderr,"FlightRecorder::dump() open() failed!\n");
+            return false;
+        }
+
+        std::vector<char> copy(LOG_FLIGHT_RING_SIZE);
+        write_header(fd, reason);
+
+        for (Slot &slot : slots()) {
+            if (slot.state.load(std::memory_order_acquire) < Live)
+                continue;
+
+            const uint64_t head = slot.head.load(std::memory_order_acquire);
+            const uint64_t start = head > LOG_FLIGHT_RING_SIZE ? head - LOG_FLIGHT_RING_SIZE : 0;
+            slot.read(start, head, copy.data());
+
+            // whatever the owner wrote meanwhile has overwritten the oldest bytes
+            const uint64_t after = slot.head.load(std::memory_order_acquire);
+            const uint64_t valid = after > LOG_FLIGHT_RING_SIZE ? std::max(start, after - LOG_FLIGHT_RING_SIZE) : start;
+            write_thread(fd, slot, copy.data() + (valid - start), head - valid, nullptr, 0, valid > 0);
+        }
+
+        close(fd);
+        return true;
+    }
+
+    // dumps from SIGSEGV, SIGBUS, SIGFPE, SIGILL and SIGABRT, then hands the signal to the previous handler.
+    // installed with the first recorded thread, every recorded thread gets an alternate signal stack
+    static bool install_crash_handler() {
+        for (int sig : {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT}) {
+            struct sigaction sa{};
+            sa.sa_handler = crash_handler;
+            sa.sa_flags = SA_ONSTACK;
+            sigemptyset(&sa.sa_mask);
+
+            if (sigaction(sig, &sa, &previous()[sig]) != 0) {
+                fprintf(stderr,"FlightRecorder::install_crash_handler() sigaction() failed!\n");
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+private:
+    enum State {
+        Free,
+        Claimed,
+        Live, // owner thread running
+        Dead  // owner exited, records kept until the slot is reused
+    };
+
+    static constexpr size_t ALT_STACK_SIZE = 64 * 1024;
+
+    // ERROR records and the PROFILE/STACK reports somebody asked for
+    static bool written(const char *type) {
+        return type && (strcmp(type, "ERROR") == 0 || strcmp(type, "PROFILE") == 0 || strcmp(type, "STACK") == 0);
+    }
+
+    struct Slot {
+        std::atomic<int> state {Free};
+        std::atomic<uint64_t> head {0}; // bytes ever written, the ring holds the last LOG_FLIGHT_RING_SIZE
+        int tid {0};
+        char *buf {nullptr};
+        char *alt_stack {nullptr};
+
+        // only called by the owner thread
+        void write(const char *data, size_t len) {
+            const uint64_t h = head.load(std::memory_order_relaxed);
+            if (len > LOG_FLIGHT_RING_SIZE) {
+                data += len - LOG_FLIGHT_RING_SIZE;
+                len = LOG_FLIGHT_RING_SIZE;
+            }
+
+            const size_t pos = h % LOG_FLIGHT_RING_SIZE;
+            const size_t first = std::min(len, LOG_FLIGHT_RING_SIZE - pos);
+            memcpy(buf + pos, data, first);
+            memcpy(buf, data + first, len - first);
+            head.store(h + len, std::memory_order_release);
+        }
+
+        // ring bytes [from, to) into out
+        void read(uint64_t from, uint64_t to, char *out) const {
+            const size_t pos = from % LOG_FLIGHT_RING_SIZE;
+            const size_t len = to - from;
+            const size_t first = std::min(len, LOG_FLIGHT_RING_SIZE - pos);
+            memcpy(out, buf + pos, first);
+            memcpy(out + first, buf, len - first);
+        }
+    };
+
+    // constant initialized, the crash handler can walk it at any time
+    static std::array<Slot, LOG_FLIGHT_THREADS> &slots() {
+        static std::array<Slot, LOG_FLIGHT_THREADS> slots;
+        return slots;
+    }
+
+    static struct sigaction *previous() {
+        static struct sigaction actions[NSIG];
+        return actions;
+    }
+
+    // slot of the calling thread, claimed on first use and marked Dead at thread exit
+    static Slot *local_slot() {
+        struct Owner {
+            Slot *slot {claim()};
+
+            ~Owner() {
+                if (slot)
+                    slot->state.store(Dead, std::memory_order_release);
+            }
+        };
+
+        thread_local Owner owner;
+        return owner.slot;
+    }
+
+    // prefers never used slots, then the oldest records of exited threads are given up
+    static Slot *claim() {
+        static const bool installed = install_crash_handler();
+        (void) installed;
+
+        for (int wanted : {Free, Dead}) {
+            for (Slot &slot : slots()) {
+                int state = wanted;
+                if (!slot.state.compare_exchange_strong(state, Claimed, std::memory_order_acquire))
+                    continue;
+
+                if (slot.buf == nullptr) {
+                    slot.buf = new char[LOG_FLIGHT_RING_SIZE];
+                    slot.alt_stack = new char[ALT_STACK_SIZE];
+                }
+                slot.head.store(0, std::memory_order_relaxed);
+                slot.tid = LogRecord::get().tid();
+                set_alt_stack(slot.alt_stack);
+
+                slot.state.store(Live, std::memory_order_release);
+                return &slot;
+            }
+        }
+
+        return nullptr;
+    }
+
+    // a stack overflow can only be reported from another stack, kept if the thread already has one
+    static void set_alt_stack(char *stack) {
+        stack_t old{};
+        if (sigaltstack(nullptr, &old) != 0 || !(old.ss_flags & SS_DISABLE))
+            return;
+
+        stack_t st{};
+        st.ss_sp = stack;
+        st.ss_size = ALT_STACK_SIZE;
+        sigaltstack(&st, nullptr);
+    }
+
+    static bool dump_due() {
+        static std::atomic<int64_t> next_ms {0};
+
+        struct timespec ts{};
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        const int64_t now_ms = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+
+        int64_t next = next_ms.load(std::memory_order_relaxed);
+        return now_ms >= next && next_ms.compare_exchange_strong(next, now_ms + LOG_FLIGHT_DUMP_MS);
+    }
+
+    // only async-signal-safe calls from here on, they are shared by dump() and crash_handler()
+
+    static void write_str(int fd, const char *str) {
+        write_fd(fd, str, strlen(str));
+    }
+
+    static void write_num(int fd, unsigned long v) {
+        char digits[20];
+        size_t n = 0;
+        do {
+            digits[sizeof(digits) - ++n] = char('0' + v % 10);
+            v /= 10;
+        } while (v);
+        write_fd(fd, digits + sizeof(digits) - n, n);
+    }
+
+    // "==== flight recorder dump: LOG_ERROR, pid 42 ===="
+    static void write_header(int fd, const char *reason) {
+        write_str(fd, "==== flight recorder dump: ");
+        write_str(fd, reason);
+        write_str(fd, ", pid ");
+        write_num(fd, getpid());
+        write_str(fd, " ====\n");
+    }
+
+    // one thread's records, given as up to two pieces of its ring.
+    // a wrapped ring starts in the middle of a line that is skipped
+    static void write_thread(int fd, const Slot &slot, const char *first, size_t first_len,
+                             const char *second, size_t second_len, bool wrapped) {
+        write_str(fd, "---- thread ");
+        write_num(fd, slot.tid);
+        write_str(fd, slot.state.load(std::memory_order_relaxed) == Dead ? " (exited) ----\n" : " ----\n");
+
+        if (wrapped) {
+            const char *nl = static_cast<const char *>(memchr(first, '\n', first_len));
+            if (nl) {
+                first_len -= nl + 1 - first;
+                first = nl + 1;
+            } else {
+                first_len = 0;
+                nl = second_len ? static_cast<const char *>(memchr(second, '\n', second_len)) : nullptr;
+                const size_t skip = nl ? nl + 1 - second : second_len;
+                second += skip;
+                second_len -= skip;
+            }
+        }
+
+        write_fd(fd, first, first_len);
+        write_fd(fd, second, second_len);
+        write_str(fd, "\033[0m\n");
+    }
+
+    static void crash_handler(int sig) {
+        const int saved = errno;
+        const int fd = open(LOG_FLIGHT_FILE, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+        if (fd >= 0) {
+            write_header(fd, sig == SIGABRT ? "SIGABRT" : sig == SIGSEGV ? "SIGSEGV" : "fatal signal");
+
+            // no copy: the crashed thread is stopped, other threads may still be writing their rings
+            for (const Slot &slot : slots()) {
+                if (slot.state.load(std::memory_order_acquire) < Live)
+                    continue;
+
+                const uint64_t head = slot.head.load(std::memory_order_acquire);
+                const size_t len = std::min<uint64_t>(head, LOG_FLIGHT_RING_SIZE);
+                const size_t pos = (head - len) % LOG_FLIGHT_RING_SIZE;
+
+                const size_t first = std::min(len, LOG_FLIGHT_RING_SIZE - pos);
+                write_thread(fd, slot, slot.buf + pos, first, slot.buf, len - first, head > len);
+            }
+
+            close(fd);
+        }
+
+        sigaction(sig, &previous()[sig], nullptr);
+        errno = saved;
+        raise(sig);
+    }
+};
+
+inline std::string to_str(const std::string &str) {
+    return str;
+}
+
+// no copy, the pointer outlives the record it is written into
+inline std::string_view to_str(const char *chars) {
+    return chars ? chars : "(null)";
+}
+
+inline std::string_view to_str(bool b) {
+    return b? "true": "false";
+}
+
+template<typename T>
+std::string to_str(const T &t) {
+    return std::to_string(t);
+}
+
+// renders a LOG_CALL argument straight into the record,
+// overload to_log(LogRecord &, const YourType &) next to YourType to customize it
+template<typename T>
+void to_log(LogRecord &record, const T &value) {
+    if constexpr (std::is_same_v<T, bool>) {
+        record.append_raw(value ? "true" : "false");
+    } else if constexpr (std::is_arithmetic_v<T>) {
+        record.append_number(value);
+    } else if constexpr (std::is_pointer_v<std::decay_t<T>> &&
+                         std::is_convertible_v<std::decay_t<T>, const char *>) {
+        record.append_raw(to_str(static_cast<const char *>(value)));
+    } else if constexpr (std::is_convertible_v<const T &, std::string_view>) {
+        record.append_raw(std::string_view(value));
+    } else {
+        // user to_str() overload, may allocate
+        const auto str = to_str(value);
+        record.append_raw(std::string_view(str));
+    }
+}
+
+template<typename T>
+void LogRecord::field(std::string_view key, const T &value) {
+    // text appended since the last field is the message, fields can not follow it
+    const size_t start = m_len;
+    if (m_len != m_fields_end || !append_key(key))
+        return;
+
+    const size_t value_from = m_len;
+    if constexpr (std::is_same_v<T, bool>) {
+        append_raw(value ? "true" : "false");
+    } else if constexpr (std::is_arithmetic_v<T>) {
+        if constexpr (std::is_floating_point_v<T>) {
+            if (!std::isfinite(value)) {
+                append_quoted(std::isnan(value) ? "nan" : value < 0 ? "-inf" : "inf");
+                m_fields_end = m_len;
+                return;
+            }
+        }
+        append_number(value);
+    } else if constexpr (std::is_pointer_v<std::decay_t<T>> && std::is_convertible_v<std::decay_t<T>, const char *>) {
+        append_quoted(to_str(static_cast<const char *>(value)));
+    } else if constexpr (std::is_convertible_v<const T &, std::string_view>) {
+        append_quoted(std::string_view(value));
+    } else {
+        const size_t from = m_len;
+        to_log(*this, value);
+        char text[LOG_RECORD_SIZE];
+        const size_t len = m_len - from;
+        memcpy(text, m_buf + from, len);
+        m_len = from;
+        append_quoted(std::string_view(text, len));
+    }
+
+    // strings are cut short inside their quotes, a number that does not fit drops the whole field
+    if (m_len == value_from || m_len > sizeof(m_buf) - 1 - FIELDS_RESERVE) {
+        m_len = start;
+        return;
+    }
+    m_fields_end = m_len;
+}
+
+// printf format strings of LOG() parsed at compile time: the arguments are checked against their conversions
+// and written with std::to_chars() instead of vsnprintf(), the rare spec it does not render ("%#g") still
+// goes through vsnprintf() with the argument widened to the type the spec expects
+class LogFormat {
+public:
+    enum Flag : uint8_t { Left = 1, Plus = 2, Space = 4, Alt = 8, Zero = 16 };
+
+    static constexpr int NONE = -1;     // no width or precision
+    static constexpr int FROM_ARG = -2; // '*', taken from the argument before the value
+
+    struct Spec {
+        size_t text_from {0}; // literal text written before the conversion
+        size_t text_len {0};
+        char conv {0};        // d i u o x X c f F e E g G a A s p, '%' for "%%", 0 ends the format, '?' is invalid
+        uint8_t flags {0};
+        int width {NONE};
+        int precision {NONE};
+        size_t arg {0};       // index of the first argument the spec takes
+    };
+
+    // index of the first character after the spec starting at f[i] == '%', spec.conv is '?' if it is invalid
+    static constexpr size_t parse_spec(std::string_view f, size_t i, Spec &spec) {
+        i++;
+        for (;; i++) {
+            const char c = i < f.size() ? f[i] : 0;
+            if (c == '-') spec.flags |= Left;
+            else if (c == '+') spec.flags |= Plus;
+            else if (c == ' ') spec.flags |= Space;
+            else if (c == '#') spec.flags |= Alt;
+            else if (c == '0') spec.flags |= Zero;
+            else break;
+        }
+
+        i = parse_number(f, i, spec.width);
+        if (i < f.size() && f[i] == '.') {
+            spec.precision = 0;
+            i = parse_number(f, i + 1, spec.precision);
+        }
+
+        // the argument types are known, length modifiers are accepted and ignored
+        while (i < f.size() && std::string_view("hlLqjzt").find(f[i]) != std::string_view::npos)
+            i++;
+
+        spec.conv = '?';
+        if (i < f.size() && std::string_view("diuoxXcfFeEgGaAsp%").find(f[i]) != std::string_view::npos)
+            spec.conv = f[i++];
+        return i;
+    }
+
+    // conversions in the format, the trailing text included
+    static constexpr size_t count(std::string_view f) {
+        size_t n = 1;
+        for (size_t i = 0; i < f.size();) {
+            if (f[i] == '%') {
+                Spec spec;
+                i = parse_spec(f, i, spec);
+                n++;
+            } else {
+                i++;
+            }
+        }
+        return n;
+    }
+
+    template<size_t N>
+    static constexpr std::array<Spec, N> parse(std::string_view f) {
+        std::array<Spec, N> specs {};
+        size_t n = 0, text_from = 0, arg = 0;
+
+        for (size_t i = 0; i < f.size();) {
+            if (f[i] != '%') {
+                i++;
+                continue;
+            }
+            Spec &spec = specs[n++];
+            spec.text_from = text_from;
+            spec.text_len = i - text_from;
+            spec.arg = arg;
+            i = text_from = parse_spec(f, i, spec);
+            arg += args_of(spec);
+        }
+
+        specs[n].text_from = text_from;
+        specs[n].text_len = f.size() - text_from;
+        specs[n].arg = arg;
+        return specs;
+    }
+
+    static constexpr size_t args_of(const Spec &spec) {
+        if (spec.conv == '%' || spec.conv == '?' || spec.conv == 0)
+            return 0;
+        return 1 + (spec.width == FROM_ARG) + (spec.precision == FROM_ARG);
+    }
+
+    // kinds of argument a conversion takes
+    template<typename T>
+    static constexpr bool is_integer() {
+        return std::is_integral_v<T> || std::is_enum_v<T>;
+    }
+
+    template<typename T>
+    static constexpr bool is_string() {
+        return (std::is_pointer_v<std::decay_t<T>> && std::is_convertible_v<std::decay_t<T>, const char *>) ||
+               std::is_convertible_v<const T &, std::string_view>;
+    }
+
+    template<typename T>
+    static constexpr bool is_pointer() {
+        return std::is_pointer_v<std::decay_t<T>> || std::is_null_pointer_v<T>;
+    }
+
+    // a spec and its arguments, the value is the last one
+    template<typename... Args>
+    static void write(LogRecord &record, const Spec &spec, const Args &... args) {
+        int width = spec.width, precision = spec.precision;
+        const auto &value = take_star(width, precision, spec, args...);
+        if (width < 0 && width != NONE) {
+            // a negative '*' width is a '-' flag
+            Spec left = spec;
+            left.flags |= Left;
+            write_value(record, left, (int) std::min(-(long long) width, (long long) INT32_MAX), precision, value);
+        } else {
+            write_value(record, spec, width, precision < 0 ? NONE : precision, value);
+        }
+    }
+
+private:
+    static constexpr size_t parse_number(std::string_view f, size_t i, int &n) {
+        if (i < f.size() && f[i] == '*') {
+            n = FROM_ARG;
+            return i + 1;
+        }
+        for (; i < f.size() && f[i] >= '0' && f[i] <= '9'; i++)
+            n = (n < 0 ? 0 : n * 10) + (f[i] - '0');
+        return i;
+    }
+
+    template<typename V>
+    static const V &take_star(int &, int &, const Spec &, const V &value) {
+        return value;
+    }
+
+    template<typename W, typename V>
+    static const V &take_star(int &width, int &precision, const Spec &spec, const W &star, const V &value) {
+        (spec.width == FROM_ARG ? width : precision) = (int) star;
+        return value;
+    }
+
+    template<typename W, typename P, typename V>
+    static const V &take_star(int &width, int &precision, const Spec &, const W &w, const P &p, const V &value) {
+        width = (int) w;
+        precision = (int) p;
+        return value;
+    }
+
+    static void pad(LogRecord &record, char c, int n) {
+        static const char zeros[] = "0000000000000000";
+        if (c == ' ') {
+            record.append_spaces(std::max(n, 0));
+            return;
+        }
+        for (; n > 0; n -= (int) sizeof(zeros) - 1)
+            record.append_raw(zeros, std::min<size_t>(n, sizeof(zeros) - 1));
+    }
+
+    // [spaces][prefix][zeros][body][spaces] of a conversion that is width wide
+    static void write_padded(LogRecord &record, const Spec &spec, int width, std::string_view prefix,
+                             int zeros, std::string_view body, bool zero_pad) {
+        const int fill = width - (int) (prefix.size() + body.size()) - zeros;
+        if (!(spec.flags & Left) && !zero_pad)
+            pad(record, ' ', fill);
+        record.append_raw(prefix);
+        pad(record, '0', zero_pad && !(spec.flags & Left) ? std::max(fill, 0) + zeros : zeros);
+        record.append_raw(body);
+        if (spec.flags & Left)
+            pad(record, ' ', fill);
+    }
+
+    template<typename T>
+    static void write_value(LogRecord &record, const Spec &spec, int width, int precision, const T &value) {
+        switch (spec.conv) {
+        case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+            if constexpr (is_integer<T>()) {
+                using E = typename std::conditional_t<std::is_enum_v<T>, std::underlying_type<T>,
+                                                      std::common_type<T>>::type;
+                using I = decltype(+E());
+                write_integer(record, spec, width, precision, static_cast<I>(value));
+            }
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            if constexpr (std::is_floating_point_v<T>) {
+                using D = std::conditional_t<std::is_same_v<T, long double>, long double, double>;
+                write_float(record, spec, width, precision, static_cast<D>(value));
+            }
+            break;
+        case 's':
+            if constexpr (is_string<T>()) {
+                std::string_view str;
+                if constexpr (std::is_pointer_v<std::decay_t<T>>) {
+                    const char *chars = value;
+                    str = chars ? chars : "(null)";
+                } else
+                    str = std::string_view(value);
+                if (precision >= 0)
+                    str = str.substr(0, precision);
+                write_padded(record, spec, width, {}, 0, str, false);
+            }
+            break;
+        case 'p':
+            if constexpr (is_pointer<T>()) {
+                const uintptr_t p = (uintptr_t) (const void *) value;
+                if (p == 0) {
+                    write_padded(record, spec, width, {}, 0, "(nil)", false);
+                } else {
+                    char digits[2 * sizeof(p)];
+                    const auto res = std::to_chars(digits, digits + sizeof(digits), p, 16);
+                    write_padded(record, spec, width, "0x", 0, {digits, (size_t) (res.ptr - digits)}, false);
+                }
+            }
+            break;
+        }
+    }
+
+    template<typename I>
+    static void write_integer(LogRecord &record, const Spec &spec, int width, int precision, I value) {
+        using U = std::make_unsigned_t<I>;
+
+        if (spec.conv == 'c') {
+            const char c = (char) value;
+            write_padded(record, spec, width, {}, 0, {&c, 1}, false);
+            return;
+        }
+
+        const bool is_signed = spec.conv == 'd' || spec.conv == 'i';
+        const bool negative = is_signed && value < 0;
+        const U magnitude = negative ? U(0) - U(value) : U(value);
+        const int base = spec.conv == 'o' ? 8 : spec.conv == 'x' || spec.conv == 'X' ? 16 : 10;
+
+        char digits[sizeof(U) * 3 + 1];
+        size_t len = 0;
+        if (precision != 0 || magnitude != 0)
+            len = std::to_chars(digits, digits + sizeof(digits), magnitude, base).ptr - digits;
+        if (spec.conv == 'X')
+            std::transform(digits, digits + len, digits, [](char c) { return (char) toupper(c); });
+
+        int zeros = std::max(precision - (int) len, 0);
+        std::string_view prefix;
+        if (negative)
+            prefix = "-";
+        else if (is_signed && (spec.flags & Plus))
+            prefix = "+";
+        else if (is_signed && (spec.flags & Space))
+            prefix = " ";
+        else if ((spec.flags & Alt) && spec.conv == 'o' && zeros == 0 && (len == 0 || digits[0] != '0'))
+            zeros = 1;
+        else if ((spec.flags & Alt) && magnitude != 0 && base == 16)
+            prefix = spec.conv == 'x' ? "0x" : "0X";
+
+        write_padded(record, spec, width, prefix, zeros, {digits, len}, (spec.flags & Zero) && precision < 0);
+    }
+
+    template<typename D>
+    static void write_float(LogRecord &record, const Spec &spec, int width, int precision, D value) {
+        const char conv = (char) tolower(spec.conv);
+        const std::chars_format format = conv == 'f' ? std::chars_format::fixed :
+                                         conv == 'e' ? std::chars_format::scientific :
+                                         conv == 'g' ? std::chars_format::general : std::chars_format::hex;
+
+        char digits[128];
+        std::to_chars_result res {nullptr, std::errc::value_too_large};
+        if (!(spec.flags & Alt)) {
+            if (conv == 'a' && precision < 0)
+                res = std::to_chars(digits, digits + sizeof(digits), std::fabs(value), format);
+            else
+                res = std::to_chars(digits, digits + sizeof(digits), std::fabs(value), format,
+                                    precision < 0 ? 6 : precision);
+        }
+
+        if (res.ec != std::errc()) {
+            // "%#g" keeps its trailing zeros and "%.200f" is longer than digits, vsnprintf() writes those
+            char fmt[16] = "%";
+            size_t n = 1;
+            for (int bit = 0; bit < 5; bit++)
+                if (spec.flags & (1 << bit))
+                    fmt[n++] = "-+ #0"[bit];
+            memcpy(fmt + n, "*.*", 3);
+            n += 3;
+            if constexpr (std::is_same_v<D, long double>)
+                fmt[n++] = 'L';
+            fmt[n] = spec.conv;
+            record.append(fmt, std::max(width, 0), precision, value);
+            return;
+        }
+
+        size_t len = res.ptr - digits;
+        const bool finite = std::isfinite(value);
+        if (isupper(spec.conv))
+            std::transform(digits, digits + len, digits, [](char c) { return (char) toupper(c); });
+
+        char prefix[3];
+        size_t prefix_len = 0;
+        if (std::signbit(value))
+            prefix[prefix_len++] = '-';
+        else if (spec.flags & Plus)
+            prefix[prefix_len++] = '+';
+        else if (spec.flags & Space)
+            prefix[prefix_len++] = ' ';
+        if (conv == 'a' && finite) {
+            memcpy(prefix + prefix_len, spec.conv == 'a' ? "0x" : "0X", 2);
+            prefix_len += 2;
+        }
+
+        write_padded(record, spec, width, {prefix, prefix_len}, 0, {digits, len}, finite && (spec.flags & Zero));
+    }
+};
+
+// the parsed format of one LOG() call site, F::str() returns its string literal
+template<typename F>
+struct LogFormatOf {
+    static constexpr std::string_view text = F::str();
+    static constexpr size_t count = LogFormat::count(text);
+    static constexpr std::array<LogFormat::Spec, count> specs = LogFormat::parse<count>(text);
+
+    static constexpr bool valid() {
+        for (const LogFormat::Spec &spec : specs)
+            if (spec.conv == '?')
+                return false;
+        return true;
+    }
+};
+
+// compile time checks of the arguments of spec K, the static_assert names the conversion that does not match
+template<typename F, size_t K, typename... Args>
+constexpr bool log_format_check() {
+    constexpr LogFormat::Spec spec = LogFormatOf<F>::specs[K];
+    constexpr size_t n = LogFormat::args_of(spec);
+
+    if constexpr (n > 0 && spec.arg + n <= sizeof...(Args)) {
+        using V = std::decay_t<std::tuple_element_t<spec.arg + n - 1, std::tuple<Args...>>>;
+        constexpr char c = spec.conv;
+        constexpr bool integer = c == 'd' || c == 'i' || c == 'u' || c == 'o' || c == 'x' || c == 'X' || c == 'c';
+        constexpr bool floating = c == 'f' || c == 'F' || c == 'e' || c == 'E' || c == 'g' || c == 'G' ||
+                                  c == 'a' || c == 'A';
+
+        static_assert(!integer || LogFormat::is_integer<V>(), "LOG format: %d %i %u %o %x %X %c need an integer");
+        static_assert(!floating || std::is_floating_point_v<V>, "LOG format: %f %e %g %a need a floating point value");
+        static_assert(c != 's' || LogFormat::is_string<V>(), "LOG format: %s needs a string");
+        static_assert(c != 'p' || LogFormat::is_pointer<V>(), "LOG format: %p needs a pointer");
+        if constexpr (n > 1) {
+            using W = std::decay_t<std::tuple_element_t<spec.arg, std::tuple<Args...>>>;
+            static_assert(std::is_integral_v<W>, "LOG format: a '*' width or precision needs an int");
+        }
+        if constexpr (n > 2) {
+            using P = std::decay_t<std::tuple_element_t<spec.arg + 1, std::tuple<Args...>>>;
+            static_assert(std::is_integral_v<P>, "LOG format: a '*' width or precision needs an int");
+        }
+    }
+    return true;
+}
+
+template<typename F, typename... Args, size_t... K>
+constexpr bool log_format_check(std::index_sequence<K...>) {
+    static_assert(LogFormatOf<F>::valid(), "LOG format: invalid conversion, % is written as %%");
+    static_assert(LogFormatOf<F>::specs[sizeof...(K) - 1].arg == sizeof...(Args),
+                  "LOG format: the number of arguments does not match the format");
+    return (log_format_check<F, K, Args...>() && ...);
+}
+
+template<typename F, size_t K, typename Tuple, size_t... A>
+void log_format_spec(LogRecord &record, const Tuple &args, std::index_sequence<A...>) {
+    constexpr LogFormat::Spec spec = LogFormatOf<F>::specs[K];
+    record.append_raw(LogFormatOf<F>::text.data() + spec.text_from, spec.text_len);
+
+    if constexpr (spec.conv == '%')
+        record.append_raw("%", 1);
+    else if constexpr (sizeof...(A) > 0)
+        LogFormat::write(record, spec, std::get<spec.arg + A>(args)...);
+}
+
+template<typename F, typename Tuple, size_t... K>
+void log_format_specs(LogRecord &record, const Tuple &args, std::index_sequence<K...>) {
+    (log_format_spec<F, K>(record, args, std::make_index_sequence<LogFormat::args_of(LogFormatOf<F>::specs[K])>()),
+     ...);
+}
+
+// LOG(), the format is a type made by LOG_FORMAT_STRING_() from the string literal
+template<typename F, typename... Args>
+void log_format(LogRecord &record, F, const Args &... args) {
+    constexpr auto specs = std::make_index_sequence<LogFormatOf<F>::count>();
+    static_assert(log_format_check<F, Args...>(specs));
+    log_format_specs<F>(record, std::forward_as_tuple(args...), specs);
+    record.end_truncated();
+}
+
+// number of top level arguments in #__VA_ARGS__
+constexpr size_t count_arg_names(std::string_view names) {
+    size_t count = 0, depth = 0;
+    char quote = 0;
+
+    for (size_t i = 0; i < names.size(); i++) {
+        const char c = names[i];
+
+        if (quote) {
+            if (c == '\\')
+                i++;
+            else if (c == quote)
+                quote = 0;
+        } else if (c == '"' || c == '\'') {
+            quote = c;
+        } else if (c == '(' || c == '[' || c == '{') {
+            depth++;
+        } else if (c == ')' || c == ']' || c == '}') {
+            depth--;
+        } else if (c == ',' && depth == 0) {
+            count++;
+        }
+
+        if (count == 0 && c != ' ')
+            count = 1;
+    }
+
+    return count;
+}
+
+// "a, b, c" -> {"a", " b", " c"}, commas inside brackets and quotes are kept
+template<size_t N>
+constexpr std::array<std::string_view, N> split_arg_names(std::string_view names) {
+    std::array<std::string_view, N> result {};
+    size_t n = 0, start = 0, depth = 0;
+    char quote = 0;
+
+    for (size_t i = 0; i < names.size() && n < N; i++) {
+        const char c = names[i];
+
+        if (quote) {
+            if (c == '\\')
+                i++;
+            else if (c == quote)
+                quote = 0;
+        } else if (c == '"' || c == '\'') {
+            quote = c;
+        } else if (c == '(' || c == '[' || c == '{') {
+            depth++;
+        } else if (c == ')' || c == ']' || c == '}') {
+            depth--;
+        } else if (c == ',' && depth == 0) {
+            result[n++] = names.substr(start, i - start);
+            start = i + 1;
+        }
+    }
+
+    if (n < N)
+        result[n] = names.substr(start);
+
+    return result;
+}
+
+// references to the LOG_CALL arguments, lives for one full expression
+template<typename... Args>
+class ArgList {
+    std::tuple<const Args &...> arg_values;
+
+public:
+    explicit ArgList(const Args &... values) : arg_values(values...) {
+    }
+
+    // "a=1, b=2.000000", structured records get an "args" group with one typed field per argument
+    template<size_t N>
+    void write(LogRecord &record, const std::array<std::string_view, N> &arg_names) const {
+        static_assert(N == sizeof...(Args), "LOG_CALL could not split the argument names");
+
+        size_t i = 0;
+#if LOG_FORMAT != LOG_FORMAT_TEXT
+        record.begin_group("args");
+        std::apply([&](const auto &... elems) { (record.field(arg_names[i++], elems), ...); }, arg_values);
+        record.end_group();
+#else
+        std::apply([&](const auto &... elems) {
+            ((record.append_raw(i ? "," : "", i ? 1 : 0),
+              record.append_raw(arg_names[i++]),
+              record.append_raw("=", 1),
+              to_log(record, elems)), ...);
+        }, arg_values);
+#endif
+    }
+
+    // calls f(value) for every argument in order
+    template<typename F>
+    void visit(F &&f) const {
+        std::apply([&](const auto &... elems) { (f(elems), ...); }, arg_values);
+    }
+};
+
+class LogLevel {
+public:
+    static int get() { return level.load(std::memory_order_relaxed); }
+
+    // also re-evaluates every call site that no LogFilter rule matches
+    static void set(int l);
+
+private:
+    inline static std::atomic<int> level {DEBUG_LEVEL}; // set customized log level
+};
+
+// effective level of one call site, registered with LogFilter the first time it runs.
+// constant initialized, so the static in every macro needs no guard and a check is one relaxed load
+class SiteLevel {
+public:
+    constexpr explicit SiteLevel(const LogSite &site) : m_site(&site) {
+    }
+
+    int get() {
+        const int level = m_level.load(std::memory_order_relaxed);
+        return level != UNREGISTERED ? level : enroll();
+    }
+
+private:
+    friend class LogFilter;
+
+    static constexpr int UNREGISTERED = -1000;
+
+    const LogSite *m_site;
+    std::atomic<int> m_level {UNREGISTERED};
+    SiteLevel *m_next {nullptr}; // LogFilter registry list
+
+    int enroll();
+};
+
+// per call site levels from glob rules such as "net/*.cpp=DEBUG, func_2=INFO".
+// a pattern containing '/' or '.' matches the source path (a leading "*/" is implied), any other
+// matches the function name; the last matching rule wins and the other sites follow LogLevel.
+// rules are read from $THREADLOG_FILTER at startup, set_rules(), load() or watch()
+class LogFilter {
+public:
+    // replaces the rules, returns false and keeps the old ones if spec does not parse
+    static bool set_rules(std::string_view spec) {
+        std::vector<Rule> rules;
+        if (!parse(spec, rules)) {
+            fprintf(stderr,"LogFilter::set_rules() parse() failed!\n");
+            return false;
+        }
+
+        Registry &r = registry();
+        std::scoped_lock l(r.lock);
+        r.rules = std::move(rules);
+        apply(r);
+        return true;
+    }
+
+    // one or more rules per line, '#' starts a comment
+    static bool load(const char *path) {
+        FILE *f = fopen(path, "r");
+        if (f == nullptr) {
+            fprintf(stderr,"LogFilter::load() fopen() failed!\n");
+            return false;
+        }
+
+        std::string spec;
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+            spec.append(buf, n);
+        fclose(f);
+
+        return set_rules(spec);
+    }
+
+    // loads path now and again whenever its mtime changes or sig arrives, 0 disables the signal
+    static bool watch(const char *path, int sig = SIGHUP) {
+        static int fds[2] = {-1, -1};
+
+        if (fds[0] >= 0) {
+            fprintf(stderr,"LogFilter::watch() already watching!\n");
+            return false;
+        }
+
+        if (pipe2(fds, O_CLOEXEC) != 0) {
+            fprintf(stderr,"LogFilter::watch() pipe2() failed!\n");
+            return false;
+        }
+
+        load(path);
+
+        std::thread([file = std::string(path)] {
+            struct stat last{};
+            stat(file.c_str(), &last);
+
+            for (;;) {
+                struct pollfd pfd {fds[0], POLLIN, 0};
+                const int ready = poll(&pfd, 1, LOG_FILTER_CHECK_MS);
+                if (ready < 0 && errno != EINTR)
+                    return;
+
+                bool reload = false;
+                char c;
+                if (ready > 0 && read(fds[0], &c, 1) > 0)
+                    reload = true;
+
+                struct stat st{};
+                if (stat(file.c_str(), &st) == 0 &&
+                    (st.st_mtim.tv_sec != last.st_mtim.tv_sec || st.st_mtim.tv_nsec != last.st_mtim.tv_nsec ||
+                     st.st_ino != last.st_ino || st.st_size != last.st_size)) {
+                    last = st;
+                    reload = true;
+                }
+
+                if (reload)
+                    load(file.c_str());
+            }
+        }).detach();
+
+        if (sig == 0)
+            return true;
+
+        signal_fd() = fds[1];
+
+        struct sigaction sa{};
+        sa.sa_handler = [](int) {
+            const int saved = errno;
+            if (write(signal_fd(), "r", 1) < 0) {
+            }
+            errno = saved;
+        };
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+
+        if (sigaction(sig, &sa, nullptr) != 0) {
+            fprintf(stderr,"LogFilter::watch() sigaction() failed!\n");
+            return false;
+        }
+
+        return true;
+    }
+
+    // re-evaluates every registered site, e.g. after LogLevel::set()
+    static void refresh() {
+        Registry &r = registry();
+        std::scoped_lock l(r.lock);
+        apply(r);
+    }
+
+private:
+    friend class SiteLevel;
+
+    struct Rule {
+        std::string pattern;
+        bool match_path;
+        int level;
+    };
+
+    struct Registry {
+        std::mutex lock;
+        SiteLevel *sites {nullptr};
+        std::vector<Rule> rules;
+
+        Registry() {
+            const char *env = getenv("THREADLOG_FILTER");
+            if (env && !parse(env, rules))
+                fprintf(stderr,"LogFilter::Registry() THREADLOG_FILTER does not parse!\n");
+        }
+    };
+
+    // never destroyed, sites may still log from static destructors
+    static Registry &registry() {
+        static Registry *registry = new Registry;
+        return *registry;
+    }
+
+    static int &signal_fd() {
+        static int fd = -1;
+        return fd;
+    }
+
+    static int enroll(SiteLevel *site) {
+        Registry &r = registry();
+        std::scoped_lock l(r.lock);
+
+        // another thread may have registered it meanwhile
+        int level = site->m_level.load(std::memory_order_relaxed);
+        if (level != SiteLevel::UNREGISTERED)
+            return level;
+
+        site->m_next = r.sites;
+        r.sites = site;
+        level = level_of(r, *site->m_site);
+        site->m_level.store(level, std::memory_order_relaxed);
+        return level;
+    }
+
+    static void apply(Registry &r) {
+        for (SiteLevel *site = r.sites; site; site = site->m_next)
+            site->m_level.store(level_of(r, *site->m_site), std::memory_order_relaxed);
+    }
+
+    static int level_of(const Registry &r, const LogSite &site) {
+        int level = LogLevel::get();
+
+        for (const Rule &rule : r.rules) {
+            if (rule.match_path) {
+                const std::string suffix = "*/" + rule.pattern;
+                if (site.path && (fnmatch(rule.pattern.c_str(), site.path, 0) == 0 ||
+                                  fnmatch(suffix.c_str(), site.path, 0) == 0))
+                    level = rule.level;
+            } else if (fnmatch(rule.pattern.c_str(), std::string(site.func).c_str(), 0) == 0) {
+                level = rule.level;
+            }
+        }
+
+        return level;
+    }
+
+    // "pattern=LEVEL" items separated by ',', ';' or new lines
+    static bool parse(std::string_view spec, std::vector<Rule> &rules) {
+        while (!spec.empty()) {
+            const size_t eol = std::min(spec.find('\n'), spec.size());
+            std::string_view line = spec.substr(0, eol);
+            spec.remove_prefix(std::min(eol + 1, spec.size()));
+            line = line.substr(0, line.find('#'));
+
+            while (!line.empty()) {
+                const size_t end = std::min(line.find_first_of(",;"), line.size());
+                const std::string_view item = trim(line.substr(0, end));
+                line.remove_prefix(std::min(end + 1, line.size()));
+
+                if (item.empty())
+                    continue;
+
+                const size_t eq = item.rfind('=');
+                if (eq == std::string_view::npos)
+                    return false;
+
+                Rule rule;
+                rule.pattern = std::string(trim(item.substr(0, eq)));
+                rule.match_path = rule.pattern.find_first_of("/.") != std::string::npos;
+                if (rule.pattern.empty() || !parse_level(trim(item.substr(eq + 1)), rule.level))
+                    return false;
+
+                rules.push_back(std::move(rule));
+            }
+        }
+
+        return true;
+    }
+
+    static std::string_view trim(std::string_view s) {
+        const size_t first = s.find_first_not_of(" \t\r");
+        if (first == std::string_view::npos)
+            return {};
+        return s.substr(first, s.find_last_not_of(" \t\r") - first + 1);
+    }
+
+    static bool parse_level(std::string_view s, int &level) {
+        static constexpr std::pair<std::string_view, int> names[] = {
+            {"OFF", OFF_LEVEL}, {"ERROR", ERROR_LEVEL}, {"WARN", WARN_LEVEL},
+            {"INFO", INFO_LEVEL}, {"DEBUG", DEBUG_LEVEL}, {"DBUG", DEBUG_LEVEL},
+        };
+
+        for (const auto &name : names) {
+            if (s.size() == name.first.size() &&
+                std::equal(s.begin(), s.end(), name.first.begin(),
+                           [](char a, char b) { return toupper((unsigned char) a) == b; })) {
+                level = name.second;
+                return true;
+            }
+        }
+
+        if (s.size() == 1 && s[0] >= '0' && s[0] <= '3') {
+            level = s[0] - '0';
+            return true;
+        }
+
+        return false;
+    }
+};
+
+inline int SiteLevel::enroll() {
+    return LogFilter::enroll(this);
+}
+
+inline void LogLevel::set(int l) {
+    level.store(l, std::memory_order_relaxed);
+    LogFilter::refresh();
+}
+
+class ThreadColor {
+public:
+    enum Color {
+        Green,
+        Pink,
+        Teal,
+        BoldOrange,
+        BoldGreen,
+        BoldYellow,
+        BoldBlue,
+        BoldPink,
+        BoldTeal
+    };
+
+    static ThreadColor &getInstance() {
+        thread_local ThreadColor t;
+
+        return t;
+    }
+
+    void set() const { LogRecord::get().append_color(code()); }
+
+    static void reset() { LogRecord::get().append_color("\033[0m"); }
+
+    const char *code() const { return code(my_color); }
+
+    int index() const { return my_color; }
+
+    static const char *code(int color) {
+        switch (color) {
+            case Green:
+                return "\033[0;32m";
+            case Pink:
+                return "\033[0;35m";
+            case Teal:
+                return "\033[0;36m";
+            case BoldOrange:
+                return "\033[31;1m";
+            case BoldGreen:
+                return "\033[32;1m";
+            case BoldYellow:
+                return "\033[33;1m";
+            case BoldBlue:
+                return "\033[34;1m";
+            case BoldPink:
+                return "\033[35;1m";
+            case BoldTeal:
+                return "\033[36;1m";
+            default:
+                return "\033[0;37m";
+        }
+    }
+
+private:
+    int my_color;
+
+    ThreadColor() {
+        static int last_color = Green;
+
+        static std::mutex lock;
+        std::scoped_lock l(lock);
+
+        last_color = ++last_color > BoldTeal ? Green : last_color;
+
+        my_color = last_color;
+    }
+};
+
+// starts a record: "<time> [ModuleName][type]: <color><tid>:<indent>"
+inline LogRecord &begin_record(const char *type, unsigned int depth) {
+    LogRecord &record = LogRecord::get();
+    record.append_prefix(type);
+#if LOG_FORMAT != LOG_FORMAT_TEXT
+    record.field("depth", depth);
+#else
+    record.append_raw(" ", 1);
+    ThreadColor::getInstance().set();
+    record.append_uint(record.tid());
+    record.append_raw(":", 1);
+    record.append_spaces(depth * 2);
+#endif
+    return record;
+}
+
+#if LOG_FORMAT != LOG_FORMAT_TEXT
+// func, file and line fields of a structured record
+inline void append_site_fields(LogRecord &record, const LogSite &site) {
+    record.field("func", site.func);
+    record.field("file", site.file);
+    record.field("line", site.line);
+}
+#endif
+
+#if defined (LOG_BINARY)
+// LOG_BINARY records only store raw values, tools/threadlog-decode.cpp renders the text later
+template<typename T>
+void append_binary_arg(LogRecord &record, const T &value) {
+    using D = std::decay_t<T>;
+
+    if constexpr (std::is_enum_v<D>) {
+        append_binary_arg(record, static_cast<std::underlying_type_t<D>>(value));
+    } else if constexpr (std::is_integral_v<D> && sizeof(D) < sizeof(int32_t)) {
+        // promoted like a printf vararg
+        record.append_pod(BinaryLog::ArgInt32);
+        record.append_pod((int32_t) value);
+    } else if constexpr (std::is_integral_v<D> && sizeof(D) == sizeof(int32_t)) {
+        record.append_pod(std::is_signed_v<D> ? BinaryLog::ArgInt32 : BinaryLog::ArgUint32);
+        record.append_pod(value);
+    } else if constexpr (std::is_integral_v<D>) {
+        record.append_pod(std::is_signed_v<D> ? BinaryLog::ArgInt64 : BinaryLog::ArgUint64);
+        record.append_pod((uint64_t) value);
+    } else if constexpr (std::is_same_v<D, long double>) {
+        record.append_pod(BinaryLog::ArgLongDouble);
+        record.append_pod(value);
+    } else if constexpr (std::is_floating_point_v<D>) {
+        record.append_pod(BinaryLog::ArgDouble);
+        record.append_pod((double) value);
+    } else if constexpr (std::is_convertible_v<D, const char *> || std::is_convertible_v<const D &, std::string_view>) {
+        std::string_view str;
+        if constexpr (std::is_convertible_v<D, const char *>)
+            str = to_str(static_cast<const char *>(value));
+        else
+            str = value;
+        record.append_pod(BinaryLog::ArgString);
+        record.append_pod((uint32_t) str.size());
+        record.append_raw(str);
+    } else if constexpr (std::is_pointer_v<D> || std::is_null_pointer_v<D>) {
+        record.append_pod(BinaryLog::ArgPointer);
+        record.append_pod((uint64_t) (uintptr_t) value);
+    } else {
+        static_assert(std::is_void_v<T>, "LOG_BINARY can not store this argument type");
+    }
+}
+
+// one PRINT, LOG_CALL_X or LOG_SCOPE record, the site table entry is written on first use,
+// the format is checked against the arguments as LOG() checks it
+template<typename F, typename... Args>
+void binary_event(std::atomic<uint32_t> &site_id, const LogSite &site, uint8_t event,
+                  unsigned int depth, F, const Args &... args) {
+    static_assert(log_format_check<F, Args...>(std::make_index_sequence<LogFormatOf<F>::count>()));
+    const char *fmt = LogFormatOf<F>::text.data();
+
+    uint32_t id = site_id.load(std::memory_order_acquire);
+    if (id == 0) {
+        static std::mutex lock;
+        std::scoped_lock l(lock);
+
+        id = site_id.load(std::memory_order_relaxed);
+        if (id == 0) {
+            id = BinaryLog::register_site(site, fmt, event);
+
+            const std::string frame = BinaryLog::site_frame(id);
+            LogRecord &def = LogRecord::get();
+            def.set_frame(BinaryLog::FrameSite);
+            def.append_raw(frame.data() + BinaryLog::FRAME_HEADER_SIZE, frame.size() - BinaryLog::FRAME_HEADER_SIZE);
+            LOG_COMMIT();
+
+            site_id.store(id, std::memory_order_release);
+        }
+    }
+
+    const struct timespec ts = LogClock::now();
+    LogRecord &record = LogRecord::get();
+    record.set_frame(BinaryLog::FrameEvent);
+    record.append_pod(id);
+    record.append_pod((int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+    record.append_pod((int32_t) record.tid());
+    record.append_pod((uint16_t) depth);
+    record.append_pod((uint8_t) ThreadColor::getInstance().index());
+    (append_binary_arg(record, args), ...);
+    LOG_COMMIT();
+}
+
+// "} func" line of ThreadDepthKeeper, elapsed is only stored with LOG_PROFILE
+inline void binary_exit(unsigned int depth, std::string_view name, uint64_t elapsed_ns) {
+    const struct timespec ts = LogClock::now();
+    LogRecord &record = LogRecord::get();
+    record.set_frame(BinaryLog::FrameExit);
+    record.append_pod((int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+    record.append_pod((int32_t) record.tid());
+    record.append_pod((uint16_t) depth);
+    record.append_pod((uint8_t) ThreadColor::getInstance().index());
+    record.append_pod((uint16_t) name.size());
+    record.append_raw(name);
+#if defined (LOG_PROFILE)
+    record.append_pod((int64_t) elapsed_ns);
+#else
+    (void) elapsed_ns;
+#endif
+    LOG_COMMIT();
+}
+#endif
+
+// LOG_PROFILE statistics of every LOG_CALL*/LOG_SCOPE site, kept in per-thread tables
+// that only their thread writes and that are merged when a report is asked for
+class Profiler {
+public:
+    struct Stats {
+        const LogSite *site {nullptr};
+        uint64_t count {0};
+        uint64_t total_ns {0};
+        uint64_t self_ns {0};
+        uint64_t max_ns {0};
+        uint64_t hist[LOG_PROFILE_BUCKETS] {}; // hist[i] counts calls of [2^i, 2^(i+1)) ns
+
+        // upper bound of the bucket holding the q quantile
+        uint64_t quantile_ns(double q) const {
+            const uint64_t rank = (uint64_t) (q * count);
+            uint64_t seen = 0;
+            for (int i = 0; i < LOG_PROFILE_BUCKETS; i++) {
+                seen += hist[i];
+                if (seen > rank)
+                    return std::min<uint64_t>(2ULL << i, max_ns);
+            }
+            return max_ns;
+        }
+    };
+
+    static uint64_t now_ns() {
+        struct timespec ts{};
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    // called by ThreadDepthKeeper when a profiled scope is left
+    static void record(const LogSite *site, uint64_t elapsed_ns, uint64_t self_ns) {
+        Table *table = local_table();
+        if (table == nullptr) {
+            // the thread's table was already retired, e.g. a scope left by a later thread_local destructor
+            Stats s;
+            s.site = site;
+            s.count = 1;
+            s.total_ns = s.max_ns = elapsed_ns;
+            s.self_ns = self_ns;
+            s.hist[bucket(elapsed_ns)] = 1;
+
+            Registry &r = registry();
+            std::scoped_lock l(r.lock);
+            fold(r.retired, s);
+            return;
+        }
+
+        Slot *slot = table->find(site);
+        if (slot == nullptr)
+            return;
+
+        // single writer, plain load + store is enough
+        auto add = [](std::atomic<uint64_t> &a, uint64_t v) {
+            a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+        };
+        add(slot->count, 1);
+        add(slot->total_ns, elapsed_ns);
+        add(slot->self_ns, self_ns);
+        if (elapsed_ns > slot->max_ns.load(std::memory_order_relaxed))
+            slot->max_ns.store(elapsed_ns, std::memory_order_relaxed);
+        add(slot->hist[bucket(elapsed_ns)], 1);
+    }
+
+    // merged statistics of all threads, live and exited, sorted by self time
+    static std::vector<Stats> snapshot() {
+        std::vector<Stats> result;
+        Registry &r = registry();
+        std::scoped_lock l(r.lock);
+
+        auto merge = [&result](const Stats &s) { fold(result, s); };
+
+        for (const Stats &s : r.retired)
+            merge(s);
+        for (const Table *t : r.tables)
+            t->for_each(merge);
+
+        std::sort(result.begin(), result.end(),
+                  [](const Stats &a, const Stats &b) { return a.self_ns > b.self_ns; });
+        return result;
+    }
+
+    // logs the top sites of snapshot() as PROFILE records
+    static void dump(size_t top = 20) {
+        const std::vector<Stats> stats = snapshot();
+
+        dump_line("     calls   total ms    self ms     avg us     p50 us     p99 us     max us  site");
+        for (size_t i = 0; i < stats.size() && i < top; i++) {
+            const Stats &s = stats[i];
+            char line[512];
+            snprintf(line, sizeof(line), "%10llu %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f  %.*s %.*s:%d",
+                     (unsigned long long) s.count, s.total_ns / 1e6, s.self_ns / 1e6,
+                     s.count ? s.total_ns / 1e3 / s.count : 0.0, s.quantile_ns(0.5) / 1e3,
+                     s.quantile_ns(0.99) / 1e3, s.max_ns / 1e3,
+                     (int) s.site->func.size(), s.site->func.data(),
+                     (int) s.site->file.size(), s.site->file.data(), s.site->line);
+            dump_line(line);
+        }
+    }
+
+    // dump() whenever sig arrives, the handler only wakes a helper thread
+    static bool install_signal(int sig) {
+        static int fds[2] = {-1, -1};
+
+        if (fds[0] < 0) {
+            if (pipe2(fds, O_CLOEXEC) != 0) {
+                fprintf(stderr,"Profiler::install_signal() pipe2() failed!\n");
+                return false;
+            }
+
+            std::thread([] {
+                char c;
+                while (read(fds[0], &c, 1) > 0 || errno == EINTR)
+                    dump();
+            }).detach();
+        }
+
+        signal_fd() = fds[1];
+
+        struct sigaction sa{};
+        sa.sa_handler = [](int) {
+            const int saved = errno;
+            if (write(signal_fd(), "d", 1) < 0) {
+            }
+            errno = saved;
+        };
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+
+        if (sigaction(sig, &sa, nullptr) != 0) {
+            fprintf(stderr,"Profiler::install_signal() sigaction() failed!\n");
+            return false;
+        }
+
+        return true;
+    }
+
+private:
+    struct Slot {
+        std::atomic<const LogSite *> site {nullptr};
+        std::atomic<uint64_t> count {0};
+        std::atomic<uint64_t> total_ns {0};
+        std::atomic<uint64_t> self_ns {0};
+        std::atomic<uint64_t> max_ns {0};
+        std::atomic<uint64_t> hist[LOG_PROFILE_BUCKETS] {};
+    };
+
+    // open addressing on the site address, slots are only claimed by the owner thread
+    struct Table {
+        Slot slots[LOG_PROFILE_SLOTS];
+
+        Slot *find(const LogSite *site) {
+            size_t i = (reinterpret_cast<uintptr_t>(site) >> 4) % LOG_PROFILE_SLOTS;
+            for (size_t n = 0; n < LOG_PROFILE_SLOTS; n++, i = (i + 1) % LOG_PROFILE_SLOTS) {
+                const LogSite *s = slots[i].site.load(std::memory_order_relaxed);
+                if (s == site)
+                    return &slots[i];
+                if (s == nullptr) {
+                    slots[i].site.store(site, std::memory_order_release);
+                    return &slots[i];
+                }
+            }
+            return nullptr; // full, site is not profiled on this thread
+        }
+
+        template<typename F>
+        void for_each(F &&f) const {
+            for (const Slot &slot : slots) {
+                Stats s;
+                s.site = slot.site.load(std::memory_order_acquire);
+                if (s.site == nullptr)
+                    continue;
+                s.count = slot.count.load(std::memory_order_relaxed);
+                s.total_ns = slot.total_ns.load(std::memory_order_relaxed);
+                s.self_ns = slot.self_ns.load(std::memory_order_relaxed);
+                s.max_ns = slot.max_ns.load(std::memory_order_relaxed);
+                for (int i = 0; i < LOG_PROFILE_BUCKETS; i++)
+                    s.hist[i] = slot.hist[i].load(std::memory_order_relaxed);
+                f(s);
+            }
+        }
+    };
+
+    struct Registry {
+        std::mutex lock;
+        std::vector<Table *> tables;
+        std::vector<Stats> retired; // tables of exited threads, folded per site
+    };
+
+    static Registry &registry() {
+        // never destroyed, threads may exit while static destructors run
+        static Registry *r = new Registry;
+        return *r;
+    }
+
+    // adds s to the entry of its site in list
+    static void fold(std::vector<Stats> &list, const Stats &s) {
+        auto it = std::find_if(list.begin(), list.end(), [&s](const Stats &x) { return x.site == s.site; });
+        if (it == list.end()) {
+            list.push_back(s);
+            return;
+        }
+        it->count += s.count;
+        it->total_ns += s.total_ns;
+        it->self_ns += s.self_ns;
+        it->max_ns = std::max(it->max_ns, s.max_ns);
+        for (int i = 0; i < LOG_PROFILE_BUCKETS; i++)
+            it->hist[i] += s.hist[i];
+    }
+
+    // nullptr once the thread's table was retired
+    static Table *local_table() {
+        struct Owner {
+            Table *table {nullptr};
+            bool retired {false};
+
+            ~Owner() {
+                retired = true;
+                if (table == nullptr)
+                    return;
+
+                Registry &r = registry();
+                std::scoped_lock l(r.lock);
+                table->for_each([&r](const Stats &s) { fold(r.retired, s); });
+                r.tables.erase(std::find(r.tables.begin(), r.tables.end(), table));
+                delete table;
+                table = nullptr;
+            }
+        };
+        thread_local Owner owner;
+
+        if (owner.retired)
+            return nullptr;
+
+        if (owner.table == nullptr) {
+            owner.table = new Table;
+
+            Registry &r = registry();
+            std::scoped_lock l(r.lock);
+            r.tables.push_back(owner.table);
+        }
+
+        return owner.table;
+    }
+
+    static int bucket(uint64_t ns) {
+        const int b = ns ? 63 - __builtin_clzll(ns) : 0;
+        return std::min(b, LOG_PROFILE_BUCKETS - 1);
+    }
+
+    static int &signal_fd() {
+        static int fd = -1;
+        return fd;
+    }
+
+    static void dump_line(const char *line) {
+        LogRecord &record = LogRecord::get();
+        record.append_prefix("PROFILE");
+        record.append_raw(" ", 1);
+        record.append_raw(line);
+        record.append_raw("\n", 1);
+        LOG_COMMIT();
+    }
+};
+
+inline void LogTelemetry::dump() {
+    const Counters c = snapshot().total;
+    uint64_t bytes = 0;
+    for (int i = 0; i < LEVELS; i++)
+        bytes += c.bytes[i];
+
+    LogRecord &record = LogRecord::get();
+    record.append_prefix("STATS");
+    record.append(" records E/W/I/D %llu/%llu/%llu/%llu, %llu bytes, lock waits %llu (%.3f ms), queue waits %llu "
+                  "(%.3f ms), write p50/p99/max %.1f/%.1f/%.1f us, sync %llu p50/p99/max %.1f/%.1f/%.1f us, "
+                  "rotations %llu (max %.3f ms), dropped %llu, suppressed %llu, max depth %u\n",
+                  (unsigned long long) c.records[ERROR_LEVEL], (unsigned long long) c.records[WARN_LEVEL],
+                  (unsigned long long) c.records[INFO_LEVEL], (unsigned long long) c.records[DEBUG_LEVEL],
+                  (unsigned long long) bytes, (unsigned long long) c.lock_waits, c.lock_wait_ns / 1e6,
+                  (unsigned long long) c.queue_waits, c.queue_wait_ns / 1e6,
+                  c.write.quantile_ns(0.5) / 1e3, c.write.quantile_ns(0.99) / 1e3, c.write.max_ns / 1e3,
+                  (unsigned long long) c.sync.count, c.sync.quantile_ns(0.5) / 1e3, c.sync.quantile_ns(0.99) / 1e3,
+                  c.sync.max_ns / 1e3, (unsigned long long) c.rotations, c.max_rotate_ns / 1e6,
+                  (unsigned long long) c.dropped, (unsigned long long) c.suppressed, c.max_depth);
+    LOG_COMMIT();
+}
+
+// LOG_STACK: every ThreadDepthKeeper pushes a frame on its thread's shadow stack. stacks are published in
+// a global table and read by other threads without locks, each frame is guarded by its own seqlock
+class ShadowStack {
+public:
+    struct Frame {
+        const LogSite *site;
+        uint64_t elapsed_ns; // time in frame
+        uint8_t kind;        // Call, Scope or Unknown when INFO was off and nothing was formatted
+        std::string args;    // LOG_CALL arguments or LOG_SCOPE text
+    };
+
+    struct Thread {
+        int tid;
+        uint32_t depth;             // may exceed frames.size(), deep frames are not stored
+        std::vector<Frame> frames;  // outermost first
+    };
+
+    enum Kind {
+        Unknown,
+        Call,
+        Scope
+    };
+
+    static void push(const LogSite &site) {
+        Stack *stack = local_stack();
+        if (stack == nullptr)
+            return;
+
+        const uint32_t depth = stack->depth.load(std::memory_order_relaxed);
+        if (depth < LOG_STACK_DEPTH) {
+            Slot &slot = stack->frames[depth];
+            slot.begin_write();
+            slot.site.store(&site, std::memory_order_relaxed);
+            slot.enter_ns.store(Profiler::now_ns(), std::memory_order_relaxed);
+            slot.kind.store(Unknown, std::memory_order_relaxed);
+            slot.args_len.store(0, std::memory_order_relaxed);
+            slot.end_write();
+        }
+        stack->depth.store(depth + 1, std::memory_order_release);
+    }
+
+    static void pop() {
+        Stack *stack = local_stack();
+        if (stack == nullptr)
+            return;
+
+        const uint32_t depth = stack->depth.load(std::memory_order_relaxed);
+        if (depth > 0)
+            stack->depth.store(depth - 1, std::memory_order_release);
+    }
+
+    // formatted arguments of the innermost frame, truncated to LOG_STACK_ARGS bytes
+    static void set_args(std::string_view args, Kind kind) {
+        Stack *stack = local_stack();
+        if (stack == nullptr)
+            return;
+
+        const uint32_t depth = stack->depth.load(std::memory_order_relaxed);
+        if (depth == 0 || depth > LOG_STACK_DEPTH)
+            return;
+
+        Slot &slot = stack->frames[depth - 1];
+        const size_t len = std::min(args.size(), sizeof(slot.args));
+        slot.begin_write();
+        memcpy(slot.args, args.data(), len);
+        slot.args_len.store(len, std::memory_order_relaxed);
+        slot.kind.store(kind, std::memory_order_relaxed);
+        slot.end_write();
+    }
+
+    // current stacks of all live threads, frames that change while they are read are left out
+    static std::vector<Thread> snapshot() {
+        std::vector<Thread> threads;
+        const uint64_t now = Profiler::now_ns();
+
+        for (auto &entry : table()) {
+            const Stack *stack = entry.load(std::memory_order_acquire);
+            if (stack == nullptr || stack->state.load(std::memory_order_acquire) != Live)
+                continue;
+
+            Thread thread;
+            thread.tid = stack->tid.load(std::memory_order_relaxed);
+            thread.depth = stack->depth.load(std::memory_order_acquire);
+
+            for (uint32_t i = 0; i < std::min<uint32_t>(thread.depth, LOG_STACK_DEPTH); i++) {
+                Frame frame;
+                if (stack->frames[i].read(frame, now))
+                    thread.frames.push_back(std::move(frame));
+            }
+
+            threads.push_back(std::move(thread));
+        }
+
+        return threads;
+    }
+
+    // one "STACK" record per line, innermost frame first:
+    // thread 1234, 2 frames
+    //   #0 func_2(a:1, b:2.0) ----test.cpp:16 (1000.123 ms)
+    //   #1 func_1 { step 1 } ----test.cpp:22 (2000.456 ms)
+    static void dump() {
+        for (const Thread &thread : snapshot()) {
+            LogRecord &record = LogRecord::get();
+            record.append_prefix("STACK");
+            record.append(" thread %d, %u frames\n", thread.tid, thread.depth);
+            LOG_COMMIT();
+
+            for (size_t i = thread.frames.size(); i-- > 0;) {
+                const Frame &f = thread.frames[i];
+                record.append_prefix("STACK");
+                record.append("   #%zu ", thread.frames.size() - 1 - i);
+                record.append_raw(f.site->func);
+                if (f.kind == Call)
+                    record.append("(%s)", f.args.c_str());
+                else if (f.kind == Scope)
+                    record.append(" { %s }", f.args.c_str());
+                record.append_raw(" ----", 5);
+                record.append_location(*f.site);
+                record.append(" (%.3f ms)\n", f.elapsed_ns / 1e6);
+                LOG_COMMIT();
+            }
+        }
+    }
+
+    // dump() whenever sig arrives, the handler only wakes a helper thread
+    static bool install_signal(int sig) {
+        static int fds[2] = {-1, -1};
+
+        if (fds[0] < 0) {
+            if (pipe2(fds, O_CLOEXEC) != 0) {
+                fprintf(stderr,"ShadowStack::install_signal() pipe2() failed!\n");
+                return false;
+            }
+
+            std::thread([] {
+                char c;
+                while (read(fds[0], &c, 1) > 0 || errno == EINTR)
+                    dump();
+            }).detach();
+        }
+
+        signal_fd() = fds[1];
+
+        struct sigaction sa{};
+        sa.sa_handler = [](int) {
+            const int saved = errno;
+            if (write(signal_fd(), "s", 1) < 0) {
+            }
+            errno = saved;
+        };
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+
+        if (sigaction(sig, &sa, nullptr) != 0) {
+            fprintf(stderr,"ShadowStack::install_signal() sigaction() failed!\n");
+            return false;
+        }
+
+        return true;
+    }
+
+private:
+    enum State {
+        Free,
+        Live
+    };
+
+    struct Slot {
+        std::atomic<uint32_t> seq {0}; // odd while the owner writes
+        std::atomic<const LogSite *> site {nullptr};
+        std::atomic<uint64_t> enter_ns {0};
+        std::atomic<uint8_t> kind {Unknown};
+        std::atomic<uint32_t> args_len {0};
+        char args[LOG_STACK_ARGS];
+
+        void begin_write() {
+            seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+
+        void end_write() {
+            seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+        // false if the owner kept writing during every try
+        bool read(Frame &frame, uint64_t now) const {
+            for (int tries = 0; tries < 3; tries++) {
+                const uint32_t before = seq.load(std::memory_order_acquire);
+                if (before & 1)
+                    continue;
+
+                frame.site = site.load(std::memory_order_relaxed);
+                const uint64_t enter = enter_ns.load(std::memory_order_relaxed);
+                frame.kind = kind.load(std::memory_order_relaxed);
+                const size_t len = std::min<size_t>(args_len.load(std::memory_order_relaxed), sizeof(args));
+                frame.args.assign(args, len);
+
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (seq.load(std::memory_order_relaxed) == before && frame.site) {
+                    frame.elapsed_ns = now > enter ? now - enter : 0;
+                    return true;
+                }
+            }
+            return false;
+        }
+    };
+
+    struct Stack {
+        std::atomic<int> state {Live};
+        std::atomic<int> tid {0};
+        std::atomic<uint32_t> depth {0};
+        Slot frames[LOG_STACK_DEPTH];
+    };
+
+    // stacks are never freed, a thread that exits leaves its stack to the next new thread
+    static std::array<std::atomic<Stack *>, LOG_STACK_THREADS> &table() {
+        static std::array<std::atomic<Stack *>, LOG_STACK_THREADS> table {};
+        return table;
+    }
+
+    static int &signal_fd() {
+        static int fd = -1;
+        return fd;
+    }
+
+    static Stack *local_stack() {
+        struct Owner {
+            Stack *stack {claim()};
+
+            ~Owner() {
+                if (stack) {
+                    stack->depth.store(0, std::memory_order_relaxed);
+                    stack->state.store(Free, std::memory_order_release);
+                }
+            }
+        };
+
+        thread_local Owner owner;
+        return owner.stack;
+    }
+
+    // nullptr once LOG_STACK_THREADS threads are live, their frames are not tracked
+    static Stack *claim() {
+        for (auto &entry : table()) {
+            Stack *stack = entry.load(std::memory_order_acquire);
+            int state = Free;
+            if (stack && stack->state.compare_exchange_strong(state, Live, std::memory_order_acquire)) {
+                stack->tid.store(LogRecord::get().tid(), std::memory_order_relaxed);
+                return stack;
+            }
+        }
+
+        Stack *stack = new Stack;
+        stack->tid.store(LogRecord::get().tid(), std::memory_order_relaxed);
+        for (auto &entry : table()) {
+            Stack *expected = nullptr;
+            if (entry.compare_exchange_strong(expected, stack, std::memory_order_release))
+                return stack;
+        }
+
+        delete stack;
+        return nullptr;
+    }
+};
+
+// LOG_TRACE sink: Chrome Trace Event JSON, "B"/"E" events for LOG_CALL*/LOG_SCOPE and "i" events for PRINT records.
+// events are collected in a per-thread buffer and written to LOG_TRACE_FILE one chunk at a time
+class TraceLog {
+public:
+    // LOG_CALL_X/LOG_SCOPE enter, the formatted arguments are kept as args.text
+    static void begin(const LogSite &site, std::string_view name, std::string_view text) {
+        Buffer &buf = Buffer::get();
+        buf.open(name.empty() ? site.func : name, "B", site.type);
+        buf.open_args(site);
+        if (!text.empty()) {
+            buf.key("text");
+            buf.string(text);
+        }
+        buf.close(true);
+    }
+
+    // LOG_CALL enter, every argument becomes a typed field of args
+    template<size_t N, typename... Args>
+    static void begin(const LogSite &site, const std::array<std::string_view, N> &arg_names,
+                      const ArgList<Args...> &args) {
+        Buffer &buf = Buffer::get();
+        buf.open(site.func, "B", site.type);
+        buf.open_args(site);
+        size_t i = 0;
+        args.visit([&](const auto &value) {
+            std::string_view name = arg_names[i++];
+            name.remove_prefix(std::min(name.find_first_not_of(' '), name.size()));
+            buf.key(name);
+            buf.value(value);
+        });
+        buf.close(true);
+    }
+
+    // ThreadDepthKeeper exit, matched with the thread's last "B"
+    static void end() {
+        Buffer &buf = Buffer::get();
+        buf.open({}, "E", nullptr);
+        buf.close(false);
+    }
+
+    // one PRINT record, named after its message
+    static void instant(const LogSite &site, std::string_view text) {
+        Buffer &buf = Buffer::get();
+        buf.open(text.empty() ? site.func : text, "i", site.type);
+        buf.raw(",\"s\":\"t\"");
+        buf.open_args(site);
+        buf.close(true);
+    }
+
+    // writes the calling thread's buffered events, threads also flush when they exit
+    static void flush() {
+        Buffer::get().flush();
+    }
+
+private:
+    class Buffer {
+    public:
+        static Buffer &get() {
+            thread_local Buffer buffer;
+            return buffer;
+        }
+
+        ~Buffer() {
+            flush();
+        }
+
+        // {"name":"...","cat":"INFO","ph":"B","ts":12.345,"pid":1,"tid":2
+        void open(std::string_view name, const char *ph, const char *cat) {
+            const uint64_t now = Profiler::now_ns();
+
+            if (sizeof(m_buf) - m_len < RESERVE || now - m_flushed_ns >= LOG_TRACE_FLUSH_MS * 1000000ULL) {
+                flush();
+                m_flushed_ns = now;
+            }
+
+            raw("{");
+            if (!name.empty()) {
+                raw("\"name\":");
+                string(name);
+                raw(",");
+            }
+            if (cat) {
+                raw("\"cat\":\"");
+                raw(cat);
+                raw("\",");
+            }
+            raw("\"ph\":\"");
+            raw(ph);
+            raw("\",\"ts\":");
+            number(now / 1000);
+            char frac[4] = {'.'};
+            LogTimestamp::write_digits(frac + 1, now % 1000, 3);
+            raw(std::string_view(frac, sizeof(frac)));
+            raw(",\"pid\":");
+            number(m_pid);
+            raw(",\"tid\":");
+            number(LogRecord::get().tid());
+        }
+
+        // ,"args":{"loc":"file.cpp:42"
+        void open_args(const LogSite &site) {
+            raw(",\"args\":{\"loc\":\"");
+            escape(site.file);
+            raw(":");
+            number(site.line);
+            raw("\"");
+        }
+
+        void key(std::string_view name) {
+            raw(",");
+            string(name);
+            raw(":");
+        }
+
+        // numbers and bools stay JSON values, everything else is rendered by to_log() into a string
+        template<typename T>
+        void value(const T &v) {
+            const size_t from = m_scratch.size();
+
+            if constexpr (std::is_same_v<T, bool>) {
+                raw(v ? "true" : "false");
+            } else if constexpr (std::is_arithmetic_v<T>) {
+                m_scratch.append_number(v);
+                if constexpr (std::is_floating_point_v<T>) {
+                    if (!std::isfinite(v)) {
+                        string(std::isnan(v) ? "nan" : v < 0 ? "-inf" : "inf");
+                        m_scratch.clear();
+                        return;
+                    }
+                }
+                raw(m_scratch.view(from));
+            } else {
+                to_log(m_scratch, v);
+                string(m_scratch.view(from));
+            }
+
+            m_scratch.clear();
+        }
+
+        void string(std::string_view str) {
+            raw("\"");
+            escape(str);
+            raw("\"");
+        }
+
+        void close(bool args) {
+            raw(args ? "}},\n" : "},\n");
+        }
+
+        void raw(std::string_view str) {
+            const size_t len = std::min(str.size(), sizeof(m_buf) - m_len);
+            memcpy(m_buf + m_len, str.data(), len);
+            m_len += len;
+        }
+
+        void number(unsigned long long v) {
+            auto res = std::to_chars(m_buf + m_len, m_buf + sizeof(m_buf), v);
+            if (res.ec == std::errc())
+                m_len = res.ptr - m_buf;
+        }
+
+        void flush() {
+            if (m_len == 0)
+                return;
+
+            std::scoped_lock l(lock());
+            file().write(m_buf, m_len);
+            m_len = 0;
+        }
+
+    private:
+        // room kept for one event, strings are cut short instead of overrunning it
+        static constexpr size_t RESERVE = 2 * LOG_RECORD_SIZE + 1024;
+        static_assert(LOG_TRACE_BUFFER_SIZE >= 2 * RESERVE, "LOG_TRACE_BUFFER_SIZE is too small");
+
+        char m_buf[LOG_TRACE_BUFFER_SIZE];
+        size_t m_len {0};
+        uint64_t m_flushed_ns {Profiler::now_ns()};
+        unsigned long long m_pid {(unsigned long long) getpid()};
+        LogRecord m_scratch; // to_log() target for LOG_CALL arguments
+
+        void escape(std::string_view str) {
+            const size_t limit = sizeof(m_buf) - 64;
+
+            if (m_len < limit)
+                m_len += LogEscape::json(m_buf + m_len, limit - m_len, str);
+        }
+    };
+
+    static std::mutex &lock() {
+        static std::mutex lock;
+        return lock;
+    }
+
+    // a new file starts the JSON array, the closing ']' is optional for trace viewers
+    static RotateLog &file() {
+        static RotateLog file(LOG_TRACE_FILE, LOG_TRACE_FILE_SIZE_LIMIT, [](int fd, size_t size) {
+            if (size != 0)
+                return;
+
+            char header[256];
+            const int n = snprintf(header, sizeof(header),
+                                   "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                                   "\"args\":{\"name\":\"" ModuleName "\"}},\n", (int) getpid());
+            write_fd(fd, header, n);
+        });
+        return file;
+    }
+};
+
+class ThreadDepthKeeper {
+public:
+    ThreadDepthKeeper() : ThreadDepthKeeper(LogLevel::get() >= INFO_LEVEL) {
     }
 
-private:
-    FILE *m_file_ptr {nullptr};
+    // enabled is decided once, so the "}" line always matches its "{"
+    explicit ThreadDepthKeeper(bool enabled) : mEnabled(enabled) {
+        if (mEnabled) {
+            (*getDepth())++;
+            LogTelemetry::depth(*getDepth());
+        }
+    }
 
-    static long get_file_size(const char *filename) {
-        struct stat st{};
-        if (stat(filename, &st) == 0)
-            return st.st_size;
+    explicit ThreadDepthKeeper(const LogSite &site) : ThreadDepthKeeper(site, LogLevel::get() >= INFO_LEVEL) {
+    }
 
-        return 0;
+    ThreadDepthKeeper(const LogSite &site, bool enabled) : ThreadDepthKeeper(enabled) {
+#if defined (LOG_STACK)
+        ShadowStack::push(site);
+        mStacked = true;
+#endif
+#if defined (LOG_PROFILE)
+        mSite = &site;
+        mParent = current();
+        current() = this;
+        mStart = Profiler::now_ns();
+#else
+        (void) site;
+#endif
     }
 
-    bool rotate_logs() {
-        if (!close_log_file()) {
-            fprintf(stderr,"RotateLog::rotate_logs() close_log_file() failed!\n");
-            return false;
+    ~ThreadDepthKeeper() {
+        [[maybe_unused]] uint64_t elapsed = 0;
+#if defined (LOG_PROFILE)
+        if (mSite) {
+            elapsed = Profiler::now_ns() - mStart;
+            Profiler::record(mSite, elapsed, elapsed - std::min(mChildNs, elapsed));
+            if (mParent)
+                mParent->mChildNs += elapsed;
+            current() = mParent;
         }
+#endif
+#if defined (LOG_TRACE)
+        if (mTraced)
+            TraceLog::end();
+#endif
+#if defined (LOG_STACK)
+        if (mStacked)
+            ShadowStack::pop();
+#endif
 
-        char old_name[256], new_name[256];
+        if (!mSilent && mEnabled) {
+#if defined (LOG_BINARY)
+            binary_exit(*getDepth(), mDepthName, elapsed);
+            (*getDepth())--;
+            return;
+#endif
+            LogRecord &record = begin_record("INFO", *getDepth() - 1);
+#if LOG_FORMAT != LOG_FORMAT_TEXT
+            record.field("event", std::string_view("exit"));
+            if (!mDepthName.empty())
+                record.field("func", mDepthName);
+#if defined (LOG_PROFILE)
+            record.field("elapsed_ms", elapsed / 1e6);
+#endif
+#else
+            record.append_raw("  } ", 4);
+            record.append_raw(mDepthName);
+#if defined (LOG_PROFILE)
+            record.append(" (%.3f ms)", elapsed / 1e6);
+#endif
+            record.append_raw("\n", 1);
 
-        snprintf(old_name, sizeof(old_name), LOG_FILE ".%d", LOG_ROTATE_NUM);
+            ThreadColor::reset();
 
-        if (access(old_name, F_OK) == 0) {
-            if (unlink(old_name) != 0) {
-                fprintf(stderr,"RotateLog::rotate_logs() unlink() failed!\n");
-                return false;
+            if (*getDepth() == 1) {
+                record.append_prefix("INFO");
+                record.append_raw("\n", 1);
             }
-        }
+#endif
 
-        for (int i = LOG_ROTATE_NUM - 1; i >= 1; --i) {
-            snprintf(old_name, sizeof(old_name), LOG_FILE ".%d", i);
-            snprintf(new_name, sizeof(new_name), LOG_FILE ".%d", i + 1);
+            LOG_COMMIT();
 
-            if (access(old_name, F_OK) == 0) {
-                if (rename(old_name, new_name) != 0) {
-                    fprintf(stderr,"RotateLog::rotate_logs() rename() failed!\n");
-                    return false;
-                }
-            }
+            (*getDepth())--;
         }
+    }
 
-        if (access(LOG_FILE, F_OK) == 0) {
-            if (rename(LOG_FILE, LOG_FILE ".1") != 0) {
-                fprintf(stderr,"RotateLog::rotate_logs() rename() failed!\n");
-                return false;
-            }
+    void setDepthName(std::string_view name) {
+        if (mEnabled) {
+            mDepthName = name;
         }
+    }
 
-        if (!open_log_file()) {
-            fprintf(stderr,"RotateLog::rotate_logs() open_log_file() failed!\n");
-            return false;
+    // rate limited call was suppressed: nothing is printed and nested records keep the outer depth
+    void setSilent() {
+        if (!mSilent && mEnabled) {
+            (*getDepth())--;
         }
+        mSilent = true;
+    }
 
-        return true;
+    bool enabled() const { return mEnabled; }
+
+    // a "B" trace event was written for this scope, the destructor writes the "E"
+    void setTraced() {
+#if defined (LOG_TRACE)
+        mTraced = true;
+#endif
     }
 
-    bool open_log_file() {
-        m_file_ptr = fopen(LOG_FILE, "a");
-        if (m_file_ptr == nullptr) {
-            fprintf(stderr,"fopen() log file failed!\n");
-            return false;
-        }
+    static uint *getDepth() {
+        static thread_local uint depth = 0;
 
-        return true;
+        return &depth;
     }
 
-    bool close_log_file() {
-        if (m_file_ptr == nullptr)
-            return true;
+private:
+    std::string_view mDepthName;
+    bool mEnabled;
+    bool mSilent {false};
 
-        if (fclose(m_file_ptr) != 0) {
-            fprintf(stderr,"fclose() log file failed!\n");
-            return false;
-        }
+#if defined (LOG_TRACE)
+    bool mTraced {false};
+#endif
+#if defined (LOG_STACK)
+    bool mStacked {false};
+#endif
 
-        m_file_ptr = nullptr;
-        return true;
+#if defined (LOG_PROFILE)
+    const LogSite *mSite {nullptr};
+    ThreadDepthKeeper *mParent {nullptr};
+    uint64_t mStart {0};
+    uint64_t mChildNs {0}; // time spent in nested profiled scopes
+
+    // innermost profiled scope of this thread
+    static ThreadDepthKeeper *&current() {
+        static thread_local ThreadDepthKeeper *keeper = nullptr;
+        return keeper;
     }
+#endif
 };
 
-inline std::string to_str(const std::string &str) {
-    return str;
-}
-
-inline std::string to_str(const char *chars) {
-    return chars;
+// "func(" ... ") { ----file:line", shared by LOG_CALL and LOG_CALL_X
+inline LogRecord &begin_call_record(ThreadDepthKeeper &keeper, const LogSite &site) {
+    keeper.setDepthName(site.func);
+    LogRecord &record = begin_record("INFO", *ThreadDepthKeeper::getDepth() - 1);
+#if LOG_FORMAT != LOG_FORMAT_TEXT
+    record.field("event", std::string_view("call"));
+    append_site_fields(record, site);
+#else
+    record.append_raw("  ", 2);
+    record.append_raw(site.func);
+    record.append_raw("(", 1);
+#endif
+    return record;
 }
 
-inline std::string to_str(bool b) {
-    return b? "true": "false";
+// args_from is where the arguments start in the record
+inline void end_call_record(LogRecord &record, const LogSite &site, size_t args_from) {
+#if defined (LOG_STACK)
+    ShadowStack::set_args(record.view(args_from), ShadowStack::Call);
+#else
+    (void) args_from;
+#endif
+#if LOG_FORMAT != LOG_FORMAT_TEXT
+    (void) record;
+    (void) site;
+#else
+    record.append_raw(") { ----", 8);
+    record.append_location(site);
+    record.append_raw("\n", 1);
+    ThreadColor::reset();
+#endif
+    LOG_COMMIT();
 }
 
-template<typename T>
-std::string to_str(const T &t) {
-    return std::to_string(t);
+// renders the LOG_CALL arguments into the record and, with LOG_TRACE, into the "B" trace event
+template<size_t N, typename... Args>
+void write_call_args(LogRecord &record, ThreadDepthKeeper &keeper, const LogSite &site,
+                     const std::array<std::string_view, N> &arg_names, const ArgList<Args...> &args) {
+    args.write(record, arg_names);
+#if defined (LOG_TRACE)
+    TraceLog::begin(site, arg_names, args);
+    keeper.setTraced();
+#else
+    (void) keeper;
+    (void) site;
+#endif
 }
 
-inline std::vector<std::string> split_str(const std::string &str, char delimiter) {
-    std::vector<std::string> result;
-    std::stringstream ss(str);
-    std::string item;
-
-    while (std::getline(ss, item, delimiter)) {
-        result.push_back(item);
+// state of one rate limited call site, checked with relaxed atomics before anything is formatted.
+// the time based limits count what they drop and report() it with the next record that passes,
+// LOG_EVERY_N/LOG_FIRST_N drop a known number and report nothing
+class LogLimit {
+public:
+    bool every_n(uint64_t n) {
+        return m_count.fetch_add(1, std::memory_order_relaxed) % std::max<uint64_t>(n, 1) == 0;
     }
 
-    return result;
-}
+    bool first_n(uint64_t n) {
+        // stops writing the shared counter once the site is closed
+        if (m_count.load(std::memory_order_relaxed) >= n)
+            return false;
+        return m_count.fetch_add(1, std::memory_order_relaxed) < n;
+    }
 
-inline std::string catenate(const std::string &names) {
-    return names;
-}
+    bool every_ms(int64_t ms) {
+        const int64_t now = now_ns();
+        int64_t next = m_next.load(std::memory_order_relaxed);
 
-template<typename... Args>
-class ArgList {
-    std::vector<std::string> arg_names;
-    std::tuple<Args...> arg_values;
-    std::vector<std::string> arg_values_strs;
+        if (now >= next && m_next.compare_exchange_strong(next, now + ms * 1000000, std::memory_order_relaxed))
+            return true;
 
-public:
-    explicit ArgList(Args... values) : arg_values(values...) {
+        m_suppressed.fetch_add(1, std::memory_order_relaxed);
+        LogTelemetry::suppressed();
+        return false;
     }
 
-    void set_names(const std::vector<std::string> &names) {
-        arg_names = names;
-    }
+    // token bucket kept as one timestamp (GCRA): m_next is when the bucket will be full again
+    bool ratelimited(double per_sec, uint64_t burst) {
+        const int64_t interval = (int64_t) (1e9 / std::max(per_sec, 1e-3));
+        const int64_t tolerance = interval * (int64_t) (std::max<uint64_t>(burst, 1) - 1);
+        const int64_t now = now_ns();
+        int64_t next = m_next.load(std::memory_order_relaxed);
 
-    std::string string() {
-        std::string str;
-        std::apply([this](const auto &... elems) {
-            ((arg_values_strs.push_back(to_str(elems))), ...);
-        }, arg_values);
-        for (int i = 0; i < arg_names.size(); i++) {
-            str += arg_names[i];
-            str += "=";
-            str += arg_values_strs[i];
-            str += ",";
-        }
-        if (!str.empty()) {
-            str.pop_back();
+        for (;;) {
+            const int64_t start = std::max(next, now);
+            if (start - now > tolerance) {
+                m_suppressed.fetch_add(1, std::memory_order_relaxed);
+                LogTelemetry::suppressed();
+                return false;
+            }
+            if (m_next.compare_exchange_weak(next, start + interval, std::memory_order_relaxed))
+                return true;
         }
-        return str;
     }
-};
 
-class LogLevel {
-public:
-    static int get() { return level; }
+    // "suppressed N records ----file:line" before the first record after a suppressed window
+    void report(const LogSite &site) {
+        if (m_suppressed.load(std::memory_order_relaxed) == 0)
+            return;
 
-    static void set(int l) { level = l; }
+        const uint64_t n = m_suppressed.exchange(0, std::memory_order_relaxed);
+        if (n == 0)
+            return;
+
+        LogRecord &record = begin_record(site.type, *ThreadDepthKeeper::getDepth());
+        record.append_raw("  suppressed ", 13);
+        record.append_uint(n);
+        record.append_raw(" records ----", 13);
+        record.append_location(site);
+        record.append_raw("\n", 1);
+        ThreadColor::reset();
+        LOG_COMMIT();
+    }
 
 private:
-    inline static int level = DEBUG_LEVEL; // set customized log level
-};
+    std::atomic<uint64_t> m_count {0};
+    std::atomic<int64_t> m_next {0};
+    std::atomic<uint64_t> m_suppressed {0};
 
-class PrintLock {
-public:
-    static std::recursive_mutex &get() {
-        static std::recursive_mutex lock;
-        return lock;
+    // vDSO read, the windows are as fine as the scheduler tick
+    static int64_t now_ns() {
+        struct timespec ts{};
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
     }
 };
 
-class ThreadColor {
-public:
-    enum Color {
-        Green,
-        Pink,
-        Teal,
-        BoldOrange,
-        BoldGreen,
-        BoldYellow,
-        BoldBlue,
-        BoldPink,
-        BoldTeal
-    };
-
-    static ThreadColor &getInstance() {
-        thread_local ThreadColor t;
-
-        return t;
-    }
+// statements that only exist with LOG_TRACE
+#if defined (LOG_TRACE)
+#define LOG_TRACE_(...) __VA_ARGS__
+#else
+#define LOG_TRACE_(...)
+#endif
 
-    void set() const {
-        switch (my_color) {
-            case Green:
-                LOG("\033[0;32m");
-                break;
-            case Pink:
-                LOG("\033[0;35m");
-                break;
-            case Teal:
-                LOG("\033[0;36m");
-                break;
-            case BoldOrange:
-                LOG("\033[31;1m");
-                break;
-            case BoldGreen:
-                LOG("\033[32;1m");
-                break;
-            case BoldYellow:
-                LOG("\033[33;1m");
-                break;
-            case BoldBlue:
-                LOG("\033[34;1m");
-                break;
-            case BoldPink:
-                LOG("\033[35;1m");
-                break;
-            case BoldTeal:
-                LOG("\033[36;1m");
-                break;
-            default:
-                LOG("\033[0;37");
-                break;
-        }
-    }
+// statements that only exist with LOG_STACK
+#if defined (LOG_STACK)
+#define LOG_STACK_(...) __VA_ARGS__
+#else
+#define LOG_STACK_(...)
+#endif
 
-    static void reset() { LOG("\033[0m"); }
+#if defined (LOG_BINARY)
 
-private:
-    int my_color;
+// LOG_CALL_X, LOG_SCOPE, LOG_INFO and LOG_DBUG only store the site id and raw arguments,
+// LOG_CALL, LOG_WARN and LOG_ERROR stay text and are written to stderr as well
+#define LOG_EVENT_(event, site, ...)                                           \
+  LOG_EVENT_FORMAT_(event, site, __VA_ARGS__)
 
-    ThreadColor() {
-        static int last_color = Green;
+// LOG_CALL_X() and LOG_SCOPE() without a format store ""
+#define LOG_EVENT_FORMAT_(event, site, fmt, ...)                               \
+  {                                                                            \
+    static std::atomic<uint32_t> log_event_id_ {0};                            \
+    binary_event(log_event_id_, site, event, *ThreadDepthKeeper::getDepth(),   \
+                 LOG_FORMAT_STRING_(fmt), ##__VA_ARGS__);                      \
+  }
 
-        static std::mutex lock;
-        std::scoped_lock l(lock);
+#define LOG_CALL_RECORD_(site, keeper, ...)                                    \
+  {                                                                            \
+    keeper.setDepthName(site.func);                                            \
+    LOG_TRACE_(TraceLog::begin(site, {}, {}); keeper.setTraced();)             \
+    LOG_EVENT_(BinaryLog::EventCall, site, ##__VA_ARGS__)                      \
+  }
 
-        last_color = ++last_color > BoldTeal ? Green : last_color;
+#define LOG_SCOPE_RECORD_(site, keeper, ...)                                   \
+  {                                                                            \
+    keeper.setDepthName("");                                                   \
+    LOG_TRACE_(TraceLog::begin(site, {}, {}); keeper.setTraced();)             \
+    LOG_EVENT_(BinaryLog::EventScope, site, ##__VA_ARGS__)                     \
+  }
 
-        my_color = last_color;
-    }
-};
+#define LOG_PRINT_RECORD_(type, ...)                                           \
+  {                                                                            \
+    LOG_SITE_(log_print_site_, type);                                          \
+    LOG_TRACE_(TraceLog::instant(log_print_site_, {});)                        \
+    LOG_EVENT_(BinaryLog::EventPrint, log_print_site_, __VA_ARGS__)            \
+  }
 
-class ThreadDepthKeeper {
-public:
-    ThreadDepthKeeper() {
-        if (LogLevel::get() >= INFO_LEVEL) {
-            (*getDepth())++;
-        }
-    }
+#else
 
-    ~ThreadDepthKeeper() {
-        if (LogLevel::get() >= INFO_LEVEL) {
-            std::scoped_lock l(PrintLock::get());
+#define LOG_CALL_RECORD_(site, keeper, ...)                                    \
+  {                                                                            \
+    LogRecord &record_ = begin_call_record(keeper, site);                      \
+    const size_t args_from_ = record_.size();                                  \
+    LOG(__VA_ARGS__);                                                          \
+    LOG_TRACE_(TraceLog::begin(site, {}, record_.view(args_from_));            \
+               keeper.setTraced();)                                            \
+    end_call_record(record_, site, args_from_);                                \
+  }
 
-            struct tm *now;
-            struct timespec ts{};
-            clock_gettime(CLOCK_REALTIME, &ts);
-            now = localtime(&ts.tv_sec);
-            LOG("%04d/%02d/%02d %02d:%02d:%02d:%03ld [%s][INFO]: ",
-                    now->tm_year + 1900, now->tm_mon + 1, now->tm_mday,
-                    now->tm_hour, now->tm_min, now->tm_sec, ts.tv_nsec / 1000000, ModuleName);
+#if LOG_FORMAT != LOG_FORMAT_TEXT
 
-            ThreadColor::getInstance().set();
+#define LOG_SCOPE_RECORD_(site, keeper, ...)                                   \
+  {                                                                            \
+    keeper.setDepthName("");                                                   \
+    LogRecord &record_ =                                                       \
+        begin_record("INFO", *ThreadDepthKeeper::getDepth() - 1);              \
+    record_.field("event", std::string_view("scope"));                         \
+    append_site_fields(record_, site);                                         \
+    [[maybe_unused]] const size_t args_from_ = record_.size();                 \
+    LOG(__VA_ARGS__);                                                          \
+    LOG_TRACE_(TraceLog::begin(site, record_.view(args_from_), {});            \
+               keeper.setTraced();)                                            \
+    LOG_STACK_(ShadowStack::set_args(record_.view(args_from_),                 \
+                                     ShadowStack::Scope);)                     \
+    LOG_COMMIT();                                                              \
+  }
 
-            LOG("%d:%s", THREADID_,
-                    std::string((*getDepth() - 1) * 2, ' ').c_str());
+#else
 
-            LOG("  } %s\n", mDepthName.c_str());
+#define LOG_SCOPE_RECORD_(site, keeper, ...)                                   \
+  {                                                                            \
+    keeper.setDepthName("");                                                   \
+    LogRecord &record_ =                                                       \
+        begin_record("INFO", *ThreadDepthKeeper::getDepth());                  \
+    record_.append_raw("{\n", 2);                                              \
+    ThreadColor::reset();                                                      \
+    begin_record("INFO", *ThreadDepthKeeper::getDepth() - 1);                  \
+    record_.append_raw("    ", 4);                                             \
+    [[maybe_unused]] const size_t args_from_ = record_.size();                 \
+    LOG(__VA_ARGS__);                                                          \
+    LOG_TRACE_(TraceLog::begin(site, record_.view(args_from_), {});            \
+               keeper.setTraced();)                                            \
+    LOG_STACK_(ShadowStack::set_args(record_.view(args_from_),                 \
+                                     ShadowStack::Scope);)                     \
+    record_.append_raw("  ----", 6);                                           \
+    record_.append_location(site);                                             \
+    record_.append_raw("\n", 1);                                               \
+    ThreadColor::reset();                                                      \
+    LOG_COMMIT();                                                              \
+  }
 
-            ThreadColor::reset();
+#endif
 
-            if (*getDepth() == 1) {
-                LOG("%04d/%02d/%02d %02d:%02d:%02d:%03ld [%s][INFO]:\n",
-                    now->tm_year + 1900, now->tm_mon + 1, now->tm_mday,
-                    now->tm_hour, now->tm_min, now->tm_sec, ts.tv_nsec / 1000000, ModuleName);
-            }
+#define LOG_PRINT_RECORD_(type, ...) PRINT(type, __VA_ARGS__)
 
-            fflush(stderr);
+#endif
 
-            (*getDepth())--;
-        }
-    }
+#if LOG_COMPILE_LEVEL >= INFO_LEVEL
 
-    void setDepthName(const std::string &name) {
-        if (LogLevel::get() >= INFO_LEVEL) {
-            mDepthName = name;
-        }
-    }
+// passes no arg
+#define LOG_CALL_0(...)                                                        \
+    LOG_CALL_X("");                                                            \
 
-    static uint *getDepth() {
-        static thread_local uint depth = 0;
+// passes arg list, LOG_CALL will print arg names and arg values in human-readable way,
+// names are split at compile time and values are only rendered when INFO is enabled
+#define LOG_CALL(...) LOG_CALL_BODY_(, #__VA_ARGS__, __VA_ARGS__)
 
-        return &depth;
-    }
+// use printf way
+#define LOG_CALL_X(...) LOG_CALL_X_BODY_(, __VA_ARGS__)
 
-private:
-    std::string mDepthName;
-};
+// track the thread when enters a block of code
+#define LOG_SCOPE(...) LOG_SCOPE_BODY_(, __VA_ARGS__)
 
-// a hack for fprintf with one arg
-inline int fprintf(FILE *) {
-  return 0;
-}
+// rate limited LOG_CALL/LOG_SCOPE, a suppressed call still tracks depth and profile but prints nothing
+#define LOG_CALL_EVERY_N(n, ...)                                               \
+  LOG_CALL_BODY_(LOG_CALL_LIMIT_(log_limit_.every_n(n)), #__VA_ARGS__, __VA_ARGS__)
+#define LOG_CALL_FIRST_N(n, ...)                                               \
+  LOG_CALL_BODY_(LOG_CALL_LIMIT_(log_limit_.first_n(n)), #__VA_ARGS__, __VA_ARGS__)
+#define LOG_CALL_EVERY_MS(ms, ...)                                             \
+  LOG_CALL_BODY_(LOG_CALL_LIMIT_(log_limit_.every_ms(ms)), #__VA_ARGS__, __VA_ARGS__)
+#define LOG_CALL_RATELIMITED(per_sec, burst, ...)                              \
+  LOG_CALL_BODY_(LOG_CALL_LIMIT_(log_limit_.ratelimited(per_sec, burst)), #__VA_ARGS__, __VA_ARGS__)
 
-// passes no arg
-#define LOG_CALL_0(...)      \
-    LOG_CALL_X("");          \
+#define LOG_SCOPE_EVERY_N(n, ...)                                              \
+  LOG_SCOPE_BODY_(LOG_CALL_LIMIT_(log_limit_.every_n(n)), __VA_ARGS__)
+#define LOG_SCOPE_FIRST_N(n, ...)                                              \
+  LOG_SCOPE_BODY_(LOG_CALL_LIMIT_(log_limit_.first_n(n)), __VA_ARGS__)
+#define LOG_SCOPE_EVERY_MS(ms, ...)                                            \
+  LOG_SCOPE_BODY_(LOG_CALL_LIMIT_(log_limit_.every_ms(ms)), __VA_ARGS__)
+#define LOG_SCOPE_RATELIMITED(per_sec, burst, ...)                             \
+  LOG_SCOPE_BODY_(LOG_CALL_LIMIT_(log_limit_.ratelimited(per_sec, burst)), __VA_ARGS__)
 
-// passes arg list, LOG_CALL will print arg names and arg values in human-readable way
-#define LOG_CALL(...)                                            \
-    auto arg_list = ArgList(__VA_ARGS__);                        \
-    arg_list.set_names(split_str(catenate(#__VA_ARGS__), ','));  \
-    LOG_CALL_X(arg_list.string().c_str());                       \
+#define LOG_CALL_BODY_(gate, names, ...)                                       \
+  LOG_SITE_(log_call_site_, "INFO");                                           \
+  static SiteLevel log_call_level_ {log_call_site_};                           \
+  ThreadDepthKeeper thread_depth_keeper(log_call_site_,                        \
+                                        log_call_level_.get() >= INFO_LEVEL);  \
+  do {                                                                         \
+    if (thread_depth_keeper.enabled()) {                                       \
+      gate                                                                     \
+      static constexpr auto arg_names_ =                                       \
+          split_arg_names<count_arg_names(names)>(names);                      \
+      LogRecord &record_ =                                                     \
+          begin_call_record(thread_depth_keeper, log_call_site_);              \
+      const size_t args_from_ = record_.size();                                \
+      write_call_args(record_, thread_depth_keeper, log_call_site_,            \
+                      arg_names_, ArgList(__VA_ARGS__));                       \
+      end_call_record(record_, log_call_site_, args_from_);                    \
+    }                                                                          \
+  } while (0)
 
-// use printf way
-#define LOG_CALL_X(...)                                                        \
-  ThreadDepthKeeper thread_depth_keeper;                                       \
+#define LOG_CALL_X_BODY_(gate, ...)                                            \
+  LOG_SITE_(log_call_site_, "INFO");                                           \
+  static SiteLevel log_call_level_ {log_call_site_};                           \
+  ThreadDepthKeeper thread_depth_keeper(log_call_site_,                        \
+                                        log_call_level_.get() >= INFO_LEVEL);  \
   do {                                                                         \
-    if (LogLevel::get() >= INFO_LEVEL) {                                       \
-      struct tm *now;                                                          \
-      struct timespec ts{};                                                    \
-      clock_gettime(CLOCK_REALTIME,&ts);                                       \
-      now = localtime(&ts.tv_sec);                                             \
-      {                                                                        \
-        std::scoped_lock l(PrintLock::get());                                  \
-        LOG("%04d/%02d/%02d %02d:%02d:%02d:%03ld [%s][INFO]: ",                \
-            now->tm_year + 1900, now->tm_mon + 1, now->tm_mday,                \
-            now->tm_hour, now->tm_min, now->tm_sec,                            \
-            ts.tv_nsec/1000000, ModuleName);                                   \
-        ThreadColor::getInstance().set();                                      \
-        std::string depth_name;                                                \
-        std::string func_name = __PRETTY_FUNCTION__;                           \
-        func_name = func_name.substr(0, func_name.find('('));                  \
-        func_name = func_name.substr(func_name.find_last_of(' ') + 1);         \
-        depth_name += func_name;                                               \
-        thread_depth_keeper.setDepthName(depth_name);                          \
-        LOG("%d:%s", THREADID_,                                                \
-            std::string((*ThreadDepthKeeper::getDepth()-1) * 2, ' ').c_str()); \
-        LOG("  %s(", depth_name.c_str());                                      \
-        LOG(__VA_ARGS__);                                                      \
-        LOG(") { ----%s:%d\n", FILENAME_, __LINE__);                           \
-        fflush(stderr);                                                        \
-        ThreadColor::getInstance().reset();                                    \
-      }                                                                        \
+    if (thread_depth_keeper.enabled()) {                                       \
+      gate                                                                     \
+      LOG_CALL_RECORD_(log_call_site_, thread_depth_keeper, __VA_ARGS__)       \
     }                                                                          \
   } while (0)
 
-// track the thread when enters a block of code
-#define LOG_SCOPE(...)                                                         \
-  ThreadDepthKeeper thread_depth_keeper;                                       \
+#define LOG_SCOPE_BODY_(gate, ...)                                             \
+  LOG_SITE_(log_scope_site_, "INFO");                                          \
+  static SiteLevel log_scope_level_ {log_scope_site_};                         \
+  ThreadDepthKeeper thread_depth_keeper(log_scope_site_,                       \
+                                        log_scope_level_.get() >= INFO_LEVEL); \
   do {                                                                         \
-    if (LogLevel::get() >= INFO_LEVEL) {                                       \
-      struct tm *now;                                                          \
-      struct timespec ts{};                                                    \
-      clock_gettime(CLOCK_REALTIME,&ts);                                       \
-      now = localtime(&ts.tv_sec);                                             \
-      {                                                                        \
-        std::scoped_lock l(PrintLock::get());                                  \
-        PRINT_PLAIN("INFO", "{\n")                                             \
-        LOG("%04d/%02d/%02d %02d:%02d:%02d:%03ld [%s][INFO]: ",                \
-            now->tm_year + 1900, now->tm_mon + 1, now->tm_mday,                \
-            now->tm_hour, now->tm_min, now->tm_sec,                            \
-            ts.tv_nsec/1000000, ModuleName);                                   \
-        ThreadColor::getInstance().set();                                      \
-        std::string depth_name;                                                \
-        thread_depth_keeper.setDepthName(depth_name);                          \
-        LOG("%d:%s", THREADID_,                                                \
-            std::string((*ThreadDepthKeeper::getDepth()-1) * 2, ' ').c_str()); \
-        LOG("    ");                                                           \
-        LOG(__VA_ARGS__);                                                      \
-        LOG("  ----%s:%d\n", FILENAME_, __LINE__);                             \
-        fflush(stderr);                                                        \
-        ThreadColor::getInstance().reset();                                    \
-      }                                                                        \
+    if (thread_depth_keeper.enabled()) {                                       \
+      gate                                                                     \
+      LOG_SCOPE_RECORD_(log_scope_site_, thread_depth_keeper, __VA_ARGS__)     \
     }                                                                          \
   } while (0)
 
-#define PRINT_PLAIN(type, ...)                                                     \
-    {                                                                              \
-        struct tm *now_;                                                           \
-        struct timespec ts_{};                                                     \
-        clock_gettime(CLOCK_REALTIME,&ts_);                                        \
-        now_ = localtime(&ts_.tv_sec);                                             \
-                                                                                   \
-        LOG("%04d/%02d/%02d %02d:%02d:%02d:%03ld [%s][%s]: ",                      \
-            now_->tm_year + 1900, now_->tm_mon + 1, now_->tm_mday,                 \
-            now_->tm_hour, now_->tm_min, now_->tm_sec,                             \
-            ts_.tv_nsec/1000000, ModuleName,type);                                 \
-                                                                                   \
-        ThreadColor::getInstance().set();                                          \
-                                                                                   \
-        LOG("%d:%s", THREADID_,                                                    \
-            std::string((*ThreadDepthKeeper::getDepth()) * 2, ' ').c_str());       \
-        LOG(__VA_ARGS__);                                                          \
-        fflush(stderr);                                                            \
-                                                                                   \
-        ThreadColor::getInstance().reset();                                        \
-}
+#define LOG_CALL_LIMIT_(check)                                                 \
+  LOG_LIMIT_("INFO", check, thread_depth_keeper.setSilent())
+
+#else
+// the arguments are named in sizeof() but never evaluated, so the parameters they would have logged stay used
+#define LOG_UNUSED_(...) do { (void) sizeof(std::forward_as_tuple(__VA_ARGS__)); } while (0)
+
+#define LOG_CALL_0(...) do {} while (0)
+#define LOG_CALL(...) LOG_UNUSED_(__VA_ARGS__)
+#define LOG_CALL_X(...) LOG_UNUSED_(__VA_ARGS__)
+#define LOG_SCOPE(...) LOG_UNUSED_(__VA_ARGS__)
+#define LOG_CALL_EVERY_N(...) LOG_UNUSED_(__VA_ARGS__)
+#define LOG_CALL_FIRST_N(...) LOG_UNUSED_(__VA_ARGS__)
+#define LOG_CALL_EVERY_MS(...) LOG_UNUSED_(__VA_ARGS__)
+#define LOG_CALL_RATELIMITED(...) LOG_UNUSED_(__VA_ARGS__)
+#define LOG_SCOPE_EVERY_N(...) LOG_UNUSED_(__VA_ARGS__)
+#define LOG_SCOPE_FIRST_N(...) LOG_UNUSED_(__VA_ARGS__)
+#define LOG_SCOPE_EVERY_MS(...) LOG_UNUSED_(__VA_ARGS__)
+#define LOG_SCOPE_RATELIMITED(...) LOG_UNUSED_(__VA_ARGS__)
+
+#endif
+
+// gate of the rate limited macros: a static LogLimit per call site is checked before anything is
+// formatted, a suppressed record leaves the enclosing do {} while (0)
+#define LOG_LIMIT_(type, check, on_suppress)                                   \
+  static LogLimit log_limit_;                                                  \
+  if (!(check)) {                                                              \
+    on_suppress;                                                               \
+    break;                                                                     \
+  }                                                                            \
+  {                                                                            \
+    LOG_SITE_(log_limit_site_, type);                                          \
+    log_limit_.report(log_limit_site_);                                        \
+  }
+
+#if LOG_FORMAT != LOG_FORMAT_TEXT
+
+#define PRINT_PLAIN(type, ...)                                                 \
+  {                                                                            \
+    begin_record(type, *ThreadDepthKeeper::getDepth());                        \
+    LOG(__VA_ARGS__);                                                          \
+    LOG_COMMIT();                                                              \
+  }
 
 #define PRINT(type, ...)                                                       \
   {                                                                            \
-    struct tm *now_;                                                            \
-    struct timespec ts_{};                                                      \
-    clock_gettime(CLOCK_REALTIME,&ts_);                                         \
-    now_ = localtime(&ts_.tv_sec);                                               \
-                                                                               \
-    LOG("%04d/%02d/%02d %02d:%02d:%02d:%03ld [%s][%s]: ",                      \
-        now_->tm_year + 1900, now_->tm_mon + 1, now_->tm_mday,                    \
-        now_->tm_hour, now_->tm_min, now_->tm_sec,                                \
-        ts_.tv_nsec/1000000, ModuleName,type);                                  \
-                                                                               \
-    ThreadColor::getInstance().set();                                          \
-                                                                               \
-    LOG("%d:%s  \"", THREADID_,                                                \
-            std::string((*ThreadDepthKeeper::getDepth()) * 2, ' ').c_str());   \
+    LOG_SITE_(log_print_site_, type);                                          \
+    LogRecord &record_ = begin_record(type, *ThreadDepthKeeper::getDepth());   \
+    append_site_fields(record_, log_print_site_);                              \
+    LOG_TRACE_(const size_t trace_from_ = record_.size();)                     \
     LOG(__VA_ARGS__);                                                          \
-    LOG("\" ----%s:%d\n", FILENAME_, __LINE__);                                \
-    fflush(stderr);                                                            \
-                                                                               \
-    ThreadColor::getInstance().reset();                                        \
+    LOG_TRACE_(TraceLog::instant(log_print_site_, record_.view(trace_from_));) \
+    LOG_COMMIT();                                                              \
   }
 
-#define LOG_ERROR(...)                                 \
-  do {                                                 \
-    if (LogLevel::get() >= ERROR_LEVEL) {              \
-      std::scoped_lock ll(PrintLock::get());           \
-      LOG("\e[31m");                                   \
-      PRINT("ERROR", __VA_ARGS__)                      \
-    }                                                  \
-  } while (0)
+#else
 
-#define LOG_WARN(...)                                  \
-  do {                                                 \
-    if (LogLevel::get() >= WARN_LEVEL) {               \
-      std::scoped_lock ll(PrintLock::get());           \
-      LOG("\e[33m");                                   \
-      PRINT("WARN", __VA_ARGS__)                       \
-    }                                                  \
-  } while (0)
+#define PRINT_PLAIN(type, ...)                                                 \
+  {                                                                            \
+    begin_record(type, *ThreadDepthKeeper::getDepth());                        \
+    LOG(__VA_ARGS__);                                                          \
+    ThreadColor::reset();                                                      \
+    LOG_COMMIT();                                                              \
+  }
 
-#define LOG_INFO(...)                                  \
-  do {                                                 \
-    if (LogLevel::get() >= INFO_LEVEL) {               \
-      std::scoped_lock ll(PrintLock::get());           \
-      PRINT("INFO", __VA_ARGS__)                       \
-    }                                                  \
-  } while (0)
+#define PRINT(type, ...)                                                       \
+  {                                                                            \
+    LOG_SITE_(log_print_site_, type);                                          \
+    LogRecord &record_ = begin_record(type, *ThreadDepthKeeper::getDepth());   \
+    record_.append_raw("  \"", 3);                                             \
+    LOG_TRACE_(const size_t trace_from_ = record_.size();)                     \
+    LOG(__VA_ARGS__);                                                          \
+    LOG_TRACE_(TraceLog::instant(log_print_site_, record_.view(trace_from_));) \
+    record_.append_raw("\" ----", 6);                                          \
+    record_.append_location(log_print_site_);                                  \
+    record_.append_raw("\n", 1);                                               \
+    ThreadColor::reset();                                                      \
+    LOG_COMMIT();                                                              \
+  }
 
-#define LOG_DBUG(...)                                  \
-  do {                                                 \
-    if (LogLevel::get() >= DEBUG_LEVEL) {              \
-      std::scoped_lock ll(PrintLock::get());           \
-      PRINT("DEBUG", __VA_ARGS__)                      \
-    }                                                  \
+#endif
+
+// per level record and threshold, LOG_EVERY_N(WARN, ...) etc. pick them by name
+#define LOG_ERROR_RECORD_(...) { LogRecord::get().append_color("\e[31m"); PRINT("ERROR", __VA_ARGS__) }
+#define LOG_WARN_RECORD_(...) { LogRecord::get().append_color("\e[33m"); PRINT("WARN", __VA_ARGS__) }
+#define LOG_INFO_RECORD_(...) LOG_PRINT_RECORD_("INFO", __VA_ARGS__)
+#define LOG_DBUG_RECORD_(...) LOG_PRINT_RECORD_("DEBUG", __VA_ARGS__)
+
+#define LOG_ERROR_LEVEL_ ERROR_LEVEL
+#define LOG_WARN_LEVEL_ WARN_LEVEL
+#define LOG_INFO_LEVEL_ INFO_LEVEL
+#define LOG_DBUG_LEVEL_ DEBUG_LEVEL
+
+#define LOG_ERROR_TYPE_ "ERROR"
+#define LOG_WARN_TYPE_ "WARN"
+#define LOG_INFO_TYPE_ "INFO"
+#define LOG_DBUG_TYPE_ "DEBUG"
+
+// if constexpr drops the whole statement, argument evaluation included,
+// otherwise checking the site's LogFilter level is one relaxed load
+#define LOG_LEVEL_(level, gate, ...)                                           \
+  do {                                                                         \
+    if constexpr (LOG_COMPILE_LEVEL >= LOG_##level##_LEVEL_) {                 \
+      LOG_SITE_(log_level_site_, LOG_##level##_TYPE_);                         \
+      static SiteLevel log_site_level_ {log_level_site_};                      \
+      if (log_site_level_.get() >= LOG_##level##_LEVEL_) {                     \
+        gate                                                                   \
+        LOG_##level##_RECORD_(__VA_ARGS__)                                     \
+      }                                                                        \
+    }                                                                          \
   } while (0)
 
+#define LOG_ERROR(...) LOG_LEVEL_(ERROR, , __VA_ARGS__)
+
+#define LOG_WARN(...) LOG_LEVEL_(WARN, , __VA_ARGS__)
+
+#define LOG_INFO(...) LOG_LEVEL_(INFO, , __VA_ARGS__)
+
+#define LOG_DBUG(...) LOG_LEVEL_(DBUG, , __VA_ARGS__)
+
+// rate limited records of any level, e.g. LOG_EVERY_MS(WARN, 1000, "backend down: %s", err)
+// logs every n-th call
+#define LOG_EVERY_N(level, n, ...)                                             \
+  LOG_LEVEL_(level, LOG_LIMIT_(LOG_##level##_TYPE_, log_limit_.every_n(n), ), __VA_ARGS__)
+
+// logs the first n calls only
+#define LOG_FIRST_N(level, n, ...)                                             \
+  LOG_LEVEL_(level, LOG_LIMIT_(LOG_##level##_TYPE_, log_limit_.first_n(n), ), __VA_ARGS__)
+
+// logs at most once per ms milliseconds
+#define LOG_EVERY_MS(level, ms, ...)                                           \
+  LOG_LEVEL_(level, LOG_LIMIT_(LOG_##level##_TYPE_, log_limit_.every_ms(ms), ), __VA_ARGS__)
+
+// token bucket, bursts of up to burst records refilled at per_sec records per second
+#define LOG_RATELIMITED(level, per_sec, burst, ...)                            \
+  LOG_LEVEL_(level, LOG_LIMIT_(LOG_##level##_TYPE_, log_limit_.ratelimited(per_sec, burst), ), __VA_ARGS__)
+
 #endif  // THREADLOG_H
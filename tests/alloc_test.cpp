@@ -0,0 +1,81 @@
+// a LOG_CALL renders its arguments without touching the heap: global operator new/delete are replaced
+// here and counted while LOG_CALLs with int, double, std::string, const char * and bool arguments run,
+// with INFO enabled and with it disabled
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+#include "ThreadLog.h"
+
+namespace {
+
+bool g_counting = false;
+int g_allocations = 0;
+int g_failures = 0;
+
+void *counted_alloc(size_t size) {
+    g_allocations += g_counting;
+    if (void *p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void call(int i, double d, const std::string &s, const char *c, bool b) {
+    LOG_CALL(i, d, s, c, b);
+}
+
+__attribute__((noinline)) void call_x(int i, double d, const std::string &s, const char *c, bool b) {
+    LOG_CALL_X("i:%d, d:%.2f, s:%s, c:%s, b:%d", i, d, s.c_str(), c, b);
+}
+
+template<typename F>
+void expect_no_allocations(const char *what, F &&log) {
+    g_allocations = 0;
+    g_counting = true;
+    for (int i = 0; i < 100; i++)
+        log(i);
+    g_counting = false;
+
+    const bool ok = g_allocations == 0;
+    printf("%s %s: %d allocations in 100 calls\n", ok ? "ok  " : "FAIL", what, g_allocations);
+    g_failures += !ok;
+}
+
+}  // namespace
+
+void *operator new(size_t size) { return counted_alloc(size); }
+void *operator new[](size_t size) { return counted_alloc(size); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+    g_allocations += g_counting;
+    return malloc(size ? size : 1);
+}
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+    g_allocations += g_counting;
+    return malloc(size ? size : 1);
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+int main() {
+    const std::string short_str = "four";
+    const std::string long_str(200, 'x'); // past the small string buffer
+
+    // thread locals, call sites and the log file are set up before anything is counted
+    call(0, 0.5, short_str, "c", true);
+    call_x(0, 0.5, short_str, "c", true);
+
+    expect_no_allocations("LOG_CALL", [&](int i) { call(i, i * 0.5, short_str, "literal", i & 1); });
+    expect_no_allocations("LOG_CALL long string", [&](int i) { call(i, -i * 1e9, long_str, long_str.c_str(), false); });
+    expect_no_allocations("LOG_CALL_X", [&](int i) { call_x(i, i * 0.5, short_str, "literal", i & 1); });
+
+    LogLevel::set(WARN_LEVEL);
+    expect_no_allocations("LOG_CALL disabled", [&](int i) { call(i, i * 0.5, long_str, "literal", i & 1); });
+    expect_no_allocations("LOG_CALL_X disabled", [&](int i) { call_x(i, i * 0.5, long_str, "literal", i & 1); });
+    LogLevel::set(DEBUG_LEVEL);
+
+    return g_failures == 0 ? 0 : 1;
+}
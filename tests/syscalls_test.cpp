@@ -0,0 +1,130 @@
+// every record is written with one write()/writev() per sink and never fflush()ed: write, writev and
+// fflush are wrapped here and counted while each kind of record is logged, with stderr and the file sink on;
+// a SocketSink sends each record with one sendmsg(), without color it gets the text with the escapes cut out
+
+#include <dlfcn.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <cstdio>
+#include <string>
+
+#include "ThreadLog.h"
+
+namespace {
+
+bool g_counting = false;
+int g_writes = 0;
+int g_flushes = 0;
+int g_failures = 0;
+
+template<typename F>
+F real(const char *name) {
+    return reinterpret_cast<F>(dlsym(RTLD_NEXT, name));
+}
+
+#if defined (SAVE_LOG_TO_FILE)
+constexpr int SINKS = 2;
+#else
+constexpr int SINKS = 1;
+#endif
+
+int g_sinks = SINKS;
+
+template<typename F>
+void expect_records(const char *what, int records, F &&log) {
+    g_writes = 0;
+    g_flushes = 0;
+    g_counting = true;
+    log();
+    g_counting = false;
+
+    const bool ok = g_writes == records * g_sinks && g_flushes == 0;
+    printf("%s %s: %d records, %d writes, %d fflush\n", ok ? "ok  " : "FAIL", what, records, g_writes, g_flushes);
+    g_failures += !ok;
+}
+
+void call_x(int a, float b) {
+    LOG_CALL_X("a:%d, b:%.1f", a, b);
+}
+
+void call(int a, const std::string &s) {
+    LOG_CALL(a, s);
+}
+
+}  // namespace
+
+extern "C" ssize_t write(int fd, const void *buf, size_t count) {
+    static auto write_ = real<ssize_t (*)(int, const void *, size_t)>("write");
+    g_writes += g_counting;
+    return write_(fd, buf, count);
+}
+
+extern "C" ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+    static auto writev_ = real<ssize_t (*)(int, const struct iovec *, int)>("writev");
+    g_writes += g_counting;
+    return writev_(fd, iov, iovcnt);
+}
+
+extern "C" ssize_t sendmsg(int fd, const struct msghdr *msg, int flags) {
+    static auto sendmsg_ = real<ssize_t (*)(int, const struct msghdr *, int)>("sendmsg");
+    g_writes += g_counting;
+    return sendmsg_(fd, msg, flags);
+}
+
+extern "C" int fflush(FILE *stream) {
+    static auto fflush_ = real<int (*)(FILE *)>("fflush");
+    g_flushes += g_counting;
+    return fflush_(stream);
+}
+
+int main() {
+    // opens the sinks, the log file and the thread's buffers before anything is counted
+    LOG_INFO("warm up");
+
+    expect_records("LOG_INFO", 1, [] { LOG_INFO("value %d of %s", 42, "answer"); });
+    expect_records("LOG_ERROR", 1, [] { LOG_ERROR("error %d", -1); });
+    expect_records("PRINT_PLAIN", 1, [] { PRINT_PLAIN("INFO", "plain %d", 7); });
+    expect_records("LOG_CALL_X and its exit", 2, [] { call_x(1, 2.5f); });
+    expect_records("LOG_CALL and its exit", 2, [] { call(3, "three"); });
+    expect_records("LOG_SCOPE", 1, [] {
+        LOG_SCOPE("scope %d", 1);
+        g_counting = false;
+    });
+    expect_records("ThreadDepthKeeper exit", 1, [] {
+        LOG_SCOPE("scope %d", 2);
+        g_writes = 0;
+    });
+
+    // the "{" line of LOG_SCOPE has the most escapes of any record, all of them cut out for the socket
+    const std::string path = "/tmp/threadlog_syscalls_test." + std::to_string(getpid()) + ".sock";
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(path.c_str());
+    if (fd < 0 || bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0) {
+        printf("FAIL SocketSink: socket() or bind() %s failed\n", path.c_str());
+        return 1;
+    }
+
+    LogSink &socket_sink = LogSinks::add(std::make_unique<SocketSink>(path.c_str()));
+    g_sinks = SINKS + 1;
+    expect_records("LOG_SCOPE with a SocketSink", 1, [] {
+        LOG_SCOPE("scope %d", 3);
+        g_counting = false;
+    });
+    LogSinks::remove(socket_sink);
+    g_sinks = SINKS;
+
+    char text[1024];
+    const ssize_t len = recv(fd, text, sizeof(text), MSG_DONTWAIT);
+    const std::string_view sent(text, len > 0 ? len : 0);
+    const bool ok = sent.find("scope 3") != std::string_view::npos && sent.find('\x1b') == std::string_view::npos;
+    printf("%s SocketSink text: %.*s", ok ? "ok  " : "FAIL", (int) sent.size(), sent.data());
+    g_failures += !ok;
+    close(fd);
+    unlink(path.c_str());
+
+    return g_failures == 0 ? 0 : 1;
+}
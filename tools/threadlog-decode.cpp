@@ -0,0 +1,525 @@
+// renders a LOG_BINARY log file back into the text PRINT, LOG_CALL_X and LOG_SCOPE write
+//
+// usage: threadlog-decode [--no-color] [FILE...]
+//        reads stdin when no file is given, files are decoded in the given order,
+//        e.g. threadlog-decode /tmp/MyModule.log.2 /tmp/MyModule.log.1 /tmp/MyModule.log
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "ThreadLog.h"
+
+namespace {
+
+bool g_color = true;
+
+struct Site {
+    uint8_t event;
+    uint32_t line;
+    std::string type, file, func, fmt;
+};
+
+struct Session {
+    uint8_t precision {LOG_TIME_PRECISION};
+    int32_t utc_offset {0};
+    std::string module {ModuleName};
+    std::unordered_map<uint32_t, Site> sites;
+};
+
+struct Arg {
+    uint8_t tag;
+    unsigned long long u {0};
+    long double ld {0};
+    std::string s;
+};
+
+class Reader {
+public:
+    Reader(const char *p, size_t n) : m_p(p), m_end(p + n) {
+    }
+
+    template<typename T>
+    T get() {
+        T v{};
+        if (m_end - m_p < (ptrdiff_t) sizeof(T)) {
+            m_ok = false;
+            return v;
+        }
+        memcpy(&v, m_p, sizeof(T));
+        m_p += sizeof(T);
+        return v;
+    }
+
+    std::string bytes(size_t n) {
+        if ((size_t) (m_end - m_p) < n) {
+            m_ok = false;
+            return {};
+        }
+        std::string s(m_p, n);
+        m_p += n;
+        return s;
+    }
+
+    std::string str16() { return bytes(get<uint16_t>()); }
+
+    bool ok() const { return m_ok; }
+
+    bool done() const { return m_p >= m_end; }
+
+private:
+    const char *m_p;
+    const char *m_end;
+    bool m_ok {true};
+};
+
+std::vector<Arg> read_args(Reader &r) {
+    std::vector<Arg> args;
+
+    while (!r.done()) {
+        Arg a {};
+        a.tag = r.get<uint8_t>();
+
+        switch (a.tag) {
+            case BinaryLog::ArgInt32:
+                a.u = (unsigned long long) (long long) r.get<int32_t>();
+                break;
+            case BinaryLog::ArgUint32:
+                a.u = r.get<uint32_t>();
+                break;
+            case BinaryLog::ArgInt64:
+            case BinaryLog::ArgUint64:
+            case BinaryLog::ArgPointer:
+                a.u = r.get<uint64_t>();
+                break;
+            case BinaryLog::ArgDouble:
+                a.ld = r.get<double>();
+                break;
+            case BinaryLog::ArgLongDouble:
+                a.ld = r.get<long double>();
+                break;
+            case BinaryLog::ArgString:
+                a.s = r.bytes(r.get<uint32_t>());
+                break;
+            default:
+                return args;
+        }
+
+        if (!r.ok())
+            break;
+        args.push_back(std::move(a));
+    }
+
+    return args;
+}
+
+// printf() with the stored arguments, length modifiers are re-derived from the stored types
+std::string format(const std::string &fmt, const std::vector<Arg> &args) {
+    std::string out;
+    size_t next = 0;
+    char buf[512];
+
+    auto take = [&]() -> const Arg * { return next < args.size() ? &args[next++] : nullptr; };
+
+    for (size_t i = 0; i < fmt.size(); i++) {
+        if (fmt[i] != '%') {
+            out += fmt[i];
+            continue;
+        }
+
+        if (i + 1 < fmt.size() && fmt[i + 1] == '%') {
+            out += '%';
+            i++;
+            continue;
+        }
+
+        const size_t start = i;
+        std::string spec = "%";
+        size_t j = i + 1;
+        std::vector<int> stars;
+
+        while (j < fmt.size() && strchr("-+ #0'", fmt[j]))
+            spec += fmt[j++];
+        if (j < fmt.size() && fmt[j] == '*') {
+            const Arg *a = take();
+            stars.push_back(a ? (int) a->u : 0);
+            spec += '*';
+            j++;
+        }
+        while (j < fmt.size() && isdigit((unsigned char) fmt[j]))
+            spec += fmt[j++];
+        if (j < fmt.size() && fmt[j] == '.') {
+            spec += fmt[j++];
+            if (j < fmt.size() && fmt[j] == '*') {
+                const Arg *a = take();
+                stars.push_back(a ? (int) a->u : 0);
+                spec += '*';
+                j++;
+            }
+            while (j < fmt.size() && isdigit((unsigned char) fmt[j]))
+                spec += fmt[j++];
+        }
+
+        std::string length;
+        while (j < fmt.size() && strchr("hlLqjzt", fmt[j]))
+            length += fmt[j++];
+
+        if (j >= fmt.size()) {
+            out += fmt.substr(i);
+            break;
+        }
+
+        const char conv = fmt[j];
+        i = j;
+
+        if (conv == 'n')
+            continue;
+
+        const Arg *a = take();
+        if (a == nullptr) {
+            // fewer arguments than conversions, keep the conversion as written
+            out += fmt.substr(start, j - start + 1);
+            continue;
+        }
+
+        int n = 0;
+        auto print = [&](auto v, const char *len) {
+            std::string f = spec + len + conv;
+            if (stars.size() == 2)
+                n = snprintf(buf, sizeof(buf), f.c_str(), stars[0], stars[1], v);
+            else if (stars.size() == 1)
+                n = snprintf(buf, sizeof(buf), f.c_str(), stars[0], v);
+            else
+                n = snprintf(buf, sizeof(buf), f.c_str(), v);
+        };
+
+        const bool narrow = a->tag == BinaryLog::ArgInt32 || a->tag == BinaryLog::ArgUint32;
+
+        switch (conv) {
+            case 'd':
+            case 'i': {
+                long long v = (long long) a->u;
+                if (length == "hh")
+                    v = (signed char) v;
+                else if (length == "h")
+                    v = (short) v;
+                else if (narrow)
+                    v = (int) v;
+                print(v, "ll");
+                break;
+            }
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X': {
+                unsigned long long v = a->u;
+                if (length == "hh")
+                    v = (unsigned char) v;
+                else if (length == "h")
+                    v = (unsigned short) v;
+                else if (narrow)
+                    v = (unsigned int) v;
+                print(v, "ll");
+                break;
+            }
+            case 'c':
+                print((int) a->u, "");
+                break;
+            case 'e':
+            case 'E':
+            case 'f':
+            case 'F':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+                if (a->tag == BinaryLog::ArgLongDouble)
+                    print(a->ld, "L");
+                else
+                    print((double) a->ld, "");
+                break;
+            case 's':
+                print(a->s.c_str(), "");
+                break;
+            case 'p':
+                print((void *) (uintptr_t) a->u, "");
+                break;
+            default:
+                n = 0;
+                break;
+        }
+
+        if (n > 0)
+            out.append(buf, std::min<size_t>(n, sizeof(buf) - 1));
+    }
+
+    return out;
+}
+
+std::string strip_colors(const std::string &text) {
+    std::string out;
+    for (size_t i = 0; i < text.size(); i++) {
+        if (text[i] == '\033' && i + 1 < text.size() && text[i + 1] == '[') {
+            i += 2;
+            while (i < text.size() && !isalpha((unsigned char) text[i]))
+                i++;
+            continue;
+        }
+        out += text[i];
+    }
+    return out;
+}
+
+class Printer {
+public:
+    explicit Printer(const Session &s) : m_s(s) {
+    }
+
+    // "2024/01/31 12:00:00:000 [ModuleName][type]:"
+    std::string prefix(int64_t ns, const std::string &type) const {
+        time_t sec = (time_t) (ns / 1000000000) + m_s.utc_offset;
+        const int precision = std::min<int>(m_s.precision, 9); // a damaged header can hold any byte
+        long frac = (long) (ns % 1000000000);
+        for (int i = precision; i < 9; i++)
+            frac /= 10;
+
+        struct tm t{};
+        gmtime_r(&sec, &t);
+
+        // room for every field at its widest, six ints and a fraction of up to 10 chars
+        char buf[6 * 11 + 6 + 10 + 1];
+        snprintf(buf, sizeof(buf), "%04d/%02d/%02d %02d:%02d:%02d:%0*ld",
+                 t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec,
+                 precision, frac);
+        return std::string(buf) + " [" + m_s.module + "][" + type + "]:";
+    }
+
+    std::string start(int64_t ns, const std::string &type, int32_t tid, uint8_t color, int indent) const {
+        return prefix(ns, type) + " " + (g_color ? ThreadColor::code(color) : "") +
+               std::to_string(tid) + ":" + std::string(std::max(indent, 0) * 2, ' ');
+    }
+
+    static const char *reset() { return g_color ? "\033[0m" : ""; }
+
+private:
+    const Session &m_s;
+};
+
+void print_event(const Session &s, Reader &r) {
+    const uint32_t id = r.get<uint32_t>();
+    const int64_t ns = r.get<int64_t>();
+    const int32_t tid = r.get<int32_t>();
+    const int depth = r.get<uint16_t>();
+    const uint8_t color = r.get<uint8_t>();
+    if (!r.ok())
+        return;
+
+    auto it = s.sites.find(id);
+    if (it == s.sites.end()) {
+        printf("<threadlog-decode: unknown site %u>\n", id);
+        return;
+    }
+
+    const Site &site = it->second;
+    const std::string body = format(site.fmt, read_args(r));
+    const std::string location = site.file + ":" + std::to_string(site.line);
+    const Printer p(s);
+
+    switch (site.event) {
+        case BinaryLog::EventPrint:
+            printf("%s  \"%s\" ----%s\n%s", p.start(ns, site.type, tid, color, depth).c_str(),
+                   body.c_str(), location.c_str(), Printer::reset());
+            break;
+        case BinaryLog::EventCall:
+            printf("%s  %s(%s) { ----%s\n%s", p.start(ns, site.type, tid, color, depth - 1).c_str(),
+                   site.func.c_str(), body.c_str(), location.c_str(), Printer::reset());
+            break;
+        case BinaryLog::EventScope:
+            printf("%s{\n%s", p.start(ns, site.type, tid, color, depth).c_str(), Printer::reset());
+            printf("%s    %s  ----%s\n%s", p.start(ns, site.type, tid, color, depth - 1).c_str(),
+                   body.c_str(), location.c_str(), Printer::reset());
+            break;
+        default:
+            break;
+    }
+}
+
+void print_exit(const Session &s, Reader &r) {
+    const int64_t ns = r.get<int64_t>();
+    const int32_t tid = r.get<int32_t>();
+    const int depth = r.get<uint16_t>();
+    const uint8_t color = r.get<uint8_t>();
+    const std::string name = r.str16();
+    if (!r.ok())
+        return;
+
+    // written by LOG_PROFILE builds only
+    std::string elapsed;
+    if (!r.done()) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), " (%.3f ms)", r.get<int64_t>() / 1e6);
+        elapsed = buf;
+    }
+
+    const Printer p(s);
+    printf("%s  } %s%s\n%s", p.start(ns, "INFO", tid, color, depth - 1).c_str(), name.c_str(), elapsed.c_str(),
+           Printer::reset());
+    if (depth == 1)
+        printf("%s\n", p.prefix(ns, "INFO").c_str());
+}
+
+struct Frame {
+    uint8_t kind;
+    const char *payload;
+    uint32_t size;
+};
+
+// frames of one file, stops at a truncated tail
+std::vector<Frame> split_frames(const std::vector<char> &data) {
+    std::vector<Frame> frames;
+    size_t pos = 0;
+
+    while (pos + BinaryLog::FRAME_HEADER_SIZE <= data.size()) {
+        Frame f {(uint8_t) data[pos], nullptr, 0};
+        memcpy(&f.size, &data[pos + 1], sizeof(f.size));
+        pos += BinaryLog::FRAME_HEADER_SIZE;
+
+        if (f.kind < BinaryLog::FrameHeader || f.kind > BinaryLog::FrameExit || f.size > data.size() - pos) {
+            fprintf(stderr, "threadlog-decode: corrupt frame at offset %zu\n", pos - BinaryLog::FRAME_HEADER_SIZE);
+            break;
+        }
+
+        f.payload = &data[pos];
+        frames.push_back(f);
+        pos += f.size;
+    }
+
+    return frames;
+}
+
+void read_header(Session &s, const Frame &f) {
+    Reader r(f.payload, f.size);
+    const std::string magic = r.bytes(sizeof(BinaryLog::MAGIC));
+    if (magic != std::string(BinaryLog::MAGIC, sizeof(BinaryLog::MAGIC))) {
+        fprintf(stderr, "threadlog-decode: bad header\n");
+        return;
+    }
+    s.precision = r.get<uint8_t>();
+    s.utc_offset = r.get<int32_t>();
+    s.module = r.str16();
+}
+
+void read_site(Session &s, const Frame &f) {
+    Reader r(f.payload, f.size);
+    const uint32_t id = r.get<uint32_t>();
+    Site site;
+    site.event = r.get<uint8_t>();
+    site.line = r.get<uint32_t>();
+    site.type = r.str16();
+    site.file = r.str16();
+    site.func = r.str16();
+    site.fmt = r.str16();
+    if (r.ok())
+        s.sites[id] = std::move(site);
+}
+
+void decode(const std::vector<char> &data) {
+    const std::vector<Frame> frames = split_frames(data);
+
+    // a FrameHeader starts a new process session, its sites may be defined after their first use
+    for (size_t begin = 0; begin < frames.size();) {
+        size_t end = begin + 1;
+        while (end < frames.size() && frames[end].kind != BinaryLog::FrameHeader)
+            end++;
+
+        Session s;
+        for (size_t i = begin; i < end; i++) {
+            if (frames[i].kind == BinaryLog::FrameHeader)
+                read_header(s, frames[i]);
+            else if (frames[i].kind == BinaryLog::FrameSite)
+                read_site(s, frames[i]);
+        }
+
+        for (size_t i = begin; i < end; i++) {
+            Reader r(frames[i].payload, frames[i].size);
+
+            switch (frames[i].kind) {
+                case BinaryLog::FrameText: {
+                    std::string text(frames[i].payload, frames[i].size);
+                    if (!g_color)
+                        text = strip_colors(text);
+                    fwrite(text.data(), 1, text.size(), stdout);
+                    break;
+                }
+                case BinaryLog::FrameEvent:
+                    print_event(s, r);
+                    break;
+                case BinaryLog::FrameExit:
+                    print_exit(s, r);
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        begin = end;
+    }
+}
+
+bool read_file(FILE *f, std::vector<char> &data) {
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        data.insert(data.end(), buf, buf + n);
+    return !ferror(f);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    std::vector<const char *> files;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--no-color") == 0) {
+            g_color = false;
+        } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            printf("usage: %s [--no-color] [FILE...]\n", argv[0]);
+            return 0;
+        } else {
+            files.push_back(argv[i]);
+        }
+    }
+
+    if (files.empty()) {
+        std::vector<char> data;
+        if (!read_file(stdin, data)) {
+            fprintf(stderr, "threadlog-decode: read stdin failed!\n");
+            return 1;
+        }
+        decode(data);
+        return 0;
+    }
+
+    int ret = 0;
+    for (const char *name : files) {
+        FILE *f = fopen(name, "rb");
+        if (f == nullptr) {
+            fprintf(stderr, "threadlog-decode: fopen() %s failed!\n", name);
+            ret = 1;
+            continue;
+        }
+
+        std::vector<char> data;
+        if (!read_file(f, data)) {
+            fprintf(stderr, "threadlog-decode: read %s failed!\n", name);
+            ret = 1;
+        }
+        fclose(f);
+
+        decode(data);
+    }
+
+    return ret;
+}
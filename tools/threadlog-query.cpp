@@ -0,0 +1,260 @@
+// prints the records of a log file and its rotated files that match a thread, a time range and a level,
+// skipping the blocks the LOG_INDEX .idx files rule out and scanning the rest of the mmap()ed files
+//
+// usage: threadlog-query [--tid N] [--from TIME] [--to TIME] [--level TYPE] [--color] [--stats] [FILE]
+//        TIME is "2024/01/31 12:00:00:000" or a prefix of it down to the day, --to takes all of its period;
+//        TYPE is ERROR, WARN, INFO or DEBUG and takes it and the more severe levels; color escapes are left
+//        out unless --color is given; FILE defaults to LOG_FILE and is read after FILE.N ... FILE.1[.gz],
+//        e.g. threadlog-query --tid 4242 --from "2024/01/31 12:00" --to "2024/01/31 12:30" --level WARN
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <endian.h>
+
+#include "ThreadLog.h"
+
+namespace {
+
+struct Query {
+    bool by_tid {false};
+    int tid {0};
+    int64_t from_ns {INT64_MIN};
+    int64_t to_ns {INT64_MAX};
+    int level {DEBUG_LEVEL};
+    bool color {false};
+
+    bool takes(const LogIndex::Record &r) const {
+        return r.ns >= from_ns && r.ns <= to_ns && r.level <= level && (!by_tid || r.tid == tid);
+    }
+
+    bool may_take(const LogIndex::Block &b) const {
+        return b.max_ns >= from_ns && b.min_ns <= to_ns && (b.levels & ((2u << level) - 1)) != 0 &&
+               (!by_tid || LogIndex::may_have_tid(b.tids, tid));
+    }
+};
+
+struct Stats {
+    unsigned long long files {0}, files_skipped {0}, blocks {0}, blocks_skipped {0};
+    unsigned long long bytes {0}, records {0};
+};
+
+Query g_query;
+Stats g_stats;
+std::string g_out;
+
+void flush_out() {
+    fwrite(g_out.data(), 1, g_out.size(), stdout);
+    g_out.clear();
+}
+
+void put_line(const char *line, size_t len) {
+    std::string_view s(line, len);
+    size_t at = 0;
+    while (!g_query.color && at < s.size()) {
+        const size_t esc = s.find('\x1b', at);
+        if (esc == std::string_view::npos)
+            break;
+        g_out.append(s.data() + at, esc - at);
+        const size_t n = LogIndex::escape_len(s, esc);
+        at = esc + (n ? n : 1);
+    }
+    if (at < s.size())
+        g_out.append(s.data() + at, s.size() - at);
+    g_out.push_back('\n');
+
+    if (g_out.size() >= (1 << 20))
+        flush_out();
+}
+
+// continuation lines go with the record before them, lines before the first record are left out
+void scan(const char *data, size_t from, size_t to) {
+    bool taking = false;
+    g_stats.bytes += to - from;
+    LogIndex::for_each_line(data, from, to, [&](size_t offset, size_t len, const LogIndex::Record *r) {
+        if (r != nullptr) {
+            taking = g_query.takes(*r);
+            g_stats.records += taking;
+        }
+        if (taking)
+            put_line(data + offset, len);
+    });
+}
+
+// data holds all of the file the index idx_name, when there is one, was built from
+void query(const std::string &idx_name, const char *data, size_t size) {
+    // a LOG_FILE_MMAP file that is still written has a zero tail
+    while (size > 0 && data[size - 1] == '\0')
+        size--;
+
+    LogIndex::Header h;
+    std::vector<LogIndex::Block> blocks;
+    if (!LogIndex::read(idx_name, h, blocks) || h.file_size != size) {
+        scan(data, 0, size);
+        return;
+    }
+
+    for (const LogIndex::Block &b : blocks) {
+        g_stats.blocks++;
+        if (!g_query.may_take(b)) {
+            g_stats.blocks_skipped++;
+            continue;
+        }
+        scan(data, b.offset, b.offset + b.size);
+    }
+}
+
+// false if the file can not be read, a missing one is not an error
+bool query_file(const std::string &name) {
+    int fd = open(name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno == ENOENT;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "threadlog-query: fstat() %s failed!\n", name.c_str());
+        close(fd);
+        return false;
+    }
+
+    g_stats.files++;
+    const size_t size = st.st_size;
+    if (size == 0) {
+        close(fd);
+        return true;
+    }
+
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "threadlog-query: mmap() %s failed!\n", name.c_str());
+        return false;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    query(name + ".idx", static_cast<const char *>(map), size);
+    munmap(map, size);
+    return true;
+}
+
+// the index, if it is there, decides whether the file is decompressed at all
+bool query_gz(const std::string &name, const std::string &idx_name) {
+    FILE *f = fopen(name.c_str(), "rb");
+    if (f == nullptr)
+        return errno == ENOENT;
+
+    // the gzip trailer ends with the size of the data mod 2^32
+    uint32_t isize = 0;
+    const bool sized = fseek(f, -4, SEEK_END) == 0 && fread(&isize, 1, sizeof(isize), f) == sizeof(isize);
+    fclose(f);
+    g_stats.files++;
+
+    LogIndex::Header h;
+    std::vector<LogIndex::Block> blocks;
+    if (sized && LogIndex::read(idx_name, h, blocks) && (uint32_t) h.file_size == le32toh(isize) &&
+        std::none_of(blocks.begin(), blocks.end(), [](const LogIndex::Block &b) { return g_query.may_take(b); })) {
+        g_stats.files_skipped++;
+        g_stats.blocks += blocks.size();
+        g_stats.blocks_skipped += blocks.size();
+        return true;
+    }
+
+#if defined (LOG_ZLIB)
+    gzFile gz = gzopen(name.c_str(), "rb");
+    if (gz == nullptr) {
+        fprintf(stderr, "threadlog-query: gzopen() %s failed!\n", name.c_str());
+        return false;
+    }
+    gzbuffer(gz, 1 << 17);
+
+    std::string data;
+    for (;;) {
+        const size_t at = data.size();
+        data.resize(at + (1 << 20));
+        const int n = gzread(gz, &data[at], 1 << 20);
+        if (n < 0) {
+            fprintf(stderr, "threadlog-query: gzread() %s failed!\n", name.c_str());
+            gzclose(gz);
+            return false;
+        }
+        data.resize(at + n);
+        if (n == 0)
+            break;
+    }
+    gzclose(gz);
+
+    query(idx_name, data.data(), data.size());
+    return true;
+#else
+    fprintf(stderr, "threadlog-query: %s skipped, built without zlib (zcat it into a file to query it)\n",
+            name.c_str());
+    return true;
+#endif
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    std::string path = LOG_FILE;
+    bool stats = false;
+
+    for (int i = 1; i < argc; i++) {
+        const bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--tid") == 0 && has_value) {
+            g_query.by_tid = true;
+            g_query.tid = atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "--from") == 0 || strcmp(argv[i], "--to") == 0) && has_value) {
+            const bool to = strcmp(argv[i], "--to") == 0;
+            int64_t ns = 0, unit = 0;
+            if (!LogIndex::parse_time(argv[++i], ns, &unit)) {
+                fprintf(stderr, "threadlog-query: bad time \"%s\", expected \"YYYY/MM/DD[ HH[:MM[:SS[:fraction]]]]\"\n",
+                        argv[i]);
+                return 1;
+            }
+            (to ? g_query.to_ns : g_query.from_ns) = to ? ns + unit - 1 : ns;
+        } else if (strcmp(argv[i], "--level") == 0 && has_value) {
+            g_query.level = LogIndex::level_of(argv[++i]);
+            if (g_query.level == INFO_LEVEL && strcmp(argv[i], "INFO") != 0) {
+                fprintf(stderr, "threadlog-query: bad level \"%s\", expected ERROR, WARN, INFO or DEBUG\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--color") == 0) {
+            g_query.color = true;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats = true;
+        } else if (argv[i][0] == '-') {
+            printf("usage: %s [--tid N] [--from TIME] [--to TIME] [--level TYPE] [--color] [--stats] [FILE]\n",
+                   argv[0]);
+            return strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0 ? 0 : 1;
+        } else {
+            path = argv[i];
+        }
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+
+    int last = 0;
+    while (access((path + "." + std::to_string(last + 1)).c_str(), F_OK) == 0 ||
+           access((path + "." + std::to_string(last + 1) + ".gz").c_str(), F_OK) == 0)
+        last++;
+
+    int ret = 0;
+    for (int i = last; i >= 1; i--) {
+        const std::string name = path + "." + std::to_string(i);
+        if (!query_file(name) || !query_gz(name + ".gz", name + ".idx"))
+            ret = 1;
+    }
+    if (!query_file(path))
+        ret = 1;
+    flush_out();
+
+    if (stats) {
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        fprintf(stderr, "threadlog-query: %llu files (%llu skipped), %llu of %llu indexed blocks skipped, "
+                        "%llu bytes scanned, %llu records matched in %.1f ms\n",
+                g_stats.files, g_stats.files_skipped, g_stats.blocks_skipped, g_stats.blocks, g_stats.bytes,
+                g_stats.records, ms);
+    }
+    return ret;
+}
@@ -0,0 +1,62 @@
+// writes the LOG_SHARED ring of a log file for processes built with LOG_SHARED_ELECT 0
+//
+// usage: threadlog-writerd [--unlink] [FILE]
+//        FILE defaults to LOG_FILE and must be the LOG_FILE the processes were built with,
+//        runs until SIGINT or SIGTERM; a second writerd waits and takes over when the first one exits.
+//        --unlink removes the shared memory ring after a clean exit, for a shutdown where no process
+//        logs to FILE any more; without it the ring stays in /dev/shm for the next run
+
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+
+#include "ThreadLog.h"
+
+namespace {
+
+std::atomic<bool> g_stop {false};
+
+void on_signal(int) {
+    g_stop = true;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    const char *path = LOG_FILE;
+    bool unlink_ring = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--unlink") == 0) {
+            unlink_ring = true;
+            continue;
+        }
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            printf("usage: %s [--unlink] [FILE]\n", argv[0]);
+            return 0;
+        }
+        path = argv[i];
+    }
+
+    // no SA_RESTART, a writerd blocked in flock() behind another one returns from it to stop
+    struct sigaction sa {};
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    SharedLog log(path, LOG_SHARED_RING_SIZE, false);
+    if (!log.shared()) {
+        fprintf(stderr, "threadlog-writerd: %s has no shared ring!\n", path);
+        return 1;
+    }
+
+    log.serve(g_stop);
+
+    if (unlink_ring && !log.unlink_ring())
+        return 1;
+
+    if (log.dropped() != 0)
+        fprintf(stderr, "threadlog-writerd: %llu runs of records were dropped\n", (unsigned long long) log.dropped());
+    return 0;
+}
@@ -0,0 +1,331 @@
+// measures what a log call costs: latency percentiles, ns per operation and records/sec
+// of every workload at 1, 2, 4 ... N threads, one CSV row (or JSON line) per run on stdout
+//
+// usage: threadlog_bench [--ops N] [--threads N] [--sink NAME] [--workload PREFIX] [--json]
+//        --ops      operations per thread and run, default 20000
+//        --threads  largest thread count, default std::thread::hardware_concurrency()
+//        --workload only run the workloads whose name starts with PREFIX, e.g. "prefix_"
+//        --sink     only run one sink: "stderr+file" or "file" (stderr sink at OFF_LEVEL);
+//                   threadlog_bench_nofile is built with -DLOG_NO_FILE, its sinks are "stderr" and "none"
+//                   threadlog_bench_mmap writes the same file sink through -DLOG_FILE_MMAP
+//                   threadlog_bench_shared writes it through the -DLOG_SHARED ring
+//                   threadlog_bench_coarse and threadlog_bench_tsc stamp records from another LOG_CLOCK
+//        stderr is measured wherever it points, e.g. threadlog_bench 2>/tmp/bench.err
+//
+// latencies include one clock_gettime() per operation, LOG_ASYNC runs are timed until the rings are drained
+// lock_wait_share is the time threads spent blocked on PrintLock or queued behind a group commit batch of
+// LOG_FILE, as a share of threads * wall time
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "ThreadLog.h"
+
+namespace {
+
+struct Workload {
+    const char *name;
+    int records; // records written per operation in text mode
+    int level;   // LogLevel while the workload runs
+    void (*op)(int i);
+};
+
+struct Result {
+    const char *sink;
+    const Workload *workload;
+    int threads;
+    int ops;
+    double wall_ns;
+    double mean_ns;
+    uint64_t p50_ns, p99_ns, p999_ns;
+    double lock_wait_share;
+};
+
+const std::string g_str = "four";
+
+__attribute__((noinline)) void call4(int a, double b, const std::string &c, bool d) {
+    LOG_CALL(a, b, c, d);
+}
+
+__attribute__((noinline)) void nested(int depth) {
+    LOG_CALL_X("depth %d", depth);
+    if (depth > 1)
+        nested(depth - 1);
+}
+
+const Workload g_workloads[] = {
+    {"info", 1, INFO_LEVEL, [](int i) { LOG_INFO("bench record %d of %s", i, "threadlog_bench"); }},
+    {"dbug_filtered", 0, INFO_LEVEL, [](int i) { LOG_DBUG("bench record %d", i); }},
+    {"call4", 2, INFO_LEVEL, [](int i) { call4(i, i * 0.5, g_str, i & 1); }},
+    {"scope", 2, INFO_LEVEL, [](int i) { LOG_SCOPE("bench scope %d", i); }},
+    {"nested8", 16, INFO_LEVEL, [](int) { nested(8); }},
+    // the same record formatted by vsnprintf() and by the compile time checked LOG() format, nothing is written
+    {"format_vsnprintf", 0, INFO_LEVEL, [](int i) {
+        LogRecord &record = LogRecord::get();
+        record.append("bench record %d of %s, %.3f ms, id %08x\n", i, "threadlog_bench", i * 0.25, (unsigned) i);
+        record.clear();
+    }},
+    {"format_checked", 0, INFO_LEVEL, [](int i) {
+        LOG("bench record %d of %s, %.3f ms, id %08x\n", i, "threadlog_bench", i * 0.25, (unsigned) i);
+        LogRecord::get().clear();
+    }},
+    // the record timestamp rendered as every record did before LogTimestamp, by clock_gettime(), localtime_r()
+    // and snprintf(), and by LogTimestamp from the build's LOG_CLOCK (see the threadlog_bench_coarse and
+    // threadlog_bench_tsc targets), nothing is written
+    {"prefix_localtime", 0, INFO_LEVEL, [](int) {
+        char out[64];
+        struct timespec ts{};
+        clock_gettime(CLOCK_REALTIME, &ts);
+        struct tm now{};
+        localtime_r(&ts.tv_sec, &now);
+        long fraction = ts.tv_nsec;
+        for (int digits = 9; digits > LOG_TIME_PRECISION; digits--)
+            fraction /= 10;
+        snprintf(out, sizeof(out), "%04d/%02d/%02d %02d:%02d:%02d:%0*ld", now.tm_year + 1900, now.tm_mon + 1,
+                 now.tm_mday, now.tm_hour, now.tm_min, now.tm_sec, LOG_TIME_PRECISION, fraction);
+        asm volatile("" : : "r"(out) : "memory");
+    }},
+    {"prefix_cached", 0, INFO_LEVEL, [](int) {
+        char out[LogTimestamp::SIZE];
+        LogTimestamp::get().format(out);
+        asm volatile("" : : "r"(out) : "memory");
+    }},
+};
+
+uint64_t now_ns() {
+    struct timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+const char *clock_name() {
+#if LOG_CLOCK == LOG_CLOCK_REALTIME_COARSE
+    return "+coarse";
+#elif LOG_CLOCK == LOG_CLOCK_TSC
+    return "+tsc";
+#else
+    return "";
+#endif
+}
+
+const char *mode_base() {
+#if LOG_FORMAT == LOG_FORMAT_JSON && defined (LOG_ASYNC)
+    return "async+json";
+#elif LOG_FORMAT == LOG_FORMAT_JSON
+    return "json";
+#elif LOG_FORMAT == LOG_FORMAT_LOGFMT && defined (LOG_ASYNC)
+    return "async+logfmt";
+#elif LOG_FORMAT == LOG_FORMAT_LOGFMT
+    return "logfmt";
+#elif defined (LOG_ASYNC) && defined (LOG_BINARY)
+    return "async+binary";
+#elif defined (LOG_ASYNC)
+    return "async";
+#elif defined (LOG_BINARY)
+    return "binary";
+#elif defined (LOG_FILE_MMAP)
+    return "mmap";
+#elif defined (LOG_SHARED)
+    return "shared";
+#else
+    return "sync";
+#endif
+}
+
+// e.g. "async+json", with the LOG_CLOCK when it is not CLOCK_REALTIME: "sync+tsc"
+const char *mode_name() {
+    static const std::string name = std::string(mode_base()) + clock_name();
+    return name.c_str();
+}
+
+// ns writers spent queued behind another writer's group commit batch of LOG_FILE
+uint64_t commit_wait_ns() {
+#if defined (SAVE_LOG_TO_FILE) && !defined (LOG_SHARED)
+    return LogFile::get_instance().stats().commit_wait_ns;
+#else
+    return 0;
+#endif
+}
+
+void flush_log() {
+#if defined (LOG_ASYNC)
+    AsyncLog::get_instance().flush();
+#endif
+}
+
+uint64_t percentile(const std::vector<uint32_t> &sorted, double q) {
+    if (sorted.empty())
+        return 0;
+    return sorted[std::min(sorted.size() - 1, (size_t) (q * sorted.size()))];
+}
+
+Result run(const char *sink, const Workload &w, int threads, int ops) {
+    std::vector<std::vector<uint32_t>> latencies(threads);
+    std::vector<std::thread> workers;
+    std::atomic<int> ready {0};
+    std::atomic<bool> go {false};
+
+    LogLevel::set(w.level);
+
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            std::vector<uint32_t> &lat = latencies[t];
+            lat.resize(ops);
+
+            // thread locals and the first records are not timed
+            for (int i = 0; i < std::min(ops, 1000); i++)
+                w.op(i);
+
+            ready++;
+            while (!go.load(std::memory_order_acquire))
+                std::this_thread::yield();
+
+            for (int i = 0; i < ops; i++) {
+                const uint64_t start = now_ns();
+                w.op(i);
+                lat[i] = (uint32_t) std::min<uint64_t>(now_ns() - start, UINT32_MAX);
+            }
+        });
+    }
+
+    while (ready.load() != threads)
+        std::this_thread::yield();
+
+    flush_log();
+    PrintLock::wait_ns().store(0);
+    const uint64_t commit_wait_start = commit_wait_ns();
+    const uint64_t start = now_ns();
+    go.store(true, std::memory_order_release);
+
+    for (auto &worker : workers)
+        worker.join();
+    flush_log();
+    const uint64_t wall = now_ns() - start;
+    const uint64_t wait = PrintLock::wait_ns().load() + commit_wait_ns() - commit_wait_start;
+
+    LogLevel::set(DEBUG_LEVEL);
+
+    std::vector<uint32_t> all;
+    all.reserve((size_t) threads * ops);
+    for (auto &lat : latencies)
+        all.insert(all.end(), lat.begin(), lat.end());
+    std::sort(all.begin(), all.end());
+
+    double sum = 0;
+    for (uint32_t v : all)
+        sum += v;
+
+    Result r {};
+    r.sink = sink;
+    r.workload = &w;
+    r.threads = threads;
+    r.ops = ops;
+    r.wall_ns = (double) wall;
+    r.mean_ns = all.empty() ? 0 : sum / all.size();
+    r.p50_ns = percentile(all, 0.5);
+    r.p99_ns = percentile(all, 0.99);
+    r.p999_ns = percentile(all, 0.999);
+    r.lock_wait_share = wall ? (double) wait / ((double) wall * threads) : 0;
+    return r;
+}
+
+void print_header(bool json) {
+    if (json)
+        return;
+    printf("mode,sink,workload,threads,ops,records_per_op,wall_ms,ops_per_sec,records_per_sec,"
+           "mean_ns,p50_ns,p99_ns,p999_ns,lock_wait_share\n");
+}
+
+void print_result(const Result &r, bool json) {
+    const double total = (double) r.ops * r.threads;
+    const double ops_per_sec = r.wall_ns > 0 ? total * 1e9 / r.wall_ns : 0;
+    const double records_per_sec = ops_per_sec * r.workload->records;
+
+    if (json) {
+        printf("{\"mode\":\"%s\",\"sink\":\"%s\",\"workload\":\"%s\",\"threads\":%d,\"ops\":%d,"
+               "\"records_per_op\":%d,\"wall_ms\":%.3f,\"ops_per_sec\":%.0f,\"records_per_sec\":%.0f,"
+               "\"mean_ns\":%.1f,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"lock_wait_share\":%.4f}\n",
+               mode_name(), r.sink, r.workload->name, r.threads, r.ops, r.workload->records, r.wall_ns / 1e6,
+               ops_per_sec, records_per_sec, r.mean_ns, (unsigned long long) r.p50_ns,
+               (unsigned long long) r.p99_ns, (unsigned long long) r.p999_ns, r.lock_wait_share);
+    } else {
+        printf("%s,%s,%s,%d,%d,%d,%.3f,%.0f,%.0f,%.1f,%llu,%llu,%llu,%.4f\n",
+               mode_name(), r.sink, r.workload->name, r.threads, r.ops, r.workload->records, r.wall_ns / 1e6,
+               ops_per_sec, records_per_sec, r.mean_ns, (unsigned long long) r.p50_ns,
+               (unsigned long long) r.p99_ns, (unsigned long long) r.p999_ns, r.lock_wait_share);
+    }
+    fflush(stdout);
+}
+
+// runs every workload named only_workload* and thread count with the stderr sink on or off
+void run_sink(const char *sink, bool quiet_stderr, int max_threads, int ops, const char *only_workload, bool json) {
+    LogSink &err = LogSinks::stderr_sink();
+    const int level = err.level();
+
+    if (quiet_stderr)
+        err.set_level(OFF_LEVEL);
+
+    for (const Workload &w : g_workloads) {
+        if (strncmp(w.name, only_workload, strlen(only_workload)) != 0)
+            continue;
+        for (int threads = 1;; threads = std::min(threads * 2, max_threads)) {
+            print_result(run(sink, w, threads, ops), json);
+            if (threads == max_threads)
+                break;
+        }
+    }
+
+    flush_log();
+    err.set_level(level);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    int ops = 20000;
+    int max_threads = std::max(1u, std::thread::hardware_concurrency());
+    const char *only_sink = nullptr;
+    const char *only_workload = "";
+    bool json = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc) {
+            ops = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            max_threads = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--sink") == 0 && i + 1 < argc) {
+            only_sink = argv[++i];
+        } else if (strcmp(argv[i], "--workload") == 0 && i + 1 < argc) {
+            only_workload = argv[++i];
+        } else if (strcmp(argv[i], "--json") == 0) {
+            json = true;
+        } else {
+            printf("usage: %s [--ops N] [--threads N] [--sink NAME] [--workload PREFIX] [--json]\n", argv[0]);
+            return strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0 ? 0 : 1;
+        }
+    }
+
+#if defined (SAVE_LOG_TO_FILE)
+    const char *loud = "stderr+file", *quiet = "file";
+#else
+    const char *loud = "stderr", *quiet = "none";
+#endif
+
+    if (only_sink && strcmp(only_sink, loud) != 0 && strcmp(only_sink, quiet) != 0) {
+        fprintf(stderr, "threadlog_bench: unknown sink %s, this build has %s and %s\n", only_sink, loud, quiet);
+        return 1;
+    }
+
+    print_header(json);
+
+    if (!only_sink || strcmp(only_sink, loud) == 0)
+        run_sink(loud, false, max_threads, ops, only_workload, json);
+
+    if (!only_sink || strcmp(only_sink, quiet) == 0)
+        run_sink(quiet, true, max_threads, ops, only_workload, json);
+
+    return 0;
+}